@@ -10,7 +10,7 @@ macx {
 macx {
     LIBS = -framework CoreFoundation -framework IOKit -liconv
 } else {
-    LIBS = -lpthread -ludev
+    LIBS = -lpthread -ludev -lm
 }
 
 QMAKE_CFLAGS += -std=c99 -Wno-unused-parameter -Werror=implicit
@@ -44,7 +44,8 @@ SOURCES += \
     keyboard_de.c \
     keyboard_fr.c \
     extra_mac.c \
-    keyboard_es.c
+    keyboard_es.c \
+    keypos.c
 
 HEADERS += \
     device.h \
@@ -59,4 +60,5 @@ HEADERS += \
     structures.h \
     usb.h \
     firmware.h \
-    profile.h
+    profile.h \
+    keypos.h
@@ -42,6 +42,92 @@ usbprofile* addstore(const char* serial, int autosetup){
     return res;
 }
 
+// Disconnected devices, kept so that they can be restored quickly after a resume
+typedef struct {
+    char serial[SERIAL_LEN];
+    hwprofile* hw;
+    char active;
+    // Whether the device was disconnected shortly after a resume
+    char afterresume;
+    // Total suspend time when the device was disconnected
+    long long suspendtime;
+} parkeddev;
+static parkeddev* parked = 0;
+static int parkedcount = 0;
+
+// Time of the last resume (CLOCK_MONOTONIC) and the total suspend time when last checked
+static struct timespec resumetime;
+static long long lastsuspend = -1;
+// Number of resumes seen so far
+static int resumecount = 0;
+
+// Whether a resume was seen in the last RESUME_WINDOW seconds
+static int recentresume(){
+    if(!resumetime.tv_sec && !resumetime.tv_nsec)
+        return 0;
+    struct timespec window;
+    clock_gettime(CLOCK_MONOTONIC, &window);
+    window.tv_sec -= RESUME_WINDOW;
+    return timespec_gt(resumetime, window);
+}
+
+void checkresume(){
+    // The suspend time only increases when the system sleeps
+    long long suspend = os_suspendtime();
+    if(lastsuspend >= 0 && suspend - lastsuspend >= RESUME_MIN){
+        printf("System resumed\n");
+        clock_gettime(CLOCK_MONOTONIC, &resumetime);
+        resumecount++;
+    }
+    lastsuspend = suspend;
+}
+
+int lastresume(){
+    checkresume();
+    return recentresume() ? resumecount : 0;
+}
+
+void parkdevice(const char* serial, hwprofile* hw, int active){
+    checkresume();
+    parkeddev* dev = 0;
+    for(int i = 0; i < parkedcount; i++){
+        if(!strcmp(parked[i].serial, serial)){
+            dev = parked + i;
+            free(dev->hw);
+            break;
+        }
+    }
+    if(!dev){
+        parked = realloc(parked, ++parkedcount * sizeof(parkeddev));
+        dev = parked + parkedcount - 1;
+        strcpy(dev->serial, serial);
+    }
+    dev->hw = hw;
+    dev->active = active;
+    dev->afterresume = recentresume();
+    dev->suspendtime = os_suspendtime();
+}
+
+hwprofile* unparkdevice(const char* serial, int* active){
+    checkresume();
+    for(int i = 0; i < parkedcount; i++){
+        parkeddev* dev = parked + i;
+        if(strcmp(dev->serial, serial))
+            continue;
+        // Only restore the device if it went away because of the suspend, either just before or just after it
+        hwprofile* hw = dev->hw;
+        if(!hw || !recentresume() || !(dev->afterresume || os_suspendtime() - dev->suspendtime >= RESUME_MIN)){
+            free(hw);
+            hw = 0;
+        }
+        *active = dev->active;
+        memmove(dev, dev + 1, (parkedcount - i - 1) * sizeof(parkeddev));
+        parkedcount--;
+        return hw;
+    }
+    return 0;
+}
+
 // Per-key input settings and hardware actions
 // 0x80 generates a normal HID interrupt, 0x40 generates a proprietary interrupt. 0xc0 generates both.
 // The exceptions are the proprietary Corsair keys, which only report HID input in BIOS mode and only report Corsair input in non-BIOS mode.
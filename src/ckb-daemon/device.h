@@ -28,4 +28,18 @@ usbprofile* findstore(const char* serial);
 // Add a USB device to storage. Returns an existing device if found or a new one if not.
 usbprofile* addstore(const char* serial, int autosetup);
 
+// Devices which disconnect and come back shortly after a system resume are restored from memory instead of being set up
+// from scratch. The in-memory profile is authoritative, so the hardware profile doesn't need to be read again.
+#define RESUME_MIN      1000000000LL    // Minimum suspend time which counts as a resume (ns)
+#define RESUME_WINDOW   30              // Seconds after a resume during which devices are restored quickly
+// Checks whether the system has resumed from suspend since the last call. Called from the main loop.
+void checkresume();
+// Returns a number identifying the last resume if it happened within RESUME_WINDOW seconds, or 0 if there wasn't one
+int lastresume();
+// Keeps the hardware profile and state of a disconnected device. Takes ownership of hw.
+void parkdevice(const char* serial, hwprofile* hw, int active);
+// Gets the saved hardware profile for a device if it's reconnecting after a resume (ownership passes to the caller).
+// Returns 0 if it isn't, in which case the device should be set up normally. Active is set to the device's previous state.
+hwprofile* unparkdevice(const char* serial, int* active);
+
 #endif
@@ -318,29 +318,199 @@ unsigned readlines(int fd, const char** input){
     }
 }
 
-void readcmd(usbdevice* kb, const char* line){
-    char* word = malloc(strlen(line) + 1);
+// Compiled command cache. Clients tend to send the same lines over and over (key bindings, static lighting), so lines which
+// only contain commands that depend on nothing but the line itself and the device's current mode are compiled into a list of
+// operations and replayed from the cache the next time they're seen.
+#define CMDCACHE_SIZE   16
+#define CMDCACHE_MAXOPS 1024
+#define CMDOP_STRLEN    16
+
+typedef enum {
+    OP_MODE,        // Select a mode (arg = mode index)
+    OP_SWITCH,      // Switch to the selected mode
+    OP_UPDATEMOD,   // Update the selected mode's modification number
+    OP_RGBON,
+    OP_RGBOFF,
+    OP_RGB,         // Set an LED color (arg = LED index)
+    OP_HANDLER      // Run a command handler (arg = key index)
+} cmdoptype;
+
+typedef struct {
+    cmdhandler handler;
+    char type;
+    char nnumber;
+    short arg;
+    uchar r, g, b;
+    char str[CMDOP_STRLEN];
+} cmdop;
+
+typedef struct {
+    // Source line and the key map it was compiled against. A null line indicates an empty slot
+    char* line;
+    int linelen;
+    unsigned hash;
+    const key* keymap;
+    // Compiled operations. Compilation is abandoned if the line contains anything that can't be replayed
+    cmdop* ops;
+    int opcount, opcap;
+    char invalid;
+    unsigned lastused;
+} cmdentry;
+
+struct cmdcache {
+    cmdentry entry[CMDCACHE_SIZE];
+    // Hashes of recently missed lines. A line is only compiled once it's been seen twice, so a stream of unique lines
+    // (such as an animation) doesn't push everything else out of the cache
+    unsigned seen[CMDCACHE_SIZE];
+    int seenpos;
+    unsigned clock;
+    unsigned hits, misses;
+};
+
+void freecmdcache(usbdevice* kb){
+    struct cmdcache* cache = kb->cmdcache;
+    if(!cache)
+        return;
+    for(int i = 0; i < CMDCACHE_SIZE; i++){
+        free(cache->entry[i].line);
+        free(cache->entry[i].ops);
+    }
+    free(cache);
+    kb->cmdcache = 0;
+}
+
+void cmdcachestats(usbdevice* kb, unsigned* hits, unsigned* misses){
+    *hits = kb->cmdcache ? kb->cmdcache->hits : 0;
+    *misses = kb->cmdcache ? kb->cmdcache->misses : 0;
+}
+
+// FNV-1a hash
+static unsigned cmdhash(const char* line, int length){
+    unsigned hash = 2166136261u;
+    for(int i = 0; i < length; i++){
+        hash ^= (uchar)line[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Adds an operation to a line being compiled
+static cmdop* addop(cmdentry* compile, cmdoptype type){
+    if(!compile || compile->invalid)
+        return 0;
+    if(compile->opcount >= CMDCACHE_MAXOPS){
+        compile->invalid = 1;
+        return 0;
+    }
+    if(compile->opcount == compile->opcap){
+        compile->opcap = compile->opcap ? compile->opcap * 2 : 64;
+        compile->ops = realloc(compile->ops, compile->opcap * sizeof(cmdop));
+    }
+    cmdop* op = compile->ops + compile->opcount++;
+    memset(op, 0, sizeof(cmdop));
+    op->type = type;
+    return op;
+}
+
+// Runs a command handler and records it
+static void runhandler(cmdentry* compile, cmdhandler handler, usbdevice* kb, usbmode* mode, const key* keymap, int notifynumber, int keyindex, const char* arg){
+    handler(kb, mode, keymap, notifynumber, keyindex, arg);
+    if(!compile || compile->invalid)
+        return;
+    if(handler == cmd_rgb){
+        // Colors are parsed ahead of time and stored by LED
+        int led = keymap[keyindex].led;
+        uchar r, g, b;
+        if(led < 0 || sscanf(arg, "%2hhx%2hhx%2hhx", &r, &g, &b) != 3)
+            return;
+        cmdop* op = addop(compile, OP_RGB);
+        if(!op)
+            return;
+        op->arg = led;
+        op->r = r;
+        op->g = g;
+        op->b = b;
+        return;
+    }
+    if(strlen(arg) >= CMDOP_STRLEN){
+        compile->invalid = 1;
+        return;
+    }
+    cmdop* op = addop(compile, OP_HANDLER);
+    if(!op)
+        return;
+    op->handler = handler;
+    op->nnumber = notifynumber;
+    op->arg = keyindex;
+    strcpy(op->str, arg);
+}
+
+// Switches a device to the selected mode
+static void switchmode(usbdevice* kb, usbprofile* profile, usbmode* mode){
+    profile->currentmode = mode;
+    // Set mode light for non-RGB K95
+    int index = INDEX_OF(mode, profile->mode) % 3;
+    switch(index){
+    case 0:
+        nk95cmd(kb, NK95_M1);
+        break;
+    case 1:
+        nk95cmd(kb, NK95_M2);
+        break;
+    case 2:
+        nk95cmd(kb, NK95_M3);
+        break;
+    }
+}
+
+// Replays a compiled line
+static void runops(usbdevice* kb, const cmdentry* entry){
+    usbprofile* profile = &kb->profile;
+    const key* keymap = profile->keymap;
+    usbmode* mode = profile->currentmode;
+    for(int i = 0; i < entry->opcount; i++){
+        const cmdop* op = entry->ops + i;
+        switch(op->type){
+        case OP_MODE:
+            mode = getusbmode(op->arg, profile, keymap);
+            break;
+        case OP_SWITCH:
+            switchmode(kb, profile, mode);
+            break;
+        case OP_UPDATEMOD:
+            updatemod(&mode->id);
+            break;
+        case OP_RGBON:
+            cmd_rgbon(kb, mode);
+            break;
+        case OP_RGBOFF:
+            cmd_rgboff(kb, mode);
+            break;
+        case OP_RGB:
+            mode->light.r[op->arg] = op->r;
+            mode->light.g[op->arg] = op->g;
+            mode->light.b[op->arg] = op->b;
+            break;
+        case OP_HANDLER:
+            op->handler(kb, mode, keymap, op->nnumber, op->arg, op->str);
+            break;
+        }
+    }
+}
+
+// Reads a single line of commands. If compile is non-null, the line's operations will be recorded to it.
+// Returns 0 on success or -1 if the device was closed.
+static int readcmdline(usbdevice* kb, const char* line, char* word, cmdentry* compile){
     int wordlen;
-    const char* newline = 0;
     usbprofile* profile = (IS_CONNECTED(kb) ? &kb->profile : 0);
     const key* keymap = (profile ? profile->keymap : keymap_system);
-    usbmode* mode = 0;
+    usbmode* mode = (profile ? profile->currentmode : 0);
     cmd command = NONE;
     cmdhandler handler = 0;
     int notifynumber = 0;
     // Read words from the input
     while(sscanf(line, "%s%n", word, &wordlen) == 1){
         line += wordlen;
-        // If we passed a newline, reset the context
-        if(line > newline){
-            mode = (profile ? profile->currentmode : 0);
-            command = NONE;
-            handler = 0;
-            notifynumber = 0;
-            newline = strchr(line, '\n');
-            if(!newline)
-                newline = line + strlen(line);
-        }
         // Check for a command word
         if(!strcmp(word, "mode")){
             command = MODE;
@@ -410,9 +580,29 @@ void readcmd(usbdevice* kb, const char* line){
         } else if(!strcmp(word, "rgb")){
             command = RGB;
             handler = cmd_rgb;
+            if(mode){
+                updatemod(&mode->id);
+                addop(compile, OP_UPDATEMOD);
+            }
+            continue;
+        } else if(!strcmp(word, "draw")){
+            command = DRAW;
+            handler = 0;
             if(mode)
                 updatemod(&mode->id);
             continue;
+        } else if(!strcmp(word, "brightness")){
+            command = BRIGHTNESS;
+            handler = 0;
+            continue;
+        } else if(!strcmp(word, "gamma")){
+            command = GAMMA;
+            handler = 0;
+            continue;
+        } else if(!strcmp(word, "dim")){
+            command = DIM;
+            handler = 0;
+            continue;
         } else if(!strcmp(word, "ioff")){
             command = IOFF;
             handler = cmd_ioff;
@@ -463,6 +653,11 @@ void readcmd(usbdevice* kb, const char* line){
                 || (kb && ((!HAS_FEATURES(kb, FEAT_BIND) && (command == BIND || command == UNBIND || command == REBIND || command == MACRO))
                            || (!HAS_FEATURES(kb, FEAT_NOTIFY) && command == NOTIFY))))
             continue;
+        // Only mode selection, lighting, bindings, and notifications can be replayed from the cache
+        if(compile && command != MODE && command != SWITCH && command != RGB
+                && command != BIND && command != UNBIND && command != REBIND
+                && command != IOFF && command != ION && command != IAUTO && command != NOTIFY && command != INOTIFY)
+            compile->invalid = 1;
         // Reject anything other than fwupdate if device has a bricked FW
         if(NEEDS_FW_UPDATE(kb) && command != FWUPDATE && command != NOTIFYON && command != NOTIFYOFF)
             continue;
@@ -525,43 +720,30 @@ void readcmd(usbdevice* kb, const char* line){
         case MODE: {
             // Mode selection processes a number
             int newmode;
-            if(sscanf(word, "%u", &newmode) == 1 && newmode > 0 && newmode <= MODE_MAX)
+            if(sscanf(word, "%u", &newmode) == 1 && newmode > 0 && newmode <= MODE_MAX){
                 mode = getusbmode(newmode - 1, profile, keymap);
+                cmdop* op = addop(compile, OP_MODE);
+                if(op)
+                    op->arg = newmode - 1;
+            }
             continue;
         } case SWITCH:
-            profile->currentmode = mode;
-            // Set mode light for non-RGB K95
-            int index = INDEX_OF(mode, profile->mode) % 3;
-            switch(index){
-            case 0:
-                nk95cmd(kb, NK95_M1);
-                break;
-            case 1:
-                nk95cmd(kb, NK95_M2);
-                break;
-            case 2:
-                nk95cmd(kb, NK95_M3);
-                break;
-            }
+            switchmode(kb, profile, mode);
+            addop(compile, OP_SWITCH);
             continue;
         case HWLOAD:
-            // Try to load the profile from hardware. Reset on failure, disconnect if reset fails.
-            while(hwloadprofile(kb, 1)){
-                if(usb_tryreset(kb)){
-                    closeusb(kb);
-                    free(word);
-                    return;
-                }
+            // Try to load the profile from hardware. On failure, reset the device from the main loop
+            if(hwloadprofile(kb, 1)){
+                printf("Warning: Hardware load failed\n");
+                usb_needreset(kb);
             }
             continue;
         case HWSAVE:
-            // Save the profile to hardware. Reset on failure
-            while(hwsaveprofile(kb)){
-                if(usb_tryreset(kb)){
-                    closeusb(kb);
-                    free(word);
-                    return;
-                }
+            // Save the profile to hardware. On failure, reset the device from the main loop
+            if(hwsaveprofile(kb)){
+                printf("Warning: Hardware save failed\n");
+                usb_needreset(kb);
+                continue;
             }
             // Re-send the current RGB state as the save sometimes scrambles it
             updatergb(kb, 1);
@@ -577,7 +759,7 @@ void readcmd(usbdevice* kb, const char* line){
             continue;
         case NAME: case IOFF: case ION: case IAUTO: case INOTIFY:
             // All of the above just parse the whole word
-            handler(kb, mode, keymap, notifynumber, 0, word);
+            runhandler(compile, handler, kb, mode, keymap, notifynumber, 0, word);
             continue;
         case PROFILENAME:
             // Profile name is the same, but takes a different parameter
@@ -595,18 +777,45 @@ void readcmd(usbdevice* kb, const char* line){
             if(!setid(&profile->id, word) && sscanf(word, "%08x", &newmodified) == 1)
                 memcpy(profile->id.modified, &newmodified, sizeof(newmodified));
             continue;
-        } case RGB: {
+        } case DRAW:
+            // Draw commands parse the whole word
+            if(cmd_draw(kb, mode, keymap, word))
+                printf("Warning: Invalid draw command %s\n", word);
+            continue;
+        case BRIGHTNESS:
+            // Brightness, gamma, and dimming apply to the whole device and parse the whole word
+            if(cmd_brightness(kb, word))
+                printf("Warning: Invalid brightness %s\n", word);
+            continue;
+        case GAMMA:
+            if(cmd_gamma(kb, word))
+                printf("Warning: Invalid gamma %s\n", word);
+            continue;
+        case DIM:
+            if(cmd_dim(kb, keymap, word))
+                printf("Warning: Invalid dim command %s\n", word);
+            continue;
+        case RGB: {
             // RGB command has a special response for "on", "off", and a hex constant
             int r, g, b;
             if(!strcmp(word, "on")){
                 cmd_rgbon(kb, mode);
+                addop(compile, OP_RGBON);
                 continue;
             } else if(!strcmp(word, "off")){
                 cmd_rgboff(kb, mode);
+                addop(compile, OP_RGBOFF);
                 continue;
             } else if(sscanf(word, "%02x%02x%02x", &r, &g, &b) == 3){
                 for(int i = 0; i < N_KEYS; i++)
-                    cmd_rgb(kb, mode, keymap, notifynumber, i, word);
+                    runhandler(compile, cmd_rgb, kb, mode, keymap, notifynumber, i, word);
+                continue;
+            } else if(word[0] == '@'){
+                // Packed bulk update. This is already cheap to parse, so it isn't cached
+                if(compile)
+                    compile->invalid = 1;
+                if(cmd_rgbbulk(kb, mode, keymap, word + 1))
+                    printf("Warning: Invalid bulk RGB data\n");
                 continue;
             }
         } case MACRO:
@@ -618,12 +827,7 @@ void readcmd(usbdevice* kb, const char* line){
             break;
         case FWUPDATE:
             // FW update also parses a whole word
-            if(cmd_fwupdate(kb, notifynumber, word)){
-                // If the USB device failed, close it
-                closeusb(kb);
-                free(word);
-                return;
-            }
+            cmd_fwupdate(kb, notifynumber, word);
             continue;
         default:
             break;
@@ -650,16 +854,16 @@ void readcmd(usbdevice* kb, const char* line){
             if(!strcmp(keyname, "all")){
                 // Set all keys
                 for(int i = 0; i < N_KEYS; i++)
-                    handler(kb, mode, keymap, notifynumber, i, right);
+                    runhandler(compile, handler, kb, mode, keymap, notifynumber, i, right);
             } else if((sscanf(keyname, "#%d", &keycode) && keycode >= 0 && keycode < N_KEYS)
                       || (sscanf(keyname, "#x%x", &keycode) && keycode >= 0 && keycode < N_KEYS)){
                 // Set a key numerically
-                handler(kb, mode, keymap, notifynumber, keycode, right);
+                runhandler(compile, handler, kb, mode, keymap, notifynumber, keycode, right);
             } else {
                 // Find this key in the keymap
                 for(unsigned i = 0; i < N_KEYS; i++){
                     if(keymap[i].name && !strcmp(keyname, keymap[i].name)){
-                        handler(kb, mode, keymap, notifynumber, i, right);
+                        runhandler(compile, handler, kb, mode, keymap, notifynumber, i, right);
                         break;
                     }
                 }
@@ -668,9 +872,98 @@ void readcmd(usbdevice* kb, const char* line){
                 position++;
         }
     }
+    return 0;
+}
+
+// Looks up a line in the cache. Returns the entry if found or null if not
+static cmdentry* findcmd(struct cmdcache* cache, const key* keymap, const char* line, int length, unsigned hash){
+    for(int i = 0; i < CMDCACHE_SIZE; i++){
+        cmdentry* entry = cache->entry + i;
+        if(entry->line && entry->hash == hash && entry->keymap == keymap && entry->linelen == length && !memcmp(entry->line, line, length))
+            return entry;
+    }
+    return 0;
+}
+
+// Gets a slot to compile a new line into, evicting the least recently used entry if needed
+static cmdentry* newcmd(struct cmdcache* cache, const key* keymap, const char* line, int length, unsigned hash){
+    cmdentry* entry = cache->entry;
+    for(int i = 1; i < CMDCACHE_SIZE && entry->line; i++){
+        if(!cache->entry[i].line || cache->entry[i].lastused < entry->lastused)
+            entry = cache->entry + i;
+    }
+    free(entry->line);
+    entry->line = malloc(length);
+    memcpy(entry->line, line, length);
+    entry->linelen = length;
+    entry->hash = hash;
+    entry->keymap = keymap;
+    entry->opcount = 0;
+    entry->invalid = 0;
+    entry->lastused = ++cache->clock;
+    return entry;
+}
+
+void readcmd(usbdevice* kb, const char* line){
+    // Make a copy of the input so it can be split into lines
+    char* lines = strdup(line);
+    char* word = malloc(strlen(line) + 1);
+    char* next = lines;
+    while(next){
+        char* newline = strchr(next, '\n');
+        if(newline)
+            *newline = 0;
+        int length = strlen(next);
+        cmdentry* entry = 0;
+        // The cache is only used for active devices; anything else goes through the full parser
+        if(length > 0 && IS_CONNECTED(kb) && kb->active && !NEEDS_FW_UPDATE(kb)){
+            if(!kb->cmdcache)
+                kb->cmdcache = calloc(1, sizeof(struct cmdcache));
+            struct cmdcache* cache = kb->cmdcache;
+            const key* keymap = kb->profile.keymap;
+            unsigned hash = cmdhash(next, length);
+            entry = findcmd(cache, keymap, next, length, hash);
+            if(entry){
+                entry->lastused = ++cache->clock;
+                if(!entry->invalid){
+                    // Cache hit: replay the compiled ops
+                    cache->hits++;
+                    runops(kb, entry);
+                    next = newline ? newline + 1 : 0;
+                    continue;
+                }
+                // Known to be uncacheable, parse it normally
+                entry = 0;
+            } else {
+                // Compile the line if it's been seen recently
+                int seen = 0;
+                for(int i = 0; i < CMDCACHE_SIZE; i++){
+                    if(cache->seen[i] == hash){
+                        seen = 1;
+                        break;
+                    }
+                }
+                if(seen)
+                    entry = newcmd(cache, keymap, next, length, hash);
+                else {
+                    cache->seen[cache->seenpos] = hash;
+                    cache->seenpos = (cache->seenpos + 1) % CMDCACHE_SIZE;
+                }
+            }
+            cache->misses++;
+        }
+        if(length > 0 && readcmdline(kb, next, word, entry)){
+            // Device was closed (along with its cache)
+            free(word);
+            free(lines);
+            return;
+        }
+        next = newline ? newline + 1 : 0;
+    }
 
     // Finish up
     if(!NEEDS_FW_UPDATE(kb))
         updatergb(kb, 0);
     free(word);
+    free(lines);
 }
@@ -60,6 +60,10 @@ typedef enum {
 
     FPS,
     RGB,
+    DRAW,
+    BRIGHTNESS,
+    GAMMA,
+    DIM,
     IOFF,
     ION,
     IAUTO,
@@ -76,5 +80,9 @@ typedef void (*cmdhandler)(usbdevice*, usbmode*, const key*, int, int, const cha
 
 // Reads input from the command FIFO
 void readcmd(usbdevice* kb, const char* line);
+// Frees a device's compiled command cache
+void freecmdcache(usbdevice* kb);
+// Gets the number of command lines that were/weren't found in the cache
+void cmdcachestats(usbdevice* kb, unsigned* hits, unsigned* misses);
 
 #endif
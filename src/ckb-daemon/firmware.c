@@ -171,17 +171,11 @@ int fwupdate(usbdevice* kb, const char* path, int nnumber){
     return FW_OK;
 }
 
-int cmd_fwupdate(usbdevice* kb, int nnumber, const char* path){
+void cmd_fwupdate(usbdevice* kb, int nnumber, const char* path){
     if(!HAS_FEATURES(kb, FEAT_FWUPDATE))
-        return 0;
+        return;
     // Update the firmware
     int ret = fwupdate(kb, path, nnumber);
-    while(ret == FW_USBFAIL){
-        // Try to reset the device if it fails
-        if(usb_tryreset(kb))
-            break;
-        ret = fwupdate(kb, path, nnumber);
-    }
     switch(ret){
     case FW_OK:
         nprintf(kb, nnumber, 0, "fwupdate %s ok\n", path);
@@ -191,8 +185,9 @@ int cmd_fwupdate(usbdevice* kb, int nnumber, const char* path){
         nprintf(kb, nnumber, 0, "fwupdate %s invalid\n", path);
         break;
     case FW_USBFAIL:
+        // Reset the device from the main loop (which disconnects it if that fails too). The update can be retried afterwards
         nprintf(kb, nnumber, 0, "fwupdate %s fail\n", path);
-        return -1;
+        usb_needreset(kb);
+        break;
     }
-    return 0;
 }
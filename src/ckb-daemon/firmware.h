@@ -7,7 +7,7 @@
 int getfwversion(usbdevice* kb);
 
 // Updates firmware with data at the specified path. Prints notifications on success/failure.
-// Returns 0 if the device is ok or -1 if it needs to be removed.
-int cmd_fwupdate(usbdevice* kb, int nnumber, const char* path);
+// If the device fails, it's reset from the main loop (see usb_needreset).
+void cmd_fwupdate(usbdevice* kb, int nnumber, const char* path);
 
 #endif
@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #include <iconv.h>
 #include <locale.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -0,0 +1,152 @@
+#include "keypos.h"
+
+// Normal size
+#define NS 12, 12
+
+typedef struct {
+    const char* name;
+    short x, y, width, height;
+} keyposinit;
+
+// Key positions on the K95. Coordinates are the center of each key.
+// Copied from K95PosUS/K95PosGB (ckb/keymap_us.cpp, keymap_gb.cpp) and K65TopRow (ckb/keymap.cpp); keep them in sync.
+static const keyposinit k95pos[] = {
+    { "mr", 38, 0, NS }, { "m1", 50, 0, NS }, { "m2", 62, 0, NS }, { "m3", 74, 0, NS }, { "light", 222, 0, NS }, { "lock", 234, 0, NS }, { "mute", 273, 0, 13, 8 }, { "volup", 290, -2, 18, 6 }, { "voldn", 290, 2, 18, 6 },
+    { "g1", 0, 14, NS }, { "g2", 11, 14, NS }, { "g3", 22, 14, NS }, { "esc", 38, 14, NS }, { "f1", 58, 14, NS }, { "f2", 70, 14, NS }, { "f3", 82, 14, NS }, { "f4", 94, 14, NS }, { "f5", 114, 14, NS }, { "f6", 126, 14, NS }, { "f7", 138, 14, NS }, { "f8", 150, 14, NS }, { "f9", 170, 14, NS }, { "f10", 182, 14, NS }, { "f11", 194, 14, NS }, { "f12", 206, 14, NS }, { "prtscn", 222, 14, NS }, { "scroll", 234, 14, NS }, { "pause", 246, 14, NS }, { "stop", 262, 14, 12, 8 }, { "prev", 273, 14, 13, 8 }, { "play", 285, 14, 13, 8 }, { "next", 296, 14, 12, 8 },
+    { "g4", 0, 25, NS }, { "g5", 11, 25, NS }, { "g6", 22, 25, NS }, { "grave", 38, 27, NS }, { "1", 50, 27, NS }, { "2", 62, 27, NS }, { "3", 74, 27, NS }, { "4", 86, 27, NS }, { "5", 98, 27, NS }, { "6", 110, 27, NS }, { "7", 122, 27, NS }, { "8", 134, 27, NS }, { "9", 146, 27, NS }, { "0", 158, 27, NS }, { "minus", 170, 27, NS }, { "equal", 182, 27, NS }, { "bspace", 200, 27, 24, 12 }, { "ins", 222, 27, NS }, { "home", 234, 27, NS }, { "pgup", 246, 27, NS }, { "numlock", 261, 27, NS }, { "numslash", 273, 27, NS }, { "numstar", 285, 27, NS }, { "numminus", 297, 27, NS },
+    { "g7", 0, 39, NS }, { "g8", 11, 39, NS }, { "g9", 22, 39, NS }, { "tab", 41, 39, 18, 12 }, { "q", 56, 39, NS }, { "w", 68, 39, NS }, { "e", 80, 39, NS }, { "r", 92, 39, NS }, { "t", 104, 39, NS }, { "y", 116, 39, NS }, { "u", 128, 39, NS }, { "i", 140, 39, NS }, { "o", 152, 39, NS }, { "p", 164, 39, NS }, { "lbrace", 176, 39, NS }, { "rbrace", 188, 39, NS }, { "del", 222, 39, NS }, { "end", 234, 39, NS }, { "pgdn", 246, 39, NS }, { "num7", 261, 39, NS }, { "num8", 273, 39, NS }, { "num9", 285, 39, NS }, { "numplus", 297, 45, 12, 24 },
+    { "g10", 0, 50, NS }, { "g11", 11, 50, NS }, { "g12", 22, 50, NS }, { "caps", 42, 51, 20, 12 }, { "a", 59, 51, NS }, { "s", 71, 51, NS }, { "d", 83, 51, NS }, { "f", 95, 51, NS }, { "g", 107, 51, NS }, { "h", 119, 51, NS }, { "j", 131, 51, NS }, { "k", 143, 51, NS }, { "l", 155, 51, NS }, { "colon", 167, 51, NS }, { "quote", 179, 51, NS }, { "num4", 261, 51, NS }, { "num5", 273, 51, NS }, { "num6", 285, 51, NS },
+    { "g13", 0, 64, NS }, { "g14", 11, 64, NS }, { "g15", 22, 64, NS }, { "z", 65, 63, NS }, { "x", 77, 63, NS }, { "c", 89, 63, NS }, { "v", 101, 63, NS }, { "b", 113, 63, NS }, { "n", 125, 63, NS }, { "m", 137, 63, NS }, { "comma", 149, 63, NS }, { "dot", 161, 63, NS }, { "slash", 173, 63, NS }, { "rshift", 196, 63, 32, 12 }, { "up", 234, 63, NS }, { "num1", 261, 63, NS }, { "num2", 273, 63, NS }, { "num3", 285, 63, NS }, { "numenter", 297, 69, 12, 24 },
+    { "g16", 0, 75, NS }, { "g17", 11, 75, NS }, { "g18", 22, 75, NS }, { "lctrl", 40, 75, 16, 12 }, { "lwin", 54, 75, NS }, { "lalt", 67, 75, 14, 12 }, { "space", 116, 75, 84, 12 }, { "ralt", 165, 75, 14, 12 }, { "rwin", 178, 75, NS }, { "rmenu", 190, 75, NS }, { "rctrl", 204, 75, 16, 12 }, { "left", 222, 75, NS }, { "down", 234, 75, NS }, { "right", 246, 75, NS }, { "num0", 267, 75, 24, 12 }, { "numdot", 285, 75, NS }
+};
+
+// Keys which differ between ANSI (US) and ISO (all other) layouts
+static const keyposinit k95pos_ansi[] = {
+    { "bslash", 203, 39, 18, 12 }, { "enter", 199, 51, 26, 12 }, { "lshift", 45, 63, 26, 12 }
+};
+static const keyposinit k95pos_iso[] = {
+    { "enter", 203, 39, 18, 24 }, { "hash", 191, 51, NS }, { "lshift", 39, 63, 14, 12 }, { "bslash", 53, 63, NS }
+};
+
+#define K95_WIDTH       298
+#define K95_HEIGHT      76
+// The K70 lacks the G keys and M keys, which are everything left of this point
+#define K70_X_START     38
+#define K70_WIDTH       (K95_WIDTH - K70_X_START)
+// The K65 also lacks the numpad and media keys and has its own top row
+#define K65_WIDTH       209
+static const keyposinit k65top[] = {
+    { "light", 164 - K70_X_START, 0, NS }, { "mute", 176 - K70_X_START, 0, NS }, { "voldn", 192 - K70_X_START, 0, 14, 8 }, { "volup", 205 - K70_X_START, 0, 14, 8 }, { "lock", 222 - K70_X_START, 0, NS }
+};
+
+#define N_ELEMENTS(array) (sizeof(array) / sizeof(*(array)))
+
+static int classify(const char* name){
+    if(name[0] == 'g' && name[1] >= '1' && name[1] <= '9')
+        return KC_GKEYS;
+    if(!strcmp(name, "mr") || !strcmp(name, "m1") || !strcmp(name, "m2") || !strcmp(name, "m3"))
+        return KC_MKEYS;
+    if(name[0] == 'f' && name[1] >= '1' && name[1] <= '9')
+        return KC_FKEYS;
+    if(strstr(name, "num") == name)
+        return KC_NUMPAD;
+    if(!strcmp(name, "stop") || !strcmp(name, "prev") || !strcmp(name, "play") || !strcmp(name, "next")
+            || !strcmp(name, "mute") || !strcmp(name, "volup") || !strcmp(name, "voldn"))
+        return KC_MEDIA;
+    if(!strcmp(name, "up") || !strcmp(name, "down") || !strcmp(name, "left") || !strcmp(name, "right"))
+        return KC_ARROWS;
+    if(!strcmp(name, "ins") || !strcmp(name, "del") || !strcmp(name, "home") || !strcmp(name, "end") || !strcmp(name, "pgup") || !strcmp(name, "pgdn")
+            || !strcmp(name, "prtscn") || !strcmp(name, "scroll") || !strcmp(name, "pause"))
+        return KC_NAV;
+    if(!strcmp(name, "lshift") || !strcmp(name, "rshift") || !strcmp(name, "lctrl") || !strcmp(name, "rctrl")
+            || !strcmp(name, "lalt") || !strcmp(name, "ralt") || !strcmp(name, "lwin") || !strcmp(name, "rwin") || !strcmp(name, "rmenu"))
+        return KC_MODS;
+    if(!strcmp(name, "light") || !strcmp(name, "lock"))
+        return 0;
+    return KC_MAIN;
+}
+
+// Adds a list of keys to a geometry table. The keymap is used to find each key's LED
+static void addkeys(keygeometry* geometry, const key* keymap, const keyposinit* keys, int count, int model){
+    for(int i = 0; i < count; i++){
+        const keyposinit* pos = keys + i;
+        int x = pos->x, classes = classify(pos->name);
+        if(model != 95 && keys != k65top){
+            // K70 and K65 don't have G keys or M keys and are shifted to the left
+            if(classes & (KC_GKEYS | KC_MKEYS))
+                continue;
+            x -= K70_X_START;
+            // The K65 doesn't have anything to the right of the main block, and its top row is added separately
+            if(model == 65 && (x >= K65_WIDTH || pos->y < 14))
+                continue;
+        }
+        for(int j = 0; j < N_KEYS; j++){
+            if(keymap[j].name && keymap[j].led >= 0 && !strcmp(keymap[j].name, pos->name)){
+                keypos* out = geometry->key + keymap[j].led;
+                out->x = x;
+                out->y = pos->y;
+                out->width = pos->width;
+                out->height = pos->height;
+                out->classes = classes;
+                break;
+            }
+        }
+    }
+}
+
+const keygeometry* getgeometry(int model, const key* keymap){
+    // Tables are generated on first use. Index by model and by ANSI/ISO layout
+    // Devices are set up on their own threads, so the tables are built under a lock
+    static keygeometry* tables[3][2] = { { 0 } };
+    static pthread_mutex_t tablemutex = PTHREAD_MUTEX_INITIALIZER;
+    int mindex = (model == 65 ? 0 : model == 70 ? 1 : model == 95 ? 2 : -1);
+    if(mindex < 0)
+        return 0;
+    int iso = (keymap != keymap_us);
+    pthread_mutex_lock(&tablemutex);
+    keygeometry* geometry = tables[mindex][iso];
+    if(geometry){
+        pthread_mutex_unlock(&tablemutex);
+        return geometry;
+    }
+    geometry = calloc(1, sizeof(keygeometry));
+    geometry->width = (model == 65 ? K65_WIDTH : model == 70 ? K70_WIDTH : K95_WIDTH);
+    geometry->height = K95_HEIGHT;
+    // The physical layout is the same for all ISO keyboards, so use the UK key names to look up the LEDs
+    const key* namemap = (iso ? keymap_gb : keymap_us);
+    addkeys(geometry, namemap, k95pos, N_ELEMENTS(k95pos), model);
+    if(iso)
+        addkeys(geometry, namemap, k95pos_iso, N_ELEMENTS(k95pos_iso), model);
+    else
+        addkeys(geometry, namemap, k95pos_ansi, N_ELEMENTS(k95pos_ansi), model);
+    if(model == 65)
+        addkeys(geometry, namemap, k65top, N_ELEMENTS(k65top), model);
+    // Only publish the table once it's complete
+    tables[mindex][iso] = geometry;
+    pthread_mutex_unlock(&tablemutex);
+    return geometry;
+}
+
+int getkeyclass(const char* name){
+    if(!strcmp(name, "gkeys"))
+        return KC_GKEYS;
+    if(!strcmp(name, "mkeys"))
+        return KC_MKEYS;
+    if(!strcmp(name, "fkeys"))
+        return KC_FKEYS;
+    if(!strcmp(name, "numpad"))
+        return KC_NUMPAD;
+    if(!strcmp(name, "media"))
+        return KC_MEDIA;
+    if(!strcmp(name, "arrows"))
+        return KC_ARROWS;
+    if(!strcmp(name, "nav"))
+        return KC_NAV;
+    if(!strcmp(name, "mods"))
+        return KC_MODS;
+    if(!strcmp(name, "main"))
+        return KC_MAIN;
+    if(!strcmp(name, "all"))
+        return KC_ALL;
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef KEYPOS_H
+#define KEYPOS_H
+
+#include "includes.h"
+#include "keyboard.h"
+
+// Key classes
+#define KC_GKEYS    0x001   // G1 - G18
+#define KC_MKEYS    0x002   // MR, M1 - M3
+#define KC_FKEYS    0x004   // F1 - F12
+#define KC_NUMPAD   0x008   // Number pad, including Num Lock
+#define KC_MEDIA    0x010   // Media buttons and volume
+#define KC_ARROWS   0x020   // Arrow keys
+#define KC_NAV      0x040   // Insert/Delete/Home/End/Page Up/Page Down and Print Screen/Scroll Lock/Pause
+#define KC_MODS     0x080   // Shift, Ctrl, Alt, Windows, and Menu
+#define KC_MAIN     0x100   // Everything else in the main block (letters, numbers, punctuation, Esc, Space, etc)
+#define KC_ALL      0x1ff
+
+// Position of a single key. Coordinates use the same units as the ckb keymaps (a standard key is 12x12) and give the center of the key.
+typedef struct {
+    short x, y;
+    // Zero if there's no key at this LED
+    short width, height;
+    short classes;
+} keypos;
+
+// Geometry for a whole keyboard, indexed by LED
+typedef struct {
+    keypos key[N_KEYS];
+    short width, height;
+} keygeometry;
+
+// Gets the geometry for a keyboard model (65, 70, or 95) and layout. Returns null if the model is unknown.
+const keygeometry* getgeometry(int model, const key* keymap);
+// Gets a key class bitfield from a name such as "numpad". Returns 0 if the name isn't recognized.
+int getkeyclass(const char* name);
+
+#endif
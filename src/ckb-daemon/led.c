@@ -1,5 +1,6 @@
 #include "led.h"
 #include "device.h"
+#include "keypos.h"
 #include "notify.h"
 
 void initrgb(keylight* light){
@@ -8,7 +9,88 @@ void initrgb(keylight* light){
     light->enabled = 1;
 }
 
-void makergb_512(const keylight* light, uchar data_pkt[5][MSG_SIZE], int forceon){
+// Brightness, gamma, and dimming settings for a device. Each LED is passed through one lookup table per channel when the
+// lighting is sent to the device, so the colors stored in the mode are never changed.
+#define SCALE_GROUPS    16
+struct rgbscale {
+    // Overall brightness, 0 - 100
+    int brightness;
+    // Gamma for each channel (1 = linear)
+    float gamma[3];
+    // Dimming for each LED, 0 - 100
+    uchar dim[N_KEYS];
+    // Lookup tables. LEDs with the same dimming level share a table
+    uchar group[N_KEYS];
+    uchar lut[SCALE_GROUPS][3][256];
+    // Set when the settings have changed and the tables need to be rebuilt
+    char dirty;
+    // Set if the tables don't change anything
+    char identity;
+};
+
+static void buildscale(struct rgbscale* scale){
+    // Assign a table to each dimming level in use
+    int levels[SCALE_GROUPS];
+    int count = 0;
+    for(int i = 0; i < N_KEYS; i++){
+        int level = scale->dim[i], group;
+        for(group = 0; group < count; group++){
+            if(levels[group] == level)
+                break;
+        }
+        if(group == count){
+            if(count < SCALE_GROUPS)
+                levels[count++] = level;
+            else {
+                // Out of tables, use the closest level
+                group = 0;
+                for(int j = 1; j < count; j++){
+                    if(abs(levels[j] - level) < abs(levels[group] - level))
+                        group = j;
+                }
+            }
+        }
+        scale->group[i] = group;
+    }
+    // Fill the tables
+    scale->identity = (count == 1 && levels[0] == 100 && scale->brightness == 100);
+    for(int clr = 0; clr < 3; clr++){
+        if(scale->gamma[clr] != 1.f)
+            scale->identity = 0;
+    }
+    for(int group = 0; group < count; group++){
+        float factor = scale->brightness * levels[group] / 10000.f;
+        for(int clr = 0; clr < 3; clr++){
+            for(int value = 0; value < 256; value++)
+                scale->lut[group][clr][value] = (uchar)roundf(powf(value / 255.f, scale->gamma[clr]) * factor * 255.f);
+        }
+    }
+    scale->dirty = 0;
+}
+
+static struct rgbscale* getscale(usbdevice* kb){
+    if(!kb->rgbscale){
+        struct rgbscale* scale = kb->rgbscale = calloc(1, sizeof(struct rgbscale));
+        scale->brightness = 100;
+        scale->gamma[0] = scale->gamma[1] = scale->gamma[2] = 1.f;
+        memset(scale->dim, 100, N_KEYS);
+    }
+    return kb->rgbscale;
+}
+
+void freergbscale(usbdevice* kb){
+    free(kb->rgbscale);
+    kb->rgbscale = 0;
+}
+
+void rgbscaleinfo(usbdevice* kb, int* brightness, float gamma[3]){
+    struct rgbscale* scale = getscale(kb);
+    *brightness = scale->brightness;
+    memcpy(gamma, scale->gamma, sizeof(scale->gamma));
+}
+
+// Generates RGB packets for the device. If scale is non-null, the colors are passed through its lookup tables.
+static void makergb_512(const keylight* light, uchar data_pkt[5][MSG_SIZE], int forceon, const struct rgbscale* scale){
     if(forceon || light->enabled){
         uchar r[N_KEYS / 2], g[N_KEYS / 2], b[N_KEYS / 2];
         // Compress RGB values to a 512-color palette
@@ -16,6 +98,12 @@ void makergb_512(const keylight* light, uchar data_pkt[5][MSG_SIZE], int forceon
             char r1 = light->r[i], r2 = light->r[i + 1];
             char g1 = light->g[i], g2 = light->g[i + 1];
             char b1 = light->b[i], b2 = light->b[i + 1];
+            if(scale){
+                const uchar (*lut1)[256] = scale->lut[scale->group[i]], (*lut2)[256] = scale->lut[scale->group[i + 1]];
+                r1 = lut1[0][light->r[i]]; r2 = lut2[0][light->r[i + 1]];
+                g1 = lut1[1][light->g[i]]; g2 = lut2[1][light->g[i + 1]];
+                b1 = lut1[2][light->b[i]]; b2 = lut2[2][light->b[i + 1]];
+            }
             r[i / 2] = (7 - (r2 >> 5)) << 4 | (7 - (r1 >> 5));
             g[i / 2] = (7 - (g2 >> 5)) << 4 | (7 - (g1 >> 5));
             b[i / 2] = (7 - (b2 >> 5)) << 4 | (7 - (b1 >> 5));
@@ -34,9 +122,19 @@ void makergb_512(const keylight* light, uchar data_pkt[5][MSG_SIZE], int forceon
     }
 }
 
-void makergb_full(const keylight* light, uchar data_pkt[12][MSG_SIZE], int forceon){
+static void makergb_full(const keylight* light, uchar data_pkt[12][MSG_SIZE], int forceon, const struct rgbscale* scale){
     if(forceon || light->enabled){
         const uchar* r = light->r, *g = light->g, *b = light->b;
+        uchar sr[N_KEYS], sg[N_KEYS], sb[N_KEYS];
+        if(scale){
+            for(int i = 0; i < N_KEYS; i++){
+                const uchar (*lut)[256] = scale->lut[scale->group[i]];
+                sr[i] = lut[0][r[i]];
+                sg[i] = lut[1][g[i]];
+                sb[i] = lut[2][b[i]];
+            }
+            r = sr; g = sg; b = sb;
+        }
         // Red
         memcpy(data_pkt[0] + 4, r, 60);
         memcpy(data_pkt[1] + 4, r + 60, 60);
@@ -58,8 +156,19 @@ void updatergb(usbdevice* kb, int force){
     // Don't do anything if the lighting hasn't changed
     keylight* lastlight = &kb->lastlight;
     keylight* newlight = &kb->profile.currentmode->light;
+    // Rebuild the brightness tables if needed. This always requires a new frame
+    struct rgbscale* scale = kb->rgbscale;
+    if(scale && scale->dirty){
+        buildscale(scale);
+        force = 1;
+    }
+    if(scale && scale->identity)
+        scale = 0;
     if(!force && ((!lastlight->enabled && !newlight->enabled) || !memcmp(lastlight, newlight, sizeof(keylight))))
         return;
+    // Send fewer frames if the device is having trouble keeping up
+    if(!force && usb_throttle(kb))
+        return;
 
     /*if(kb->fwversion >= 0x0120){
         uchar data_pkt[12][MSG_SIZE] = {
@@ -79,7 +188,7 @@ void updatergb(usbdevice* kb, int force){
             { 0x7f, 0x03, 24, 0 },
             { 0x07, 0x28, 0x03, 0x00, 0x02, 0x01}
         };
-        makergb_full(newlight, data_pkt, 0);
+        makergb_full(newlight, data_pkt, 0, scale);
         if(usbqueue(kb, data_pkt[0], 12))
             return;
     } else {*/
@@ -92,7 +201,7 @@ void updatergb(usbdevice* kb, int force){
             { 0x7f, 0x04, 36, 0 },
             { 0x07, 0x27, 0x00, 0x00, 0xD8 }
         };
-        makergb_512(newlight, data_pkt, 0);
+        makergb_512(newlight, data_pkt, 0, scale);
         if(usbqueue(kb, data_pkt[0], 5))
             return;
     //}
@@ -100,7 +209,7 @@ void updatergb(usbdevice* kb, int force){
     memcpy(lastlight, newlight, sizeof(keylight));
 }
 
-void savergb(usbdevice* kb, int mode){
+void savergb(usbdevice* kb, int mode, int planes){
     if(kb->fwversion >= 0x0120){
         uchar data_pkt[12][MSG_SIZE] = {
             // Red
@@ -119,8 +228,12 @@ void savergb(usbdevice* kb, int mode){
             { 0x7f, 0x03, 24, 0 },
             { 0x07, 0x14, 0x03, 0x01, 0x01, mode + 1, 0x03 }
         };
-        makergb_full(&kb->profile.mode[mode].light, data_pkt, 0);
-        usbqueue(kb, data_pkt[0], 12);
+        makergb_full(&kb->profile.mode[mode].light, data_pkt, 0, 0);
+        // Each plane is saved separately, so unchanged planes can be skipped
+        for(int clr = 0; clr < 3; clr++){
+            if(planes & (1 << clr))
+                usbqueue(kb, data_pkt[clr * 4], 4);
+        }
     } else {
         uchar data_pkt[5][MSG_SIZE] = {
             { 0x7f, 0x01, 60, 0 },
@@ -129,11 +242,33 @@ void savergb(usbdevice* kb, int mode){
             { 0x7f, 0x04, 36, 0 },
             { 0x07, 0x14, 0x02, 0x00, 0x01, mode + 1 }
         };
-        makergb_512(&kb->profile.mode[mode].light, data_pkt, 0);
+        makergb_512(&kb->profile.mode[mode].light, data_pkt, 0, 0);
         usbqueue(kb, data_pkt[0], 5);
     }
 }
 
+int rgbdiff(usbdevice* kb, const keylight* light1, const keylight* light2){
+    if(kb->fwversion >= 0x0120){
+        // Full color: compare each plane
+        int planes = 0;
+        if(memcmp(light1->r, light2->r, N_KEYS))
+            planes |= RGB_PLANE_R;
+        if(memcmp(light1->g, light2->g, N_KEYS))
+            planes |= RGB_PLANE_G;
+        if(memcmp(light1->b, light2->b, N_KEYS))
+            planes |= RGB_PLANE_B;
+        return planes;
+    }
+    // 512 colors: only the top 3 bits of each channel matter, and the planes can't be saved separately
+    for(int i = 0; i < N_KEYS; i++){
+        if((light1->r[i] ^ light2->r[i]) & 0xe0
+                || (light1->g[i] ^ light2->g[i]) & 0xe0
+                || (light1->b[i] ^ light2->b[i]) & 0xe0)
+            return RGB_PLANE_ALL;
+    }
+    return 0;
+}
+
 int loadrgb(usbdevice* kb, keylight* light, int mode){
     if(kb->fwversion >= 0x0120){
         uchar data_pkt[12][MSG_SIZE] = {
@@ -348,6 +483,321 @@ void cmd_rgb(usbdevice* kb, usbmode* mode, const key* keymap, int dummy, int key
     }
 }
 
+// Hex digit lookup table. Valid digits have bit 0x10 set, so a pair can be validated with a single AND.
+static const uchar hexdigit[256] = {
+    ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+    ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+    ['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+    ['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+};
+
+// Decodes exactly 'count' bytes of hex from 'hex'. Returns 0 on success, -1 if the string is too short or contains non-hex characters.
+static int hexdecode(const char* hex, uchar* out, int count){
+    const uchar* in = (const uchar*)hex;
+    for(int i = 0; i < count; i++){
+        // A terminating null (or any other invalid char) maps to 0 and fails the check. The second digit isn't read
+        // unless the first one is valid, so this never reads past the end of the string
+        uchar hi = hexdigit[in[0]];
+        if(!(hi & 0x10))
+            return -1;
+        uchar lo = hexdigit[in[1]];
+        if(!(lo & 0x10))
+            return -1;
+        out[i] = hi << 4 | (lo & 0x0f);
+        in += 2;
+    }
+    return 0;
+}
+
+int cmd_rgbbulk(usbdevice* kb, usbmode* mode, const key* keymap, const char* code){
+    int planar;
+    if(!strncmp(code, "planar:", 7)){
+        planar = 1;
+        code += 7;
+    } else if(!strncmp(code, "keys:", 5)){
+        planar = 0;
+        code += 5;
+    } else
+        return -1;
+    // Build the list of target indices. Default is all of them, or they can be given as a range or a bitmap
+    uchar index[N_KEYS];
+    int count = 0;
+    int first, last, length = 0;
+    if(code[0] == '/'){
+        // Bitmap: "/<36 hex digits>:", bit N (LSB first) of byte N/8 selects index N
+        uchar bitmap[N_KEYS / 8];
+        if(hexdecode(code + 1, bitmap, N_KEYS / 8) || code[1 + N_KEYS / 4] != ':')
+            return -1;
+        for(int i = 0; i < N_KEYS; i++){
+            if(bitmap[i / 8] & (1 << (i % 8)))
+                index[count++] = i;
+        }
+        code += 2 + N_KEYS / 4;
+    } else if(sscanf(code, "%d-%d:%n", &first, &last, &length) == 2 && length > 0){
+        // Range: "<first>-<last>:"
+        if(first < 0 || last >= N_KEYS || first > last)
+            return -1;
+        for(int i = first; i <= last; i++)
+            index[count++] = i;
+        code += length;
+    } else {
+        for(int i = 0; i < N_KEYS; i++)
+            index[count++] = i;
+    }
+    // Decode the colors to a temporary buffer so that a malformed string doesn't leave a partial frame behind
+    uchar data[N_KEYS * 3];
+    if(hexdecode(code, data, count * 3))
+        return -1;
+    keylight* light = &mode->light;
+    if(planar){
+        // Planar data is in LED order: all reds, then all greens, then all blues
+        const uchar* r = data, *g = data + count, *b = data + count * 2;
+        for(int i = 0; i < count; i++){
+            int led = index[i];
+            light->r[led] = r[i];
+            light->g[led] = g[i];
+            light->b[led] = b[i];
+        }
+    } else {
+        // Key data is rrggbb in key index order and needs to be translated through the key map
+        const uchar* rgb = data;
+        for(int i = 0; i < count; i++, rgb += 3){
+            int led = keymap[index[i]].led;
+            if(led < 0)
+                continue;
+            light->r[led] = rgb[0];
+            light->g[led] = rgb[1];
+            light->b[led] = rgb[2];
+        }
+    }
+    return 0;
+}
+
+// Color gradient. Same format as ckb_gradient in ckb-anim.h
+#define GRAD_MAX    100
+typedef struct {
+    int ptcount;
+    char pts[GRAD_MAX];
+    uchar a[GRAD_MAX], r[GRAD_MAX], g[GRAD_MAX], b[GRAD_MAX];
+} gradient;
+
+// Reads a gradient in the form "<pos>:<AARRGGBB><pos>:<AARRGGBB>...". Returns 0 on success.
+static int scangrad(const char* string, gradient* grad){
+    int pos = -1, count = 0;
+    while(count < GRAD_MAX){
+        int newpos, scanned = 0;
+        uchar a, r, g, b;
+        if(sscanf(string, "%d:%2hhx%2hhx%2hhx%2hhx%n", &newpos, &a, &r, &g, &b, &scanned) != 5)
+            break;
+        string += scanned;
+        // Don't allow stops out-of-order or past 100
+        if(newpos <= pos || newpos > 100)
+            return -1;
+        pos = newpos;
+        grad->pts[count] = pos;
+        grad->a[count] = a;
+        grad->r[count] = r;
+        grad->g[count] = g;
+        grad->b[count] = b;
+        count++;
+    }
+    // Gradients need stops at 0 and 100
+    if(count < 2 || grad->pts[0] != 0 || grad->pts[count - 1] != 100)
+        return -1;
+    grad->ptcount = count;
+    return 0;
+}
+
+// Blends a point on a gradient (0 to 100) into an LED
+static void blendgrad(keylight* light, int led, const gradient* grad, float pos){
+    if(pos < 0.f)
+        pos = 0.f;
+    if(pos > 100.f)
+        pos = 100.f;
+    int i = 1;
+    for(; i < grad->ptcount - 1; i++){
+        if(grad->pts[i] >= pos)
+            break;
+    }
+    // Interpolate between the surrounding stops. Alpha is premultiplied so that transparent stops don't contribute any color
+    float dx = (pos - grad->pts[i - 1]) / (float)(grad->pts[i] - grad->pts[i - 1]);
+    float a1 = grad->a[i - 1] / 255.f * (1.f - dx), a2 = grad->a[i] / 255.f * dx;
+    float a = a1 + a2;
+    if(a <= 0.f)
+        return;
+    float r = (grad->r[i - 1] * a1 + grad->r[i] * a2) / a;
+    float g = (grad->g[i - 1] * a1 + grad->g[i] * a2) / a;
+    float b = (grad->b[i - 1] * a1 + grad->b[i] * a2) / a;
+    // Blend over the existing color
+    light->r[led] = light->r[led] * (1.f - a) + r * a + 0.5f;
+    light->g[led] = light->g[led] * (1.f - a) + g * a + 0.5f;
+    light->b[led] = light->b[led] * (1.f - a) + b * a + 0.5f;
+}
+
+int cmd_draw(usbdevice* kb, usbmode* mode, const key* keymap, const char* shape){
+    const keygeometry* geometry = getgeometry(kb->model, keymap);
+    if(!geometry)
+        return -1;
+    keylight* light = &mode->light;
+    // Split the shape into its name, parameters, and color/gradient
+    char name[11];
+    int length = 0;
+    if(sscanf(shape, "%10[^:]:%n", name, &length) != 1 || length == 0)
+        return -1;
+    const char* params = shape + length;
+    const char* color = strchr(params, ':');
+    if(!color)
+        return -1;
+    color++;
+    if(!strcmp(name, "rect") || !strcmp(name, "class")){
+        // Solid fills. Select keys by rectangle (keys whose centers are inside it) or by class
+        uchar r, g, b;
+        if(sscanf(color, "%2hhx%2hhx%2hhx", &r, &g, &b) != 3)
+            return -1;
+        int x = 0, y = 0, w = 0, h = 0, classes = 0;
+        if(name[0] == 'r'){
+            if(sscanf(params, "%d,%d,%d,%d:", &x, &y, &w, &h) != 4)
+                return -1;
+        } else {
+            // Class names are separated by commas
+            char classname[11];
+            int field = 0;
+            while(*params != ':' && sscanf(params, "%10[^:,]%n", classname, &field) == 1){
+                int newclass = getkeyclass(classname);
+                if(!newclass)
+                    return -1;
+                classes |= newclass;
+                params += field;
+                if(*params == ',')
+                    params++;
+            }
+        }
+        for(int i = 0; i < N_KEYS; i++){
+            const keypos* pos = geometry->key + i;
+            if(!pos->width)
+                continue;
+            if(classes ? !(pos->classes & classes) : (pos->x < x || pos->x >= x + w || pos->y < y || pos->y >= y + h))
+                continue;
+            light->r[i] = r;
+            light->g[i] = g;
+            light->b[i] = b;
+        }
+        return 0;
+    } else if(!strcmp(name, "linear")){
+        // Linear gradient from (x1, y1) to (x2, y2)
+        gradient grad;
+        float x1, y1, x2, y2;
+        if(sscanf(params, "%f,%f,%f,%f:", &x1, &y1, &x2, &y2) != 4 || scangrad(color, &grad))
+            return -1;
+        float dx = x2 - x1, dy = y2 - y1;
+        float length2 = dx * dx + dy * dy;
+        if(length2 == 0.f)
+            return -1;
+        for(int i = 0; i < N_KEYS; i++){
+            const keypos* pos = geometry->key + i;
+            if(!pos->width)
+                continue;
+            // Project the key's center onto the gradient line
+            float t = ((pos->x - x1) * dx + (pos->y - y1) * dy) / length2;
+            blendgrad(light, i, &grad, t * 100.f);
+        }
+        return 0;
+    } else if(!strcmp(name, "radial")){
+        // Radial gradient centered at (x, y)
+        gradient grad;
+        float cx, cy, radius;
+        if(sscanf(params, "%f,%f,%f:", &cx, &cy, &radius) != 3 || radius <= 0.f || scangrad(color, &grad))
+            return -1;
+        for(int i = 0; i < N_KEYS; i++){
+            const keypos* pos = geometry->key + i;
+            if(!pos->width)
+                continue;
+            float dx = pos->x - cx, dy = pos->y - cy;
+            blendgrad(light, i, &grad, sqrtf(dx * dx + dy * dy) / radius * 100.f);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+int cmd_brightness(usbdevice* kb, const char* level){
+    int brightness;
+    if(sscanf(level, "%d", &brightness) != 1 || brightness < 0 || brightness > 100)
+        return -1;
+    struct rgbscale* scale = getscale(kb);
+    if(scale->brightness != brightness){
+        scale->brightness = brightness;
+        scale->dirty = 1;
+    }
+    return 0;
+}
+
+int cmd_gamma(usbdevice* kb, const char* gamma){
+    float r, g, b;
+    int count = sscanf(gamma, "%f,%f,%f", &r, &g, &b);
+    if(count == 1)
+        g = b = r;
+    else if(count != 3)
+        return -1;
+    if(r < 0.1f || r > 10.f || g < 0.1f || g > 10.f || b < 0.1f || b > 10.f)
+        return -1;
+    struct rgbscale* scale = getscale(kb);
+    scale->gamma[0] = r;
+    scale->gamma[1] = g;
+    scale->gamma[2] = b;
+    scale->dirty = 1;
+    return 0;
+}
+
+int cmd_dim(usbdevice* kb, const key* keymap, const char* keys){
+    // Level is on the right side of the colon
+    const char* colon = strchr(keys, ':');
+    int level;
+    if(!colon || sscanf(colon + 1, "%d", &level) != 1 || level < 0 || level > 100)
+        return -1;
+    // Find the LEDs to change. Classes and key names may be mixed
+    char selected[N_KEYS] = { 0 };
+    char name[11];
+    int field = 0;
+    while(*keys != ':' && sscanf(keys, "%10[^:,]%n", name, &field) == 1){
+        int classes = getkeyclass(name);
+        if(classes == KC_ALL)
+            memset(selected, 1, N_KEYS);
+        else if(classes){
+            const keygeometry* geometry = getgeometry(kb->model, keymap);
+            if(!geometry)
+                return -1;
+            for(int i = 0; i < N_KEYS; i++){
+                if(geometry->key[i].classes & classes)
+                    selected[i] = 1;
+            }
+        } else {
+            int found = 0;
+            for(int i = 0; i < N_KEYS; i++){
+                if(keymap[i].name && !strcmp(keymap[i].name, name)){
+                    // Keys without LEDs are accepted but ignored
+                    if(keymap[i].led >= 0)
+                        selected[keymap[i].led] = 1;
+                    found = 1;
+                }
+            }
+            if(!found)
+                return -1;
+        }
+        keys += field;
+        if(*keys == ',')
+            keys++;
+    }
+    struct rgbscale* scale = getscale(kb);
+    for(int i = 0; i < N_KEYS; i++){
+        if(selected[i] && scale->dim[i] != level){
+            scale->dim[i] = level;
+            scale->dirty = 1;
+        }
+    }
+    return 0;
+}
+
 // Indicator bitfield from string
 static uchar iselect(const char* led){
     int result = 0;
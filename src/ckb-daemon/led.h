@@ -8,8 +8,15 @@
 void initrgb(keylight* light);
 // Update a device's LEDs with RGB data.
 void updatergb(usbdevice* kb, int force);
-// Saves RGB data for a device profile.
-void savergb(usbdevice* kb, int mode);
+// RGB color planes
+#define RGB_PLANE_R     1
+#define RGB_PLANE_G     2
+#define RGB_PLANE_B     4
+#define RGB_PLANE_ALL   7
+// Saves RGB data for a device profile. Planes is a mask of the color planes to save. Firmware older than v1.20 can only save all of them at once.
+void savergb(usbdevice* kb, int mode, int planes);
+// Compares two sets of RGB data at the precision which the device is able to store. Returns a mask of the planes that differ.
+int rgbdiff(usbdevice* kb, const keylight* light1, const keylight* light2);
 // Loads RGB data for a device profile. Returns 0 on success.
 int loadrgb(usbdevice* kb, keylight* light, int mode);
 
@@ -23,6 +30,22 @@ void cmd_rgboff(usbdevice* kb, usbmode* mode);
 void cmd_rgbon(usbdevice* kb, usbmode* mode);
 // Updates an LED color
 void cmd_rgb(usbdevice* kb, usbmode* mode, const key* keymap, int dummy, int keyindex, const char* code);
+// Updates many LED colors at once from a packed hex string (the part after "@" in "rgb @planar:..." or "rgb @keys:...").
+// Returns 0 on success, nothing is changed on failure.
+int cmd_rgbbulk(usbdevice* kb, usbmode* mode, const key* keymap, const char* code);
+// Draws a shape over the key geometry ("rect:...", "class:...", "linear:...", or "radial:..."). Returns 0 on success.
+int cmd_draw(usbdevice* kb, usbmode* mode, const key* keymap, const char* shape);
+
+// Sets the overall brightness (0 - 100). Returns 0 on success.
+int cmd_brightness(usbdevice* kb, const char* level);
+// Sets the gamma, either one value for all channels or "r,g,b". Returns 0 on success.
+int cmd_gamma(usbdevice* kb, const char* gamma);
+// Sets the dimming level of a group of keys ("<key or class>,...:<0 - 100>"). Returns 0 on success.
+int cmd_dim(usbdevice* kb, const key* keymap, const char* keys);
+// Gets the current brightness and gamma
+void rgbscaleinfo(usbdevice* kb, int* brightness, float gamma[3]);
+// Frees a device's brightness settings
+void freergbscale(usbdevice* kb);
 
 // Turns an indicator off permanently
 void cmd_ioff(usbdevice* kb, usbmode* mode, const key* keymap, int dummy1, int dummy2, const char* led);
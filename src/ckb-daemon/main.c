@@ -222,6 +222,8 @@ int main(int argc, char** argv){
     while(1){
         clock_gettime(CLOCK_MONOTONIC, &time);
         pthread_mutex_lock(&kblistmutex);
+        // Watch for system resume so that devices coming back can be restored quickly
+        checkresume();
         // Process commands for root controller
         if(keyboard[0].infifo){
             const char* line;
@@ -230,17 +232,26 @@ int main(int argc, char** argv){
         }
         // Run the USB queue. Messages must be queued because sending multiple messages at the same time can cause the interface to freeze
         for(int i = 0; i < DEV_MAX; i++){
-            if(IS_CONNECTED(keyboard + i)){
+            // Devices being reset are left to the reset thread
+            if(IS_CONNECTED(keyboard + i) && keyboard[i].health.resetstate != RESET_RUNNING){
                 pthread_mutex_lock(&keyboard[i].mutex);
-                if(usbdequeue(keyboard + i) == 0
-                        && usb_tryreset(keyboard + i)){
-                    // If it failed and couldn't be reset, close the keyboard
+                // Devices which recently failed are skipped until their retry time, so they don't hold up the others
+                int res = usb_ready(keyboard + i);
+                if(res == 0){
+                    int written = usbdequeue(keyboard + i);
+                    if(written > 0)
+                        usb_ok(keyboard + i);
+                    else if(written == 0)
+                        res = usb_fail(keyboard + i);
+                }
+                if(res < 0){
+                    // If it failed and couldn't be recovered, close the keyboard
                     closeusb(keyboard + i);
                 } else {
-                    if(keyboard[i].queuecount == 0){
+                    if(res == 0 && keyboard[i].queuecount == 0){
                         // Process FIFOs
                         for(int i = 0; i < DEV_MAX; i++){
-                            if(keyboard[i].infifo){
+                            if(keyboard[i].infifo && keyboard[i].health.resetstate != RESET_RUNNING){
                                 const char* line;
                                 if(readlines(keyboard[i].infifo, &line))
                                     readcmd(keyboard + i, line);
@@ -251,6 +262,9 @@ int main(int argc, char** argv){
                         // Update indicator LEDs for this keyboard. These are polled rather than processed during events because they don't update
                         // immediately and may be changed externally by the OS.
                         updateindicators(keyboard + i, 0);
+                        // Lighting updates may have been throttled if the device is degraded. Send the latest state
+                        if(keyboard[i].health.score < HEALTH_DEGRADED)
+                            updatergb(keyboard + i, 0);
                     }
                     pthread_mutex_unlock(&keyboard[i].mutex);
                 }
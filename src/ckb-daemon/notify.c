@@ -1,5 +1,6 @@
 #include "device.h"
 #include "devnode.h"
+#include "keypos.h"
 #include "led.h"
 #include "notify.h"
 #include "profile.h"
@@ -112,9 +113,11 @@ void getinfo(usbdevice* kb, usbmode* mode, int nnumber, const char* setting){
         nrprintf(nnumber, "hello\n");
         return;
     } else if(!strcmp(setting, ":fps")){
+        // The frame rate is global, but devices may ask for it too so that they can time their frames to it
         if(kb && mode)
-            return;
-        nrprintf(nnumber, "fps %d\n", fps);
+            nprintf(kb, nnumber, 0, "fps %d\n", fps);
+        else
+            nrprintf(nnumber, "fps %d\n", fps);
         return;
     } else if(!strcmp(setting, ":layout")){
         if(kb && mode)
@@ -144,6 +147,19 @@ void getinfo(usbdevice* kb, usbmode* mode, int nnumber, const char* setting){
         else
             nprintf(kb, nnumber, mode, "rgb off\n");
         return;
+    } else if(!strcmp(setting, ":brightness")){
+        // Get the brightness and gamma
+        int brightness;
+        float gamma[3];
+        rgbscaleinfo(kb, &brightness, gamma);
+        nprintf(kb, nnumber, 0, "brightness %d\n", brightness);
+        return;
+    } else if(!strcmp(setting, ":gamma")){
+        int brightness;
+        float gamma[3];
+        rgbscaleinfo(kb, &brightness, gamma);
+        nprintf(kb, nnumber, 0, "gamma %g,%g,%g\n", gamma[0], gamma[1], gamma[2]);
+        return;
     } else if(!strcmp(setting, ":hwrgb")){
         // Get the current hardware RGB settings
         if(!kb->hw)
@@ -226,6 +242,18 @@ void getinfo(usbdevice* kb, usbmode* mode, int nnumber, const char* setting){
             uchar state = kb->kbinput[byte] & bit;
             nprintkey(kb, nnumber, keymap, i, state);
         }
+    } else if(!strcmp(setting, ":geometry")){
+        // Get the size of the key geometry used by the draw commands
+        const keygeometry* geometry = getgeometry(kb->model, profile->keymap);
+        if(geometry)
+            nprintf(kb, nnumber, 0, "geometry %d %d\n", geometry->width, geometry->height);
+    } else if(!strcmp(setting, ":stats")){
+        // Get command cache statistics
+        unsigned hits, misses;
+        cmdcachestats(kb, &hits, &misses);
+        nprintf(kb, nnumber, 0, "stats cmdcache %u %u\n", hits, misses);
+        // USB health
+        nprintf(kb, nnumber, 0, "stats usb %d %u %u\n", kb->health.score, kb->health.errors, kb->health.resets);
     } else if(!strcmp(setting, ":i")){
         // Get the current state of all LEDs
         nprintind(kb, nnumber, I_NUM, kb->ileds & I_NUM);
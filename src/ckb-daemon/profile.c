@@ -241,18 +241,55 @@ void hwtonative(usbprofile* profile, hwprofile* hw, int modes){
         memcpy(&profile->mode[i].light, hw->light + i, sizeof(keylight));
 }
 
-// Converts a native profile to a hardware profile
-void nativetohw(usbprofile* profile, hwprofile* hw, int modes){
+// Compares a native profile to a hardware profile. The dirty arrays are filled with what needs to be saved for the profile (index 0)
+// and each mode (index 1+): bit 0 = name, bit 1 = ID, bits 2-4 = RGB planes. Returns nonzero if anything is dirty.
+#define DIRTY_NAME      1
+#define DIRTY_ID        2
+#define DIRTY_RGB(planes) ((planes) << 2)
+static int hwdiff(usbdevice* kb, hwprofile* hw, int full, int modes, int dirty[HWMODE_MAX + 1]){
+    usbprofile* profile = &kb->profile;
+    int any = 0;
+    for(int i = 0; i < modes; i++){
+        usbmode* mode = profile->mode + i;
+        int flags = 0;
+        if(full || memcmp(hw->name[i + 1], mode->name, MD_NAME_LEN * 2))
+            flags |= DIRTY_NAME;
+        flags |= DIRTY_RGB(full ? RGB_PLANE_ALL : rgbdiff(kb, hw->light + i, &mode->light));
+        // A mode gets a new ID (modification number) only if its contents or its GUID changed
+        if(flags || memcmp(hw->id[i + 1].guid, mode->id.guid, sizeof(mode->id.guid)))
+            flags |= DIRTY_ID;
+        dirty[i + 1] = flags;
+        any |= flags;
+    }
+    int flags = 0;
+    if(full || memcmp(hw->name[0], profile->name, PR_NAME_LEN * 2))
+        flags |= DIRTY_NAME;
+    if(any || flags || memcmp(hw->id[0].guid, profile->id.guid, sizeof(profile->id.guid)))
+        flags |= DIRTY_ID;
+    dirty[0] = flags;
+    return any | flags;
+}
+
+// Converts a native profile to a hardware profile, copying only the dirty fields. Clean IDs are synced back to the native profile
+// so that they keep the hardware's modification numbers.
+static void nativetohw(usbprofile* profile, hwprofile* hw, int modes, const int dirty[HWMODE_MAX + 1]){
     // Copy the profile and mode names
-    memcpy(hw->name[0], profile->name, PR_NAME_LEN * 2);
-    for(int i = 0; i < modes; i++)
-        memcpy(hw->name[i + 1], profile->mode[i].name, MD_NAME_LEN * 2);
+    if(dirty[0] & DIRTY_NAME)
+        memcpy(hw->name[0], profile->name, PR_NAME_LEN * 2);
+    for(int i = 0; i < modes; i++){
+        if(dirty[i + 1] & DIRTY_NAME)
+            memcpy(hw->name[i + 1], profile->mode[i].name, MD_NAME_LEN * 2);
+    }
     // Copy the profile and mode IDs
-    updatemod(&profile->id);
-    memcpy(hw->id, &profile->id, sizeof(usbid));
+    if(dirty[0] & DIRTY_ID)
+        memcpy(hw->id, &profile->id, sizeof(usbid));
+    else
+        memcpy(&profile->id, hw->id, sizeof(usbid));
     for(int i = 0; i < modes; i++){
-        updatemod(&profile->mode[i].id);
-        memcpy(hw->id + i + 1, &profile->mode[i].id, sizeof(usbid));
+        if(dirty[i + 1] & DIRTY_ID)
+            memcpy(hw->id + i + 1, &profile->mode[i].id, sizeof(usbid));
+        else
+            memcpy(&profile->mode[i].id, hw->id + i + 1, sizeof(usbid));
     }
     // Copy the key lighting
     for(int i = 0; i < modes; i++){
@@ -344,17 +381,34 @@ int hwloadprofile(usbdevice* kb, int apply){
 int hwsaveprofile(usbdevice* kb){
     if(!IS_CONNECTED(kb) || !HAS_FEATURES(kb, FEAT_RGB))
         return 0;
+    // If the hardware profile is unknown, everything needs to be written. It stays unknown until the save succeeds
+    hwprofile* hw = kb->hw;
+    int full = !hw;
+    if(full)
+        hw = calloc(1, sizeof(hwprofile));
+    int modes = (kb->model == 95 ? HWMODE_K95 : HWMODE_K70);
+    usbprofile* profile = &kb->profile;
+    // Find out what changed. If nothing did, there's no need to save
+    int dirty[HWMODE_MAX + 1];
+    if(!hwdiff(kb, hw, full, modes, dirty)){
+        nativetohw(profile, hw, modes, dirty);
+        kb->hw = hw;
+        return 0;
+    }
+    // Assign new modification numbers to anything that's being saved
+    for(int i = 0; i <= modes; i++){
+        if(dirty[i] & DIRTY_ID)
+            updatemod(i == 0 ? &profile->id : &profile->mode[i - 1].id);
+    }
     // Empty the current USB queue first
     while(kb->queuecount > 0){
         DELAY_SHORT;
-        if(!usbdequeue(kb))
+        if(!usbdequeue(kb)){
+            if(full)
+                free(hw);
             return -1;
+        }
     }
-    hwprofile* hw = kb->hw;
-    if(!hw)
-        hw = kb->hw = calloc(1, sizeof(hwprofile));
-    int modes = (kb->model == 95 ? HWMODE_K95 : HWMODE_K70);
-    nativetohw(&kb->profile, hw, modes);
     // Save the profile and mode names
     uchar data_pkt[2][MSG_SIZE] = {
         {0x07, 0x16, 0x01, 0 },
@@ -362,25 +416,40 @@ int hwsaveprofile(usbdevice* kb){
     };
     // Save the mode names
     for(int i = 0; i <= modes; i++){
+        if(!(dirty[i] & DIRTY_NAME))
+            continue;
         data_pkt[0][3] = i;
-        memcpy(data_pkt[0] + 4, hw->name[i], MD_NAME_LEN * 2);
+        memcpy(data_pkt[0] + 4, i == 0 ? profile->name : profile->mode[i - 1].name, MD_NAME_LEN * 2);
         usbqueue(kb, data_pkt[0], 1);
     }
     // Save the IDs
     for(int i = 0; i <= modes; i++){
+        if(!(dirty[i] & DIRTY_ID))
+            continue;
         data_pkt[1][3] = i;
-        memcpy(data_pkt[1] + 4, hw->id + i, sizeof(usbid));
+        memcpy(data_pkt[1] + 4, i == 0 ? &profile->id : &profile->mode[i - 1].id, sizeof(usbid));
         usbqueue(kb, data_pkt[1], 1);
     }
     // Save the RGB data
     for(int i = 0; i < modes; i++){
-        savergb(kb, i);
+        // Lighting is saved as-is, so make sure it's enabled
+        profile->mode[i].light.enabled = 1;
+        int planes = dirty[i + 1] >> 2;
+        if(planes)
+            savergb(kb, i, planes);
         while(kb->queuecount > 0){
             DELAY_MEDIUM;
-            if(!usbdequeue(kb))
+            if(!usbdequeue(kb)){
+                if(full)
+                    free(hw);
                 return -1;
+            }
         }
     }
+    // Everything was written successfully, so the hardware profile can be updated now.
+    // (If it fails, nothing is marked as saved and the whole thing will be retried)
+    nativetohw(profile, hw, modes, dirty);
+    kb->hw = hw;
     DELAY_LONG;
     return 0;
 }
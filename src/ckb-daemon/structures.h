@@ -133,6 +133,39 @@ typedef struct {
 // Bricked firmware?
 #define NEEDS_FW_UPDATE(kb) ((kb)->fwversion == 0 && HAS_FEATURES((kb), FEAT_FWUPDATE | FEAT_FWVERSION))
 
+// USB error classes
+#define USB_ERR_NONE        0
+#define USB_ERR_TRANSIENT   1   // Timeout, stall, etc. May go away on its own
+#define USB_ERR_FATAL       2   // The device is gone
+
+// USB reset states
+#define RESET_IDLE          0
+#define RESET_RUNNING       1   // The reset thread owns the device
+#define RESET_DONE          2   // Finished, result not handled yet
+
+// USB error tracking (see usb.c)
+typedef struct {
+    // Health score, 0 - 100. Lowered by errors and slowly restored by successful transfers
+    int score, successes;
+    // Class of the last error
+    int lasterror;
+    // Consecutive failures. The device isn't used again until the retry time
+    int failures;
+    struct timespec retry;
+    // Set when the device needs to be reset. The reset is started from the main loop after the retry time
+    char resetpending;
+    // Resets run on their own thread so they don't hold up the other devices. The main loop doesn't touch the device while
+    // resetstate is RESET_RUNNING
+    volatile char resetstate;
+    int resetresult;
+    // Set if the device was removed during a reset. The main loop closes it once the reset is done
+    volatile char closepending;
+    // Lighting updates are throttled until this time while the device is degraded
+    struct timespec nextframe;
+    // Totals
+    unsigned errors, resets;
+} usbhealth;
+
 // Structure for tracking keyboard devices
 #define NAME_LEN    33
 #define QUEUE_LEN   64
@@ -177,6 +210,8 @@ typedef struct {
     // USB output queue
     uchar* queue[QUEUE_LEN];
     char queuecount;
+    // USB error tracking
+    usbhealth health;
     // Features (see F_ macros)
     char features;
     // USB vendor and product IDs
@@ -193,6 +228,12 @@ typedef struct {
     char name[NAME_LEN];
     // Whether the keyboard is being actively controlled by the driver
     char active;
+    // Last resume the device was connected or restored after (see lastresume())
+    int resumeid;
+    // Compiled command cache (see devnode.c). Null until first used
+    struct cmdcache* cmdcache;
+    // Brightness, gamma, and dimming (see led.c). Null until first used
+    struct rgbscale* rgbscale;
 } usbdevice;
 
 #endif
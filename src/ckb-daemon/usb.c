@@ -26,6 +26,7 @@ int usbqueue(usbdevice* kb, uchar* messages, int count){
 }
 
 int setupusb(usbdevice* kb, short vendor, short product){
+    kb->health.score = HEALTH_MAX;
     kb->model = (product == P_K65) ? 65 : (product == P_K70 || product == P_K70_NRGB) ? 70 : 95;
     kb->vendor = vendor;
     kb->product = product;
@@ -92,9 +93,29 @@ int setupusb(usbdevice* kb, short vendor, short product){
         return 0;
     }
 
+    // If the device is coming back after a resume, restore it from memory. The stored profile is authoritative,
+    // so the long delay and the hardware reads can be skipped
+    usbprofile* store = findstore(kb->profile.serial);
+    int active = 0;
+    hwprofile* hw = (store && !fail) ? unparkdevice(kb->profile.serial, &active) : 0;
+    if(hw){
+        printf("Restoring %s after resume\n", kb->name);
+        memcpy(&kb->profile, store, sizeof(usbprofile));
+        if(kb->model == 95){
+            getusbmode(1, &kb->profile, keymap_system);
+            getusbmode(2, &kb->profile, keymap_system);
+        }
+        kb->hw = hw;
+        // Put the lighting back right away instead of waiting for the client
+        if(active){
+            setactive(kb, 1);
+            updatergb(kb, 1);
+        }
+        return 0;
+    }
+
     // Restore profile (if any)
     DELAY_LONG;
-    usbprofile* store = findstore(kb->profile.serial);
     if(store){
         memcpy(&kb->profile, store, sizeof(usbprofile));
         if(kb->model == 95){
@@ -171,20 +192,135 @@ int _resetusb(usbdevice* kb, const char* file, int line){
     return res ? -1 : 0;
 }
 
-int usb_tryreset(usbdevice* kb){
+// Sets a device's retry time based on the number of consecutive failures
+static void backoff(usbhealth* health){
+    long delay = BACKOFF_MIN;
+    for(int i = 1; i < health->failures && delay < BACKOFF_MAX; i++)
+        delay *= 2;
+    if(delay > BACKOFF_MAX)
+        delay = BACKOFF_MAX;
+    clock_gettime(CLOCK_MONOTONIC, &health->retry);
+    timespec_add(&health->retry, delay);
+}
+
+// Clears the error state after a successful reset
+static void resetok(usbhealth* health){
+    health->failures = 0;
+    health->resetpending = 0;
+    health->lasterror = USB_ERR_NONE;
+}
+
+void usb_ok(usbdevice* kb){
+    usbhealth* health = &kb->health;
+    if(!health->resetpending)
+        health->failures = 0;
+    // Recover one point for every 16 successful transfers
+    if(health->score < HEALTH_MAX && ++health->successes >= 16){
+        health->successes = 0;
+        health->score++;
+    }
+}
+
+int usb_fail(usbdevice* kb){
+    usbhealth* health = &kb->health;
+    health->errors++;
+    health->successes = 0;
+    health->score = (health->score > HEALTH_ERROR) ? health->score - HEALTH_ERROR : 0;
+    if(health->lasterror == USB_ERR_FATAL){
+        printf("Device is no longer available. Disconnecting.\n");
+        return -1;
+    }
+    // Transient errors are retried after a delay. If they keep happening, reset the device
+    health->failures++;
+    if(health->failures > RETRY_MAX)
+        health->resetpending = 1;
+    backoff(health);
+    return 0;
+}
+
+void usb_needreset(usbdevice* kb){
+    usbhealth* health = &kb->health;
+    if(health->failures <= RETRY_MAX)
+        health->failures = RETRY_MAX + 1;
+    health->resetpending = 1;
+    backoff(health);
+}
+
+// Makes one reset attempt. The main loop skips the device until the result is in
+static void* resetmain(void* context){
+    usbdevice* kb = context;
+    pthread_mutex_lock(&kb->mutex);
     printf("Attempting reset...\n");
-    while(1){
-        DELAY_LONG;
-        int res = resetusb(kb);
+    kb->health.resets++;
+    kb->health.resetresult = resetusb(kb);
+    kb->health.resetstate = RESET_DONE;
+    pthread_mutex_unlock(&kb->mutex);
+    return 0;
+}
+
+int usb_ready(usbdevice* kb){
+    usbhealth* health = &kb->health;
+    if(health->closepending)
+        return -1;
+    if(health->resetstate == RESET_DONE){
+        health->resetstate = RESET_IDLE;
+        int res = health->resetresult;
         if(!res){
             printf("Reset success\n");
+            resetok(health);
             return 0;
         }
-        if(res == -2)
-            break;
+        // If it failed, wait longer before the next attempt rather than retrying right away
+        if(res == -2 || health->failures - RETRY_MAX >= RESET_MAX){
+            printf("Reset failed. Disconnecting.\n");
+            return -1;
+        }
+        health->failures++;
+        backoff(health);
+        return 1;
+    }
+    if(!health->failures)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(timespec_gt(health->retry, now))
+        return 1;
+    if(!health->resetpending)
+        return 0;
+    // Start the reset. The device mutex is held by the reset thread until it's finished
+    health->resetstate = RESET_RUNNING;
+    pthread_t thread;
+    if(pthread_create(&thread, 0, resetmain, kb)){
+        health->resetstate = RESET_IDLE;
+        printf("Error: Failed to start reset thread\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+void usb_remove(usbdevice* kb){
+    if(kb->health.resetstate == RESET_RUNNING){
+        kb->health.closepending = 1;
+        return;
     }
-    printf("Reset failed. Disconnecting.\n");
-    return -1;
+    pthread_mutex_lock(&kb->mutex);
+    closeusb(kb);
+}
+
+int usb_throttle(usbdevice* kb){
+    usbhealth* health = &kb->health;
+    if(health->score >= HEALTH_DEGRADED)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(timespec_gt(health->nextframe, now))
+        return 1;
+    // Send at half the frame rate, or a quarter if the device is doing very badly
+    long interval = 1000000000 / fps * (health->score < HEALTH_DEGRADED / 2 ? 4 : 2);
+    memcpy(&health->nextframe, &now, sizeof(now));
+    timespec_add(&health->nextframe, interval);
+    return 0;
 }
 
 int closeusb(usbdevice* kb){
@@ -205,6 +341,11 @@ int closeusb(usbdevice* kb){
         else {
             usbprofile* store = addstore(kb->profile.serial, 0);
             memcpy(store, &kb->profile, sizeof(usbprofile));
+            // Keep the hardware profile in case the device is coming back after a resume
+            if(HAS_FEATURES(kb, FEAT_RGB) && kb->hw){
+                parkdevice(kb->profile.serial, kb->hw, kb->active);
+                kb->hw = 0;
+            }
         }
         // Close USB device
         closehandle(kb);
@@ -213,6 +354,8 @@ int closeusb(usbdevice* kb){
         updateconnected();
     // Delete the control path
     rmdevpath(kb);
+    freecmdcache(kb);
+    freergbscale(kb);
 
     pthread_mutex_unlock(&kb->keymutex);
     pthread_mutex_destroy(&kb->keymutex);
@@ -28,6 +28,9 @@
 #define DELAY_MEDIUM    usleep(20000)
 #define DELAY_LONG      usleep(200000)
 
+// Total time the system has spent suspended since boot, in nanoseconds. Returns 0 if this can't be determined.
+long long os_suspendtime();
+
 // Start the USB system. Returns 0 on success
 int usbinit();
 // Stop the USB system.
@@ -73,8 +76,33 @@ int _nk95cmd(usbdevice* kb, uchar bRequest, ushort wValue, const char* file, int
 #define NK95_M2     0x140002
 #define NK95_M3     0x140003
 
-// Tries to reset a USB device after a failed action. Returns 0 on success.
+// Error recovery. Transient errors back off exponentially before retrying, and a reset is only attempted after RETRY_MAX
+// consecutive failures. While a device's health score is low its lighting updates are throttled.
+#define HEALTH_MAX          100
+#define HEALTH_ERROR        20          // Score lost per error
+#define HEALTH_DEGRADED     60          // Below this, lighting is throttled
+#define RETRY_MAX           3           // Failures before a reset is needed
+#define RESET_MAX           5           // Reset attempts before the device is closed
+#define BACKOFF_MIN         10000000    // First retry delay (ns)
+#define BACKOFF_MAX         2000000000  // Longest retry delay (ns)
+
+// Records a successful transfer
+void usb_ok(usbdevice* kb);
+// Records a failed transfer. Returns 0 if the device should be retried later or -1 if it should be closed.
+int usb_fail(usbdevice* kb);
+// Marks a device as needing a reset after a failed action and returns right away. The reset is started by usb_ready().
 // The previous action will NOT be re-attempted and the keyboard's USB queue will be cleared.
-int usb_tryreset(usbdevice* kb);
+// Threading: Lock the device mutex before calling
+void usb_needreset(usbdevice* kb);
+// Checks whether a device is ready after a failure. If a reset is pending and the retry time has come, one attempt is
+// started on a separate thread. Returns 0 if ready, 1 if the device is still backing off or being reset, or -1 if it should
+// be closed.
+// Threading: Lock the device mutex before calling. Don't call it (or use the device at all) while resetstate is RESET_RUNNING
+int usb_ready(usbdevice* kb);
+// Closes a device that was removed. If it's being reset, it's closed by the main loop once the reset is done instead.
+// Threading: Lock kblistmutex (but not the device mutex) before calling
+void usb_remove(usbdevice* kb);
+// Returns 1 if a lighting update should be skipped because the device is degraded
+int usb_throttle(usbdevice* kb);
 
 #endif
@@ -1,11 +1,27 @@
 #include "device.h"
 #include "devnode.h"
 #include "input.h"
+#include "led.h"
 #include "notify.h"
 #include "usb.h"
 
 #ifdef OS_LINUX
 
+long long os_suspendtime(){
+    // CLOCK_BOOTTIME includes suspend, CLOCK_MONOTONIC doesn't
+    struct timespec boot, mono;
+    if(clock_gettime(CLOCK_BOOTTIME, &boot) || clock_gettime(CLOCK_MONOTONIC, &mono))
+        return 0;
+    return (boot.tv_sec - mono.tv_sec) * 1000000000LL + boot.tv_nsec - mono.tv_nsec;
+}
+
+// Classifies a failed transfer
+static int usberror(int res){
+    if(res < 0 && (errno == ENODEV || errno == ENOENT || errno == ESHUTDOWN))
+        return USB_ERR_FATAL;
+    return USB_ERR_TRANSIENT;
+}
+
 int _usbdequeue(usbdevice* kb, const char* file, int line){
     if(kb->queuecount == 0 || !kb->handle || !HAS_FEATURES(kb, FEAT_RGB))
         return -1;
@@ -18,7 +34,8 @@ int _usbdequeue(usbdevice* kb, const char* file, int line){
         res = ioctl(kb->handle, USBDEVFS_CONTROL, &transfer);
     }
     if(res <= 0){
-        printf("usbdequeue (%s:%d): %s\n", file, line, res ? strerror(-res) : "No data written");
+        kb->health.lasterror = usberror(res);
+        printf("usbdequeue (%s:%d): %s\n", file, line, res ? strerror(errno) : "No data written");
         return 0;
     }
     if(res != MSG_SIZE)
@@ -38,7 +55,8 @@ int _usbinput(usbdevice* kb, uchar* message, const char* file, int line){
     struct usbdevfs_ctrltransfer transfer = { 0xa1, 0x01, 0x0300, 0x03, MSG_SIZE, 5000, message };
     int res = ioctl(kb->handle, USBDEVFS_CONTROL, &transfer);
     if(res <= 0){
-        printf("usbinput (%s:%d): %s\n", file, line, res ? strerror(-res) : "No data read");
+        kb->health.lasterror = usberror(res);
+        printf("usbinput (%s:%d): %s\n", file, line, res ? strerror(errno) : "No data read");
         return 0;
     }
     if(res != MSG_SIZE)
@@ -236,6 +254,25 @@ int os_resetusb(usbdevice* kb, const char* file, int line){
     return 0;
 }
 
+// Restores a device after a resume without reconnecting it. The interfaces are reclaimed and the in-memory state is sent
+// again; nothing is read back from the hardware. If the interfaces can't be reclaimed, the device is reset from the main loop.
+static void resumeusb(usbdevice* kb){
+    printf("Restoring %s after resume\n", kb->name);
+    if(usbclaim(kb, HAS_FEATURES(kb, FEAT_RGB))){
+        printf("Error: Failed to reclaim interface: %s\n", strerror(errno));
+        usb_needreset(kb);
+        return;
+    }
+    if(!HAS_FEATURES(kb, FEAT_RGB)){
+        nk95cmd(kb, NK95_HWOFF);
+        return;
+    }
+    kb->queuecount = 0;
+    setactive(kb, kb->active);
+    updateindicators(kb, 1);
+    updatergb(kb, 1);
+}
+
 int openusb(struct udev_device* dev, short vendor, short product){
     // Make sure it's not connected yet
     const char* path = udev_device_get_devnode(dev);
@@ -251,6 +288,8 @@ int openusb(struct udev_device* dev, short vendor, short product){
         if(!IS_CONNECTED(kb)){
             // Open the sysfs device
             kb->udev = dev;
+            // A device connected after a resume doesn't need to be restored from it
+            kb->resumeid = lastresume();
             kb->handle = open(path, O_RDWR);
             if(kb->handle <= 0){
                 printf("Error: Failed to open USB device: %s\n", strerror(errno));
@@ -297,14 +336,9 @@ int openusb(struct udev_device* dev, short vendor, short product){
                 printf("Failed to set up device.\n");
                 closehandle(kb);
                 return -1;
-            } else if(setup && usb_tryreset(kb)){
-                // Any other failure is hardware based. Reset and try again.
-                closehandle(kb);
-                pthread_mutex_unlock(&kb->mutex);
-                pthread_mutex_destroy(&kb->mutex);
-                pthread_mutex_destroy(&kb->keymutex);
-                DELAY_LONG;
-                return -1;
+            } else if(setup){
+                // Any other failure is hardware based. Reset from the main loop, which disconnects it if that fails too
+                usb_needreset(kb);
             }
 
             kb->INPUT_READY = 1;
@@ -414,14 +448,32 @@ void* udevmain(void* context){
                     if(found)
                         continue;
                 }
+            } else if(!strcmp(action, "change")){
+                // Device changed. If the system just resumed without the device disconnecting, restore it in place.
+                // Other change events are ignored, and each device is only restored once per resume
+                int resume = lastresume();
+                pthread_mutex_lock(&kblistmutex);
+                const char* path = udev_device_get_syspath(dev);
+                for(int i = 1; resume && i < DEV_MAX; i++){
+                    if(keyboard[i].udev && !strcmp(path, udev_device_get_syspath(keyboard[i].udev))){
+                        // A device that's being reset will be reclaimed by the reset anyway
+                        if(keyboard[i].resumeid != resume && keyboard[i].health.resetstate != RESET_RUNNING){
+                            keyboard[i].resumeid = resume;
+                            pthread_mutex_lock(&keyboard[i].mutex);
+                            resumeusb(keyboard + i);
+                            pthread_mutex_unlock(&keyboard[i].mutex);
+                        }
+                        break;
+                    }
+                }
+                pthread_mutex_unlock(&kblistmutex);
             } else if(!strcmp(action, "remove")){
                 // Device removed. Look for it in our list of keyboards
                 pthread_mutex_lock(&kblistmutex);
                 const char* path = udev_device_get_syspath(dev);
                 for(int i = 1; i < DEV_MAX; i++){
                     if(keyboard[i].udev && !strcmp(path, udev_device_get_syspath(keyboard[i].udev))){
-                        pthread_mutex_lock(&keyboard[i].mutex);
-                        closeusb(keyboard + i);
+                        usb_remove(keyboard + i);
                         break;
                     }
                 }
@@ -8,6 +8,18 @@
 
 #define INCOMPLETE (IOHIDDeviceRef)-1l
 
+long long os_suspendtime(){
+    // Not available
+    return 0;
+}
+
+// Classifies a failed transfer
+static int usberror(IOReturn res){
+    if(res == kIOReturnNoDevice || res == kIOReturnNotAttached)
+        return USB_ERR_FATAL;
+    return USB_ERR_TRANSIENT;
+}
+
 int _usbdequeue(usbdevice* kb, const char* file, int line){
     if(kb->queuecount == 0 || !kb->handle || !HAS_FEATURES(kb, FEAT_RGB))
         return -1;
@@ -20,6 +32,7 @@ int _usbdequeue(usbdevice* kb, const char* file, int line){
     kb->queuecount--;
     kb->lastError = res;
     if(res != kIOReturnSuccess && res != 0xe0004051){   // Can't find e0004051 documented, but it seems to be a harmless error, so ignore it.
+        kb->health.lasterror = usberror(res);
         printf("usbdequeue (%s:%d): Got return value 0x%x\n", file, line, res);
         return 0;
     }
@@ -33,6 +46,7 @@ int _usbinput(usbdevice* kb, uchar* message, const char* file, int line){
     IOReturn res = IOHIDDeviceGetReport(kb->handle, kIOHIDReportTypeFeature, 0, message, &length);
     kb->lastError = res;
     if(res != kIOReturnSuccess && res != 0xe0004051){
+        kb->health.lasterror = usberror(res);
         printf("usbinput (%s:%d): Got return value 0x%x\n", file, line, res);
         return 0;
     }
@@ -72,10 +86,8 @@ void usbremove(void* context, IOReturn result, void* sender){
     pthread_mutex_lock(&kblistmutex);
     usbdevice* kb = context;
     for(int i = 0; i < DEV_MAX; i++){
-        if(keyboard + i == kb){
-            pthread_mutex_lock(&keyboard[i].mutex);
-            closeusb(keyboard + i);
-        }
+        if(keyboard + i == kb)
+            usb_remove(keyboard + i);
     }
     pthread_mutex_unlock(&kblistmutex);
 }
@@ -134,13 +146,15 @@ void openusb(usbdevice* kb, short vendor, short product){
 
     // Set up the device
     int setup = setupusb(kb, vendor, product);
-    if(setup == -1 || (setup && usb_tryreset(kb))){
+    if(setup == -1){
         closehandle(kb);
         pthread_mutex_unlock(&kb->mutex);
         pthread_mutex_destroy(&kb->mutex);
         pthread_mutex_destroy(&kb->keymutex);
         return;
-    }
+    } else if(setup)
+        // Any other failure is hardware based. Reset from the main loop, which disconnects it if that fails too
+        usb_needreset(kb);
 
     // Start handling HID reports for the input
     IOHIDDeviceRegisterInputReportCallback(kb->handles[0], kb->urbinput, 8, reportcallback, kb);
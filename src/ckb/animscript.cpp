@@ -1,21 +1,70 @@
 #include <cmath>
 #include <QApplication>
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDataStream>
 #include <QDateTime>
 #include <QDebug>
 #include <QDir>
+#include <QElapsedTimer>
+#include <QLibrary>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThread>
+#include <QTimer>
 #include <QUrl>
 #include "animscript.h"
 
+#define CKB_NO_MAIN
+#include "ckb-anim.h"
+
 QHash<QUuid, AnimScript*> AnimScript::scripts;
+bool AnimScript::_pluginsEnabled = false;
+
+// Monotonic clock for frame statistics. Started on first use; this is thread-safe as it's a local static's constructor
+struct MonotonicTimer {
+    QElapsedTimer timer;
+    MonotonicTimer() { timer.start(); }
+};
+
+static qint64 nsecs(){
+    static MonotonicTimer monotonic;
+    return monotonic.timer.nsecsElapsed();
+}
+
+struct AnimScript::Plugin {
+    QLibrary library;
+    const ckb_plugin* functions;
+    // Run context. The keys are null when the plugin isn't running
+    ckb_runctx context;
+    QVector<ckb_key> keys;
+
+    Plugin(const QString& path) : library(path), functions(0) { memset(&context, 0, sizeof(context)); }
+};
 
 AnimScript::AnimScript(QObject* parent, const QString& path) :
-    QObject(parent), _path(path), initialized(false), process(0)
+    QObject(parent), _path(path), initialized(false), warm(false), sharedPid(0), process(0), shmFile(0), shmKeys(0), sharedFrames(false), plugin(0), runningCalls(false)
 {
+    memset(&_stats, 0, sizeof(_stats));
+    memset(&sharedStats, 0, sizeof(sharedStats));
+    if(QLibrary::isLibrary(path))
+        plugin = new Plugin(path);
 }
 
 AnimScript::AnimScript(QObject* parent, const AnimScript& base) :
-    QObject(parent), _info(base._info), _path(base._path), initialized(false), process(0)
+    QObject(parent), _info(base._info), _path(base._path), initialized(false), warm(false), sharedPid(0), process(0), shmFile(0), shmKeys(0), sharedFrames(false), plugin(0), runningCalls(false)
 {
+    memset(&_stats, 0, sizeof(_stats));
+    memset(&sharedStats, 0, sizeof(sharedStats));
+    if(base.plugin){
+        // Each copy holds its own reference to the library so that it stays loaded even if the original is deleted
+        plugin = new Plugin(_path);
+        if(!loadPlugin()){
+            delete plugin;
+            plugin = 0;
+            _path = "";
+        }
+    }
 }
 
 AnimScript::~AnimScript(){
@@ -24,6 +73,16 @@ AnimScript::~AnimScript(){
         process->waitForFinished(1000);
         delete process;
     }
+    closeShared();
+    if(plugin){
+        stopPlugin();
+        plugin->library.unload();
+        delete plugin;
+    }
+}
+
+inline bool AnimScript::isRunning() const {
+    return process || (plugin && plugin->context.keys);
 }
 
 QString AnimScript::path(){
@@ -34,18 +93,212 @@ QString AnimScript::path(){
 #endif
 }
 
+static const quint32 INFO_CACHE_VERSION = 1;
+
+static QString infoCachePath(){
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    QDir().mkpath(dir);
+    return QDir(dir).absoluteFilePath("animations");
+}
+
+QHash<QString, AnimScanner::Entry> AnimScanner::readCache(){
+    QHash<QString, Entry> cache;
+    QFile file(infoCachePath());
+    if(!file.open(QIODevice::ReadOnly))
+        return cache;
+    QDataStream stream(&file);
+    quint32 version, count;
+    stream >> version >> count;
+    if(version != INFO_CACHE_VERSION)
+        return cache;
+    for(quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++){
+        Entry entry;
+        stream >> entry.path >> entry.modified >> entry.size >> entry.hash >> entry.info;
+        entry.ok = true;
+        if(stream.status() == QDataStream::Ok)
+            cache[entry.path] = entry;
+    }
+    return cache;
+}
+
+void AnimScanner::writeCache(const QList<Entry>& entries){
+    // Written to a temporary file first, so that an interrupted write doesn't leave a truncated cache behind
+    QSaveFile file(infoCachePath());
+    if(!file.open(QIODevice::WriteOnly))
+        return;
+    quint32 count = 0;
+    foreach(const Entry& entry, entries){
+        if(entry.ok)
+            count++;
+    }
+    QDataStream stream(&file);
+    stream << INFO_CACHE_VERSION << count;
+    foreach(const Entry& entry, entries){
+        if(entry.ok)
+            stream << entry.path << entry.modified << entry.size << entry.hash << entry.info;
+    }
+    if(stream.status() != QDataStream::Ok){
+        file.cancelWriting();
+        return;
+    }
+    file.commit();
+}
+
+static QByteArray fileHash(const QString& path){
+    QFile file(path);
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if(!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+    while(!file.atEnd())
+        hash.addData(file.read(64 * 1024));
+    return hash.result();
+}
+
+AnimScanner AnimScanner::_instance;
+
+AnimScanner::AnimScanner() :
+    active(false)
+{
+}
+
+void AnimScanner::start(const QList<Entry>& newEntries, const QList<int>& probes){
+    cancel();
+    entries = newEntries;
+    queue = probed = probes;
+    active = true;
+    next();
+    if(!isScanning())
+        done();
+}
+
+void AnimScanner::cancel(){
+    foreach(QProcess* process, running.keys()){
+        disconnect(process, 0, this, 0);
+        // Kills the process and waits for it
+        delete process;
+    }
+    running.clear();
+    queue.clear();
+    probed.clear();
+    entries.clear();
+    active = false;
+}
+
+void AnimScanner::next(){
+    // Several scripts are run at once, one per core
+    int maxRunning = qMax(QThread::idealThreadCount(), 1);
+    while(!queue.isEmpty() && running.count() < maxRunning){
+        int index = queue.takeFirst();
+        qDebug() << "Scanning " << entries[index].path;
+        QProcess* process = new QProcess(this);
+        running[process] = index;
+        connect(process, SIGNAL(finished(int)), this, SLOT(probeFinished()));
+        connect(process, SIGNAL(error(QProcess::ProcessError)), this, SLOT(probeError(QProcess::ProcessError)));
+        process->start(entries[index].path, QStringList("--ckb-info"));
+        // Each script has 1s to finish
+        QTimer::singleShot(1000, process, SLOT(kill()));
+    }
+}
+
+void AnimScanner::probeFinished(){
+    QProcess* process = qobject_cast<QProcess*>(sender());
+    if(!running.contains(process))
+        return;
+    // Scripts which had to be killed aren't cached, so they're tried again on the next scan
+    if(process->exitStatus() == QProcess::NormalExit){
+        Entry& entry = entries[running.value(process)];
+        entry.info = process->readAll();
+        entry.ok = true;
+    }
+    remove(process);
+}
+
+void AnimScanner::probeError(QProcess::ProcessError error){
+    // Other errors are followed by finished()
+    QProcess* process = qobject_cast<QProcess*>(sender());
+    if(error == QProcess::FailedToStart && running.contains(process))
+        remove(process);
+}
+
+void AnimScanner::remove(QProcess* process){
+    running.remove(process);
+    disconnect(process, 0, this, 0);
+    process->deleteLater();
+    next();
+    if(!isScanning())
+        done();
+}
+
+void AnimScanner::done(){
+    if(!active)
+        return;
+    active = false;
+    writeCache(entries);
+    foreach(int index, probed){
+        const Entry& entry = entries[index];
+        if(entry.ok)
+            AnimScript::add(entry.path, entry.info);
+    }
+    entries.clear();
+    probed.clear();
+    emit finished();
+}
+
 void AnimScript::scan(){
     QDir dir(path());
     foreach(AnimScript* script, scripts)
         delete script;
     scripts.clear();
-    foreach(QString file, dir.entryList(QDir::Files | QDir::Executable)){
-        AnimScript* script = new AnimScript(qApp, dir.absoluteFilePath(file));
-        if(script->load() && !scripts.contains(script->_info.guid))
-            scripts[script->_info.guid] = script;
-        else
-            delete script;
+    // Find the scripts whose info isn't in the cache
+    QHash<QString, AnimScanner::Entry> cache = AnimScanner::readCache();
+    QList<AnimScanner::Entry> entries;
+    foreach(QString file, dir.entryList(QDir::Files)){
+        // Scripts are either executables or shared libraries (see ckb-anim.h). Libraries are skipped unless plugins are enabled
+        QFileInfo fileInfo(dir.absoluteFilePath(file));
+        if(QLibrary::isLibrary(file) ? !_pluginsEnabled : !fileInfo.isExecutable())
+            continue;
+        AnimScanner::Entry entry = { fileInfo.absoluteFilePath(), fileInfo.lastModified().toMSecsSinceEpoch(), fileInfo.size(), QByteArray(), QByteArray(), false };
+        // If the modification time changed, it's still the same script as long as the contents are the same
+        if(cache.contains(entry.path)){
+            const AnimScanner::Entry& cached = cache.value(entry.path);
+            if(cached.size == entry.size){
+                if(cached.modified != entry.modified)
+                    entry.hash = fileHash(entry.path);
+                if(cached.modified == entry.modified || cached.hash == entry.hash){
+                    entry.hash = cached.hash;
+                    entry.info = cached.info;
+                    entry.ok = true;
+                }
+            }
+        }
+        if(!entry.ok && entry.hash.isEmpty())
+            entry.hash = fileHash(entry.path);
+        entries.append(entry);
+    }
+    // Load the cached scripts now. Plugins that changed are loaded as well; scripts that changed are run in the background
+    QList<int> probes;
+    for(int i = 0; i < entries.count(); i++){
+        AnimScanner::Entry& entry = entries[i];
+        if(!entry.ok && QLibrary::isLibrary(entry.path)){
+            qDebug() << "Scanning " << entry.path;
+            AnimScript script(0, entry.path);
+            entry.info = script.pluginInfo();
+            entry.ok = !entry.info.isEmpty();
+        }
+        if(entry.ok)
+            add(entry.path, entry.info);
+        else if(!QLibrary::isLibrary(entry.path))
+            probes.append(i);
     }
+    AnimScanner::instance()->start(entries, probes);
+}
+
+void AnimScript::add(const QString& path, const QByteArray& info){
+    AnimScript* script = new AnimScript(qApp, path);
+    if(script->load(info) && !scripts.contains(script->_info.guid))
+        scripts[script->_info.guid] = script;
+    else
+        delete script;
 }
 
 QList<const AnimScript*> AnimScript::list(){
@@ -74,24 +327,51 @@ inline QString urlParam(const QString& param){
 
 const static double ONE_DAY = 24. * 60. * 60.;
 
-bool AnimScript::load(){
-    // Run the process to get script info
-    QProcess infoProcess;
-    infoProcess.start(_path, QStringList("--ckb-info"));
-    qDebug() << "Scanning " << _path;
-    infoProcess.waitForFinished(1000);
-    if(infoProcess.state() == QProcess::Running){
-        // Kill the process if it takes more than 1s
-        infoProcess.kill();
+bool AnimScript::loadPlugin(){
+    if(!plugin->library.load()){
+        qDebug() << plugin->library.errorString();
+        return false;
+    }
+    typedef const ckb_plugin* (*getPlugin)();
+    getPlugin get = (getPlugin)plugin->library.resolve("ckb_plugin_get");
+    const ckb_plugin* functions = get ? get() : 0;
+    if(!functions || functions->version != CKB_PLUGIN_VERSION){
+        plugin->library.unload();
         return false;
     }
+    plugin->functions = functions;
+    return true;
+}
+
+QByteArray AnimScript::pluginInfo(){
+    // Load the library and have it print its info to a temporary file
+    QByteArray output;
+    if(!plugin || !loadPlugin())
+        return output;
+    FILE* info = tmpfile();
+    if(!info)
+        return output;
+    plugin->functions->info(info);
+    rewind(info);
+    char buffer[4096];
+    size_t length;
+    while((length = fread(buffer, 1, sizeof(buffer), info)) > 0)
+        output.append(buffer, length);
+    fclose(info);
+    return output;
+}
+
+bool AnimScript::load(const QByteArray& info){
+    QByteArray output = info;
+    QBuffer infoBuffer(&output);
+    infoBuffer.open(QIODevice::ReadOnly);
     // Set defaults for performance info
     _info.kpMode = KP_NONE;
     _info.absoluteTime = _info.preempt = _info.liveParams = false;
     _info.repeat = true;
     // Read output
     QString line;
-    while((line = infoProcess.readLine()) != ""){
+    while((line = infoBuffer.readLine()) != ""){
         line = line.trimmed();
         QStringList components = line.split(" ");
         int count = components.count();
@@ -230,16 +510,80 @@ bool AnimScript::load(){
     return true;
 }
 
+bool AnimScript::queue(const Call& call){
+    if(QThread::currentThread() == thread()){
+        if(!runningCalls)
+            runCalls();
+        return false;
+    }
+    callLock.lock();
+    calls.append(call);
+    bool first = (calls.count() == 1);
+    callLock.unlock();
+    if(first)
+        metaObject()->invokeMethod(this, "runCalls", Qt::QueuedConnection);
+    return true;
+}
+
+void AnimScript::runCalls(){
+    if(runningCalls)
+        return;
+    runningCalls = true;
+    // More calls may be queued while these are running, so keep going until there are none left
+    while(1){
+        callLock.lock();
+        QVector<Call> pending = calls;
+        calls.clear();
+        callLock.unlock();
+        if(pending.isEmpty())
+            break;
+        foreach(const Call& call, pending){
+            switch(call.type){
+            case Call::INIT:
+                init(call.map, call.keys, call.params);
+                break;
+            case Call::PARAMETERS:
+                parameters(call.params);
+                break;
+            case Call::RETRIGGER:
+                retrigger(call.timestamp, call.flag);
+                break;
+            case Call::KEYPRESS:
+                keypress(call.key, call.flag, call.timestamp);
+                break;
+            case Call::STOP:
+                stop();
+                break;
+            case Call::WARM_UP:
+                warmUp();
+                break;
+            }
+        }
+    }
+    runningCalls = false;
+}
+
 void AnimScript::init(const KeyMap& map, const QStringList& keys, const QMap<QString, QVariant>& paramValues){
+    Call call;
+    call.type = Call::INIT;
+    call.map = map;
+    call.keys = keys;
+    call.params = paramValues;
+    if(queue(call))
+        return;
     if(_path == "")
         return;
     stop();
     _map = map;
     _keys = keys;
+    _colors.fill(0, map.count());
+    _colorMask.fill(false, map.count());
     _paramValues = paramValues;
     setDuration();
-    stopped = firstFrame = false;
+    stopped = false;
     initialized = true;
+    memset(&_stats, 0, sizeof(_stats));
+    publishStats();
 }
 
 void AnimScript::setDuration(){
@@ -255,7 +599,12 @@ void AnimScript::setDuration(){
 }
 
 void AnimScript::parameters(const QMap<QString, QVariant>& paramValues){
-    if(!initialized || !process || !_info.liveParams)
+    Call call;
+    call.type = Call::PARAMETERS;
+    call.params = paramValues;
+    if(queue(call))
+        return;
+    if(!initialized || !isRunning() || !_info.liveParams)
         return;
     _paramValues = paramValues;
     setDuration();
@@ -263,6 +612,16 @@ void AnimScript::parameters(const QMap<QString, QVariant>& paramValues){
 }
 
 void AnimScript::printParams(){
+    if(plugin){
+        if(stopped)
+            return;
+        QMapIterator<QString, QVariant> i(_paramValues);
+        while(i.hasNext()){
+            i.next();
+            plugin->functions->parameter(&plugin->context, i.key().toLatin1().constData(), i.value().toString().toUtf8().constData());
+        }
+        return;
+    }
     process->write("begin params\n");
     QMapIterator<QString, QVariant> i(_paramValues);
     while(i.hasNext()){
@@ -280,58 +639,179 @@ void AnimScript::start(quint64 timestamp){
     if(!initialized)
         return;
     stop();
-    stopped = firstFrame = readFrame = readAnyFrame = false;
-    process = new QProcess(this);
-    connect(process, SIGNAL(readyRead()), this, SLOT(readProcess()));
-    process->start(_path, QStringList("--ckb-run"));
-    qDebug() << "Starting " << _path;
+    stopped = readAnyFrame = false;
+    warm = false;
+    pendingFrames.clear();
     // Determine the upper left corner of the given keys
     QStringList keysCopy = _keys;
     minX = INT_MAX;
     minY = INT_MAX;
+    keyOrder.clear();
+    keySlot.fill(-1, _map.count());
     foreach(const QString& key, keysCopy){
-        const KeyPos* pos = _map.key(key);
-        if(!pos){
+        int index = _map.index(key);
+        if(index < 0){
             keysCopy.removeAll(key);
             continue;
         }
+        if(keySlot[index] < 0)
+            keySlot[index] = keyOrder.count();
+        keyOrder.append(index);
+        const KeyPos* pos = _map.key(index);
         if(pos->x < minX)
             minX = pos->x;
         if(pos->y < minY)
             minY = pos->y;
     }
+    lastFrame = timestamp;
+    if(plugin){
+        startPlugin(keysCopy);
+        return;
+    }
+    process = new QProcess(this);
+    connect(process, SIGNAL(readyRead()), this, SLOT(readProcess()));
+    process->start(_path, QStringList("--ckb-run"));
+    qDebug() << "Starting " << _path;
+    // Offer the shared frame buffer. Older scripts ignore this and print their frames as text
+    if(openShared(keysCopy))
+        process->write("protocol 2 " + QUrl::toPercentEncoding(shmFile->fileName()) + "\n");
     // Write the keymap to the process
     process->write("begin keymap\n");
     process->write(QString("keycount %1\n").arg(keysCopy.count()).toLatin1());
-    foreach(const QString& key, keysCopy){
-        const KeyPos* pos = _map.key(key);
-        process->write(QString("key %1 %2,%3\n").arg(key).arg(pos->x - minX).arg(pos->y - minY).toLatin1());
+    for(int i = 0; i < keysCopy.count(); i++){
+        const KeyPos* pos = _map.key(keyOrder[i]);
+        process->write(QString("key %1 %2,%3\n").arg(keysCopy[i]).arg(pos->x - minX).arg(pos->y - minY).toLatin1());
     }
     process->write("end keymap\n");
     // Write parameters
     printParams();
     // Begin animating
     process->write("begin run\n");
-    lastFrame = timestamp;
+}
+
+void AnimScript::begin(quint64 timestamp){
+    if(!isRunning())
+        start(timestamp);
+    else if(warm){
+        // The animation hasn't seen any time pass yet, so it begins now
+        lastFrame = timestamp;
+        warm = false;
+    }
+}
+
+void AnimScript::warmUp(){
+    Call call;
+    call.type = Call::WARM_UP;
+    if(queue(call))
+        return;
+    if(!initialized || isRunning())
+        return;
+    start(QDateTime::currentMSecsSinceEpoch());
+    warm = true;
+}
+
+void AnimScript::startPlugin(const QStringList& keys){
+    // Plugins get the same keymap and parameters as a script process would, except that they're passed directly
+    int count = keys.count();
+    if(count == 0){
+        stopped = true;
+        return;
+    }
+    qDebug() << "Starting " << _path;
+    plugin->keys.fill(ckb_key(), count);
+    ckb_runctx& context = plugin->context;
+    memset(&context, 0, sizeof(context));
+    for(int i = 0; i < count; i++){
+        ckb_key& key = plugin->keys[i];
+        const KeyPos* pos = _map.key(keyOrder[i]);
+        memset(&key, 0, sizeof(key));
+        strncpy(key.name, keys[i].toLatin1().constData(), CKB_KEYNAME_MAX);
+        key.x = pos->x - minX;
+        key.y = pos->y - minY;
+        if((unsigned)key.x >= context.width)
+            context.width = key.x + 1;
+        if((unsigned)key.y >= context.height)
+            context.height = key.y + 1;
+    }
+    context.keys = plugin->keys.data();
+    context.keycount = count;
+    plugin->functions->init(&context);
+    printParams();
+}
+
+void AnimScript::readPlugin(){
+    const ckb_key* keys = plugin->context.keys;
+    int count = keyOrder.count();
+    for(int i = 0; i < count; i++){
+        const ckb_key& key = keys[i];
+        int index = keyOrder[i];
+        _colors[index] = qRgba(key.r, key.g, key.b, key.a);
+        _colorMask.setBit(index);
+    }
+    readAnyFrame = true;
+}
+
+void AnimScript::stopPlugin(){
+    if(!plugin->context.keys)
+        return;
+    if(plugin->functions->deinit)
+        plugin->functions->deinit(&plugin->context);
+    memset(&plugin->context, 0, sizeof(plugin->context));
+    plugin->keys.clear();
 }
 
 void AnimScript::retrigger(quint64 timestamp, bool allowPreempt){
+    Call call;
+    call.type = Call::RETRIGGER;
+    call.timestamp = timestamp;
+    call.flag = allowPreempt;
+    if(queue(call))
+        return;
     if(!initialized)
         return;
     if(allowPreempt && _info.preempt && repeatMsec > 0)
         // If preemption is wanted, trigger the animation 1 duration in the past first
         retrigger(timestamp - repeatMsec);
-    if(!process)
-        start(timestamp);
+    begin(timestamp);
+    if(plugin){
+        if(!stopped){
+            nextFrame(timestamp);
+            plugin->functions->start(&plugin->context);
+        }
+        return;
+    }
     nextFrame(timestamp);
     process->write("start\n");
 }
 
 void AnimScript::keypress(const QString& key, bool pressed, quint64 timestamp){
+    Call call;
+    call.type = Call::KEYPRESS;
+    call.key = key;
+    call.flag = pressed;
+    call.timestamp = timestamp;
+    if(queue(call))
+        return;
     if(!initialized)
         return;
-    if(!process)
-        start(timestamp);
+    begin(timestamp);
+    if(plugin && _info.kpMode != KP_NONE){
+        if(stopped)
+            return;
+        // Find the key given to the plugin, if any. By position, the event is still sent if the key wasn't given
+        int index = _map.index(key);
+        int slot = (index >= 0) ? keySlot[index] : -1;
+        ckb_key* ckbKey = (slot >= 0) ? plugin->context.keys + slot : 0;
+        const KeyPos* kp = (index >= 0) ? _map.key(index) : 0;
+        if(!ckbKey && (_info.kpMode == KP_NAME || !kp))
+            return;
+        nextFrame(timestamp);
+        if(ckbKey)
+            plugin->functions->keypress(&plugin->context, ckbKey, ckbKey->x, ckbKey->y, pressed);
+        else
+            plugin->functions->keypress(&plugin->context, 0, kp->x - minX, kp->y - minY, pressed);
+        return;
+    }
     switch(_info.kpMode){
     case KP_NONE:
         // If KPs aren't allowed, call retrigger instead
@@ -355,17 +835,70 @@ void AnimScript::keypress(const QString& key, bool pressed, quint64 timestamp){
 }
 
 void AnimScript::stop(){
-    _colors.clear();
+    Call call;
+    call.type = Call::STOP;
+    if(queue(call))
+        return;
+    warm = false;
+    _colors.fill(0);
+    _colorMask.fill(false);
     if(process){
         process->kill();
         connect(process, SIGNAL(finished(int)), process, SLOT(deleteLater()));
         disconnect(process, SIGNAL(readyRead()), this, SLOT(readProcess()));
         process = 0;
     }
+    closeShared();
+    if(plugin)
+        stopPlugin();
+    publishStats();
+}
+
+bool AnimScript::openShared(const QStringList& keys){
+    closeShared();
+    // Use /dev/shm where available so that the buffer never touches the disk
+    QString dir = QDir("/dev/shm").exists() ? "/dev/shm" : QDir::tempPath();
+    shmFile = new QTemporaryFile(dir + "/ckb-anim-XXXXXX");
+    qint64 size = sizeof(ckb_shmheader) + keys.count() * sizeof(ckb_key);
+    if(!shmFile->open() || !shmFile->resize(size) || !(shmKeys = shmFile->map(0, size))){
+        closeShared();
+        return false;
+    }
+    memset(shmKeys, 0, size);
+    ckb_shmheader* header = (ckb_shmheader*)shmKeys;
+    header->magic = CKB_SHM_MAGIC;
+    header->keycount = keys.count();
+    shmKeys += sizeof(ckb_shmheader);
+    return true;
+}
+
+void AnimScript::readShared(){
+    // Only called once every requested frame is finished, so the script isn't writing to the buffer
+    const ckb_key* keys = (const ckb_key*)shmKeys;
+    int count = keyOrder.count();
+    for(int i = 0; i < count; i++){
+        const ckb_key& key = keys[i];
+        int index = keyOrder[i];
+        _colors[index] = qRgba(key.r, key.g, key.b, key.a);
+        _colorMask.setBit(index);
+    }
+    readAnyFrame = true;
+}
+
+void AnimScript::closeShared(){
+    if(shmFile){
+        // Deleting the file also unmaps it
+        delete shmFile;
+        shmFile = 0;
+    }
+    shmKeys = 0;
+    sharedFrames = false;
 }
 
 void AnimScript::readProcess(){
-    while(process->canReadLine()){
+    if(!process)
+        return;
+    while(!sharedFrames && process->canReadLine()){
         QString line = process->readLine().trimmed();
         if(inputBuffer.length() == 0 && line != "begin frame"){
             // Ignore anything not between "begin frame" and "end frame", except for "end run", which indicates that the program is done.
@@ -373,6 +906,13 @@ void AnimScript::readProcess(){
                 stopped = true;
                 return;
             }
+            // "protocol 2" means the script accepted the shared frame buffer. Everything after it is binary.
+            // The file isn't needed anymore once the script has mapped it
+            if(line == "protocol 2" && shmFile){
+                sharedFrames = true;
+                QFile::remove(shmFile->fileName());
+                break;
+            }
             continue;
         }
         if(line == "end frame"){
@@ -381,43 +921,131 @@ void AnimScript::readProcess(){
                 QStringList split = input.split(" ");
                 if(split.length() != 3 || split[0] != "argb")
                     continue;
-                _colors[split[1]] = split[2].toUInt(0, 16);
+                // Ignore keys that weren't given to the script
+                int index = _map.index(split[1]);
+                if(index < 0 || keySlot[index] < 0)
+                    continue;
+                _colors[index] = split[2].toUInt(0, 16);
+                _colorMask.setBit(index);
             }
             inputBuffer.clear();
-            readFrame = readAnyFrame = true;
+            readAnyFrame = true;
+            frameRead(1);
+            // The script is using text frames, so the shared buffer isn't needed
+            if(shmFile)
+                closeShared();
             continue;
         }
         inputBuffer += line;
     }
+    if(!sharedFrames)
+        return;
+    // Each byte is a message. Only the most recent frame needs to be read
+    int frames = 0;
+    foreach(char message, process->readAll()){
+        if(message == CKB_MSG_FRAME)
+            frames++;
+        else if(message == CKB_MSG_END)
+            stopped = true;
+    }
+    // The script renders every frame into the same buffer, so it can only be read when there are no more frames being drawn
+    frameRead(frames);
+    if(frames && pendingFrames.isEmpty())
+        readShared();
+}
+
+void AnimScript::frameRead(int count){
+    qint64 now = nsecs();
+    while(count-- > 0 && !pendingFrames.isEmpty()){
+        // Keep a moving average of the frame latency
+        double latency = (now - pendingFrames.takeFirst()) / 1000000.;
+        _stats.latency = _stats.frames == 0 ? latency : _stats.latency * 0.9 + latency * 0.1;
+        _stats.frames++;
+    }
+}
+
+void AnimScript::publishStats(){
+    QMutexLocker locker(&statLock);
+    sharedStats = _stats;
+    sharedPid = process ? process->pid() : 0;
+}
+
+AnimScript::Stats AnimScript::stats() const {
+    statLock.lock();
+    Stats stats = sharedStats;
+    qint64 pid = sharedPid;
+    statLock.unlock();
+#ifdef Q_OS_LINUX
+    if(pid > 0){
+        // Read the user and system time from /proc/<pid>/stat
+        QFile stat(QString("/proc/%1/stat").arg(pid));
+        if(stat.open(QIODevice::ReadOnly)){
+            QString line = stat.readAll();
+            // The process name may contain spaces, so skip past it first
+            QStringList fields = line.mid(line.lastIndexOf(')') + 2).split(" ");
+            if(fields.count() > 12)
+                stats.cpuTime = (fields[11].toLongLong() + fields[12].toLongLong()) / (double)sysconf(_SC_CLK_TCK);
+        }
+    }
+#endif
+    return stats;
 }
 
 void AnimScript::frame(quint64 timestamp){
+    // Anything queued from other threads comes before this frame
+    runCalls();
     if(!initialized || stopped)
         return;
     // Start the animation if it's not running yet
-    if(!process)
-        start(timestamp);
+    begin(timestamp);
 
-    // If at least one frame was read (or no frame commands have been sent yet), advance the animation
-    if(readFrame || !firstFrame)
+    // Advance the animation unless too many frames are still waiting to be read. Plugins always finish their frames immediately.
+    // Shared frames can't be read while the next one is being drawn, so only one is requested at a time
+    if(plugin || pendingFrames.count() < (sharedFrames ? 1 : MAX_PENDING))
         nextFrame(timestamp);
-    readFrame = false;
+    else
+        _stats.dropped++;
+    publishStats();
 }
 
 void AnimScript::nextFrame(quint64 timestamp){
     if(timestamp <= lastFrame)
         lastFrame = timestamp;
     double delta = (timestamp - lastFrame) / (double)durationMsec;
-    // Skip any complete durations
-    if(!_info.absoluteTime){
-        while(delta > 1.){
-            process->write("frame 1\n");
-            delta--;
-        }
+    // If more than one duration has passed (after a stall or a suspend, for instance), finish the current duration and skip
+    // straight to the remainder. Any durations in between would look the same anyway
+    bool skip = false;
+    if(!_info.absoluteTime && delta > 1.){
+        skip = true;
+        _stats.skipped += (quint64)delta - 1;
+        delta = fmod(delta - 1., 1.);
     }
     if(delta < 0.)
         delta = 0.;
     lastFrame = timestamp;
+    if(plugin){
+        if(stopped)
+            return;
+        // Run the frame directly. A non-zero result means the plugin is done, same as "end run"
+        qint64 start = nsecs();
+        int end = 0;
+        if(skip)
+            end = plugin->functions->frame(&plugin->context, 1.);
+        if(!end)
+            end = plugin->functions->frame(&plugin->context, delta);
+        _stats.cpuTime += (nsecs() - start) / 1000000000.;
+        pendingFrames.append(start);
+        readPlugin();
+        frameRead(1);
+        if(end)
+            stopped = true;
+        return;
+    }
+    qint64 now = nsecs();
+    if(skip){
+        process->write("frame 1\n");
+        pendingFrames.append(now);
+    }
     process->write(QString("frame %1\n").arg(delta).toLatin1());
-    firstFrame = true;
+    pendingFrames.append(now);
 }
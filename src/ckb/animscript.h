@@ -1,12 +1,16 @@
 #ifndef ANIMSCRIPT_H
 #define ANIMSCRIPT_H
 
+#include <QBitArray>
 #include <QHash>
 #include <QObject>
 #include <QMap>
+#include <QMutex>
 #include <QProcess>
+#include <QTemporaryFile>
 #include <QUuid>
 #include <QVariant>
+#include <QVector>
 #include "keymap.h"
 
 class AnimScript : public QObject
@@ -44,8 +48,13 @@ public:
 
     // Global animation path
     static QString path();
-    // Scan the animation path for scripts
+    // Scan the animation path for scripts. Scripts whose info is cached are available immediately; the rest are probed in
+    // the background and added when AnimScanner::finished() is emitted
     static void scan();
+    // Whether or not animations built as shared libraries are loaded into the GUI process (see ckb-anim.h). Off by default,
+    // in which case only executables are used. Takes effect on the next scan()
+    static inline bool pluginsEnabled() { return _pluginsEnabled; }
+    static inline void pluginsEnabled(bool enabled) { _pluginsEnabled = enabled; }
     // Loaded script count and alphabetical list
     static inline int count() { return scripts.count(); }
     static QList<const AnimScript*> list();
@@ -70,6 +79,10 @@ public:
     // Creates a usable script object with the given parent object. Returns null if no such script exists.
     static AnimScript* copy(QObject* parent, const QUuid& id);
 
+    // The script lives on the thread that its frames are run on (see Kb::frameThread()). init(), parameters(), retrigger(),
+    // keypress(), stop() and warmUp() may be called from other threads, in which case they're queued and run there in order.
+    // Everything else must be called on the script's thread, except stats().
+
     // Initializes or re-initializes a script. Must be called at least once.
     // paramValues should contain parameter name/value pairs to run the script with.
     void init(const KeyMap& map, const QStringList& keys, const QMap<QString, QVariant>& paramValues);
@@ -83,20 +96,42 @@ public:
     void frame(quint64 timestamp);
     // Stops the animation.
     void stop();
+    // Launches the script and sends it the key map and parameters without starting the animation, so that it can begin
+    // without waiting for the process the next time it's triggered. Does nothing if it's already running.
+    void warmUp();
 
     // Whether or not the animation has processed any frames yet.
     inline bool hasFrame() const { return initialized && readAnyFrame; }
 
-    // Colors returned from the last executed frame.
-    const QHash<QString, QRgb>& colors() const { return _colors; }
+    // Performance statistics. Counts and times are totals since the script was initialized. Updated after every frame
+    struct Stats {
+        // Frames read, and frames that weren't requested because the script was too far behind
+        quint64 frames, dropped;
+        // Durations skipped while catching up after a stall
+        quint64 skipped;
+        // Average time between requesting and reading a frame (msec)
+        double latency;
+        // CPU time used by the script (sec). For plugins, this is the time spent in the plugin's functions
+        double cpuTime;
+    };
+    Stats stats() const;
+
+    // Colors returned from the last executed frame, indexed by key map position. Only keys set in colorMask() have a color.
+    inline const QVector<QRgb>& colors() const { return _colors; }
+    inline const QBitArray& colorMask() const { return _colorMask; }
 
     ~AnimScript();
 
 private slots:
     void readProcess();
+    // Runs the calls queued from other threads
+    void runCalls();
 
 private:
-    bool load();
+    // Reads script info from the output of --ckb-info. Returns false if the info is invalid.
+    bool load(const QByteArray& info);
+    // Gets the info from a plugin
+    QByteArray pluginInfo();
 
     // Basic info
     struct {
@@ -124,27 +159,145 @@ private:
     // Keys in use
     QStringList _keys;
     // Current colors
-    QHash<QString, QRgb> _colors;
+    QVector<QRgb> _colors;
+    QBitArray _colorMask;
     QMap<QString, QVariant> _paramValues;
 
     // Animation state
     quint64 lastFrame;
     int durationMsec, repeatMsec;
-    bool initialized :1, firstFrame :1, readFrame :1, readAnyFrame :1, stopped :1;
+    bool initialized :1, readAnyFrame :1, stopped :1;
+    // Launched by warmUp() and not triggered yet
+    bool warm :1;
+    // Times (see nsecs()) at which the frames which haven't been read yet were requested. Up to MAX_PENDING frames are requested at once so
+    // that the script can work on the next frame while the previous one is being read (text frames only; see frame())
+    QList<quint64> pendingFrames;
+    static const int MAX_PENDING = 3;
+    Stats _stats;
+    // Copy of the stats and the process ID for stats(), which can be called from any thread
+    mutable QMutex statLock;
+    Stats sharedStats;
+    qint64 sharedPid;
+    void publishStats();
     QProcess* process;
     QStringList inputBuffer;
+    // Shared frame buffer (protocol v2, see ckb-anim.h). If the script accepts it, frames are read from here instead of stdout
+    QTemporaryFile* shmFile;
+    uchar* shmKeys;
+    bool sharedFrames;
+    // Key map index of each key given to the script, in the order they were given
+    QVector<int> keyOrder;
+    // Reverse of keyOrder: position of each key map index in keyOrder, or -1 if the key wasn't given to the script
+    QVector<int> keySlot;
+    // In-process plugin, if the script is a shared library instead of an executable
+    struct Plugin;
+    Plugin* plugin;
+    inline bool isRunning() const;
+
+    // Calls made from other threads, waiting for runCalls()
+    struct Call {
+        enum Type {
+            INIT,
+            PARAMETERS,
+            RETRIGGER,
+            KEYPRESS,
+            STOP,
+            WARM_UP
+        } type;
+        KeyMap map;
+        QStringList keys;
+        QMap<QString, QVariant> params;
+        QString key;
+        quint64 timestamp;
+        // allowPreempt for RETRIGGER, pressed for KEYPRESS
+        bool flag;
+        Call() : type(STOP), timestamp(0), flag(false) {}
+    };
+    QMutex callLock;
+    QVector<Call> calls;
+    // Set while runCalls() is running, so that the calls it makes don't run the ones after them
+    bool runningCalls;
+    // Queues the call and returns true if it was made from another thread. Otherwise, runs any calls queued before it and
+    // returns false, in which case the caller goes ahead
+    bool queue(const Call& call);
 
     // Helper functions
     void setDuration();
     void printParams();
     void start(quint64 timestamp);
+    // Starts the script if it's not running yet. Must be called before sending it anything
+    void begin(quint64 timestamp);
     void nextFrame(quint64 timestamp);
+    void frameRead(int count);
+    bool loadPlugin();
+    void startPlugin(const QStringList& keys);
+    void readPlugin();
+    void stopPlugin();
+    bool openShared(const QStringList& keys);
+    void readShared();
+    void closeShared();
 
     // Global script list
     static QHash<QUuid, AnimScript*> scripts;
+    static bool _pluginsEnabled;
+    // Loads a script from its --ckb-info output and adds it to the list
+    static void add(const QString& path, const QByteArray& info);
+    friend class AnimScanner;
 
     AnimScript(QObject* parent, const QString& path);
     AnimScript(QObject* parent, const AnimScript& base);
 };
 
+// Runs the --ckb-info probes started by AnimScript::scan()
+
+class AnimScanner : public QObject
+{
+    Q_OBJECT
+public:
+    static inline AnimScanner* instance() { return &_instance; }
+    // Whether or not any scripts are still being probed
+    inline bool isScanning() const { return !queue.isEmpty() || !running.isEmpty(); }
+
+signals:
+    // Emitted when a scan is complete. The script list is final at this point
+    void finished();
+
+private slots:
+    void probeFinished();
+    void probeError(QProcess::ProcessError error);
+
+private:
+    AnimScanner();
+    static AnimScanner _instance;
+    friend class AnimScript;
+
+    // Script info cache. The output of --ckb-info is saved for each script along with the file's modification time, size,
+    // and hash, so that scripts only need to be run again when they change.
+    struct Entry {
+        QString path;
+        qint64 modified, size;
+        QByteArray hash, info;
+        // Whether the info was read successfully (otherwise it isn't cached)
+        bool ok;
+    };
+    static QHash<QString, Entry> readCache();
+    static void writeCache(const QList<Entry>& entries);
+
+    // Entries of the current scan, and indices of the ones that are waiting to be probed, being probed, or were probed
+    QList<Entry> entries;
+    QList<int> queue, probed;
+    QHash<QProcess*, int> running;
+    bool active;
+
+    // Begins probing the given entries
+    void start(const QList<Entry>& newEntries, const QList<int>& probes);
+    // Stops the current scan without finishing it
+    void cancel();
+    // Starts as many of the queued probes as possible
+    void next();
+    void remove(QProcess* process);
+    // Saves the cache and adds the probed scripts
+    void done();
+};
+
 #endif // ANIMSCRIPT_H
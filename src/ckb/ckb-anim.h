@@ -4,6 +4,11 @@
 // Standardized header for C/C++ CKB animations.
 // If your animation contains multiple source files, #define CKB_NO_MAIN in all but one of them so you don't get duplicate symbols.
 // The main function will be defined for you. You must write several specialized functions in order to handle animations:
+// Animations can also be built as shared libraries (-shared -fPIC) and loaded directly into ckb instead of running in their own process.
+// To do this, #define CKB_PLUGIN before including this file. A plugin is loaded only once, but each animation using it gets its own
+// context, so plugins must keep their state in context->state instead of global variables. Each device runs its animations on
+// its own thread, so a plugin's functions may be called from several threads at once. Plugins are only loaded if the user
+// enables them in ckb's settings; executables remain the default, so untrusted animations keep running in a separate process.
 
 //   void ckb_info()
 //     Prints information about the program and any parameters it wishes to receive. See info helpers section.
@@ -30,11 +35,17 @@
 //     Try to return as quickly as possible, because ckb may stop sending frames if it does not receive a response in time.
 //     Return 0 to continue running or any other number to exit. On exit, the last-printed image will remain on the keyboard.
 
+//   void ckb_deinit(ckb_runctx* context)
+//     Plugins only, and only if CKB_DEINIT is defined. Called when the animation is stopped, so that context->state can be freed.
+
 #include <ctype.h>
+#include <fcntl.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -54,52 +65,56 @@
 
 #define CKB_CONTAINER(macro) do { macro } while(0)
 
+// Info output stream (stdout, unless running as a plugin)
+extern FILE* ckb_out;
+void printurl(const char* src);
+
 // Plugin GUID
-#define CKB_GUID(guid)                                              CKB_CONTAINER( printf("guid "); printurl(guid); printf("\n"); )
+#define CKB_GUID(guid)                                              CKB_CONTAINER( fprintf(ckb_out, "guid "); printurl(guid); fprintf(ckb_out, "\n"); )
 // Plugin name
-#define CKB_NAME(name)                                              CKB_CONTAINER( printf("name "); printurl(name); printf("\n"); )
+#define CKB_NAME(name)                                              CKB_CONTAINER( fprintf(ckb_out, "name "); printurl(name); fprintf(ckb_out, "\n"); )
 // Plugin version
-#define CKB_VERSION(version)                                        CKB_CONTAINER( printf("version "); printurl(version); printf("\n"); )
+#define CKB_VERSION(version)                                        CKB_CONTAINER( fprintf(ckb_out, "version "); printurl(version); fprintf(ckb_out, "\n"); )
 // Plugin copyright
-#define CKB_COPYRIGHT(year, author)                                 CKB_CONTAINER( printf("author "); printurl(author); printf("\nyear %s\n", year); )
+#define CKB_COPYRIGHT(year, author)                                 CKB_CONTAINER( fprintf(ckb_out, "author "); printurl(author); fprintf(ckb_out, "\nyear %s\n", year); )
 // Plugin license
-#define CKB_LICENSE(license)                                        CKB_CONTAINER( printf("license "); printurl(license); printf("\n"); )
+#define CKB_LICENSE(license)                                        CKB_CONTAINER( fprintf(ckb_out, "license "); printurl(license); fprintf(ckb_out, "\n"); )
 // Plugin description
-#define CKB_DESCRIPTION(description)                                CKB_CONTAINER( printf("description "); printurl(description); printf("\n"); )
+#define CKB_DESCRIPTION(description)                                CKB_CONTAINER( fprintf(ckb_out, "description "); printurl(description); fprintf(ckb_out, "\n"); )
 
 // Parameter helpers
-#define CKB_PARAM(type, name, prefix, postfix, extra)               CKB_CONTAINER( printf("param %s %s ", type, name); printurl(prefix); printf(" "); printurl(postfix); printf(" "); extra; printf("\n"); )
-#define CKB_PARAM_LONG(name, prefix, postfix, default, min, max)    CKB_PARAM("long", name, prefix, postfix, printf("%ld %ld %ld", (long)(default), (long)(min), (long)(max)))
-#define CKB_PARAM_DOUBLE(name, prefix, postfix, default, min, max)  CKB_PARAM("double", name, prefix, postfix, printf("%lf %lf %lf", (double)(default), (double)(min), (double)(max)))
-#define CKB_PARAM_BOOL(name, text, default)                         CKB_PARAM("bool", name, text, "", printf((default) ? "1" : "0"))
-#define CKB_PARAM_RGB(name, prefix, postfix, r, g, b)               CKB_PARAM("rgb", name, prefix, postfix, printf("%02x%02x%02x", (unsigned char)(r), (unsigned char)(g), (unsigned char)(b)))
-#define CKB_PARAM_ARGB(name, prefix, postfix, a, r, g, b)           CKB_PARAM("argb", name, prefix, postfix, printf("%02x%02x%02x%02x", (unsigned char)(a), (unsigned char)(r), (unsigned char)(g), (unsigned char)(b)))
+#define CKB_PARAM(type, name, prefix, postfix, extra)               CKB_CONTAINER( fprintf(ckb_out, "param %s %s ", type, name); printurl(prefix); fprintf(ckb_out, " "); printurl(postfix); fprintf(ckb_out, " "); extra; fprintf(ckb_out, "\n"); )
+#define CKB_PARAM_LONG(name, prefix, postfix, default, min, max)    CKB_PARAM("long", name, prefix, postfix, fprintf(ckb_out, "%ld %ld %ld", (long)(default), (long)(min), (long)(max)))
+#define CKB_PARAM_DOUBLE(name, prefix, postfix, default, min, max)  CKB_PARAM("double", name, prefix, postfix, fprintf(ckb_out, "%lf %lf %lf", (double)(default), (double)(min), (double)(max)))
+#define CKB_PARAM_BOOL(name, text, default)                         CKB_PARAM("bool", name, text, "", fprintf(ckb_out, (default) ? "1" : "0"))
+#define CKB_PARAM_RGB(name, prefix, postfix, r, g, b)               CKB_PARAM("rgb", name, prefix, postfix, fprintf(ckb_out, "%02x%02x%02x", (unsigned char)(r), (unsigned char)(g), (unsigned char)(b)))
+#define CKB_PARAM_ARGB(name, prefix, postfix, a, r, g, b)           CKB_PARAM("argb", name, prefix, postfix, fprintf(ckb_out, "%02x%02x%02x%02x", (unsigned char)(a), (unsigned char)(r), (unsigned char)(g), (unsigned char)(b)))
 #define CKB_PARAM_GRADIENT(name, prefix, postfix, default)          CKB_PARAM("gradient", name, prefix, postfix, printurl(default))
 #define CKB_PARAM_AGRADIENT(name, prefix, postfix, default)         CKB_PARAM("agradient", name, prefix, postfix, printurl(default))
-#define CKB_PARAM_ANGLE(name, prefix, postfix, default)             CKB_PARAM("angle", name, prefix, postfix, printf("%ld", (long)(default)))
+#define CKB_PARAM_ANGLE(name, prefix, postfix, default)             CKB_PARAM("angle", name, prefix, postfix, fprintf(ckb_out, "%ld", (long)(default)))
 #define CKB_PARAM_STRING(name, prefix, postfix, default)            CKB_PARAM("string", name, prefix, postfix, printurl(default))
 #define CKB_PARAM_LABEL(name, text)                                 CKB_PARAM("label", name, text, "", )
 
-#define CKB_PRESET_START(name)                                      CKB_CONTAINER( printf("preset "); printurl(name); )
-#define CKB_PRESET_PARAM(name, value)                               CKB_CONTAINER( printf(" %s=", name); printurl(value); )
-#define CKB_PRESET_END                                              CKB_CONTAINER( printf("\n"); )
+#define CKB_PRESET_START(name)                                      CKB_CONTAINER( fprintf(ckb_out, "preset "); printurl(name); )
+#define CKB_PRESET_PARAM(name, value)                               CKB_CONTAINER( fprintf(ckb_out, " %s=", name); printurl(value); )
+#define CKB_PRESET_END                                              CKB_CONTAINER( fprintf(ckb_out, "\n"); )
 
 // Keypress interaction (none, by name, or by position). Default: NONE
 #define CKB_KP_NONE         "none"
 #define CKB_KP_NAME         "name"
 #define CKB_KP_POSITION     "position"
-#define CKB_KPMODE(mode)                                            CKB_CONTAINER( printf("kpmode %s\n", mode); )
+#define CKB_KPMODE(mode)                                            CKB_CONTAINER( fprintf(ckb_out, "kpmode %s\n", mode); )
 // Timing mode (relative to a duration, or absolute). Default: DURATION
 #define CKB_TIME_DURATION   "duration"
 #define CKB_TIME_ABSOLUTE   "absolute"
-#define CKB_TIMEMODE(mode)                                          CKB_CONTAINER( printf("time %s\n", mode); )
+#define CKB_TIMEMODE(mode)                                          CKB_CONTAINER( fprintf(ckb_out, "time %s\n", mode); )
 // Repeatability. If enabled, the animation will be restarted after a user-chosen amount of time. Default: TRUE
-#define CKB_REPEAT(enable)                                          CKB_CONTAINER( printf("repeat %s\n", (enable) ? "on" : "off"); )
+#define CKB_REPEAT(enable)                                          CKB_CONTAINER( fprintf(ckb_out, "repeat %s\n", (enable) ? "on" : "off"); )
 // Startup preemption. Requires duration and repeat enabled. Default: FALSE
 // If enabled, ckb will play an extra start command on mode switch, placed 1 duration before the actual starting animation.
-#define CKB_PREEMPT(enable)                                         CKB_CONTAINER( printf("preempt %s\n", (enable) ? "on" : "off"); )
+#define CKB_PREEMPT(enable)                                         CKB_CONTAINER( fprintf(ckb_out, "preempt %s\n", (enable) ? "on" : "off"); )
 // Live parameter updates. Default: FALSE
-#define CKB_LIVEPARAMS(enable)                                      CKB_CONTAINER( printf("parammode %s\n", (enable) ? "live" : "static"); )
+#define CKB_LIVEPARAMS(enable)                                      CKB_CONTAINER( fprintf(ckb_out, "parammode %s\n", (enable) ? "live" : "static"); )
 
 // * Runtime information
 
@@ -139,8 +154,35 @@ typedef struct {
     unsigned keycount;
     // Keyboard dimensions
     unsigned width, height;
+    // Animation state. Not used by ckb; plugins should store their state here since they may be running more than one animation.
+    void* state;
 } ckb_runctx;
 
+// Shared frame buffer (protocol v2). ckb creates a file containing this header followed by the ckb_key array and passes its path
+// to the program. The program then renders directly into the shared keys and signals each finished frame with a single byte
+// instead of printing every key. This is handled automatically by the main function, animations don't need to do anything.
+#define CKB_SHM_MAGIC       0x32626b63
+#define CKB_MSG_FRAME       0x01
+#define CKB_MSG_END         0x04
+typedef struct {
+    unsigned magic;
+    unsigned keycount;
+} ckb_shmheader;
+
+// Plugin function table (see CKB_PLUGIN). Returned by the exported function ckb_plugin_get(). The version is increased if the
+// layout of this table, ckb_runctx, or ckb_key ever changes.
+#define CKB_PLUGIN_VERSION  1
+typedef struct {
+    unsigned version;
+    void (*info)(FILE* out);
+    void (*init)(ckb_runctx* context);
+    void (*parameter)(ckb_runctx* context, const char* name, const char* value);
+    void (*keypress)(ckb_runctx* context, ckb_key* key, int x, int y, int state);
+    void (*start)(ckb_runctx* context);
+    int (*frame)(ckb_runctx* context, double delta);
+    void (*deinit)(ckb_runctx* context);
+} ckb_plugin;
+
 // Clear all keys in a context (ARGB 00000000).
 // Call this at the beginning of ckb_frame to start from a blank slate. If you don't, the colors from the previous frame are left intact.
 #define CKB_KEYCLEAR(context)                                       CKB_CONTAINER( ckb_key* key = context->keys; unsigned count = context->keycount; unsigned i = 0; for(; i < count; i++) key[i].a = key[i].r = key[i].g = key[i].b = 0; )
@@ -172,6 +214,8 @@ void ckb_alpha_blend(ckb_key* key, float a, float r, float g, float b);
 
 #ifndef CKB_NO_MAIN
 
+FILE* ckb_out = 0;
+
 // URL-encoded string printer
 void printurl(const char* src){
     char out[strlen(src) * 3 + 1];
@@ -199,7 +243,7 @@ void printurl(const char* src){
             *dst++ = s;
     }
     *dst = '\0';
-    printf("%s", out);
+    fprintf(ckb_out, "%s", out);
 }
 
 // URL decode
@@ -342,6 +386,24 @@ extern void ckb_keypress(ckb_runctx*, ckb_key*, int, int, int);
 extern void ckb_start(ckb_runctx*);
 extern int ckb_frame(ckb_runctx*, double);
 
+// Map the shared frame buffer. Returns the key array on success or null on failure.
+ckb_key* ckb_map_keys(const char* path, unsigned keycount){
+    int fd = open(path, O_RDWR);
+    if(fd < 0)
+        return 0;
+    size_t size = sizeof(ckb_shmheader) + keycount * sizeof(ckb_key);
+    void* mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED)
+        return 0;
+    ckb_shmheader* header = (ckb_shmheader*)mem;
+    if(header->magic != CKB_SHM_MAGIC || header->keycount != keycount){
+        munmap(mem, size);
+        return 0;
+    }
+    return (ckb_key*)(header + 1);
+}
+
 // Update parameter values
 void ckb_read_params(ckb_runctx* ctx){
     char cmd[CKB_MAX_WORD], param[CKB_MAX_WORD], value[CKB_MAX_WORD];
@@ -359,7 +421,41 @@ void ckb_read_params(ckb_runctx* ctx){
     } while(1);
 }
 
+#ifdef CKB_PLUGIN
+
+#ifdef CKB_DEINIT
+extern void ckb_deinit(ckb_runctx*);
+#endif
+
+static void ckb_plugin_info(FILE* out){
+    ckb_out = out;
+    ckb_info();
+    fflush(out);
+}
+
+static const ckb_plugin ckb_plugin_table = {
+    CKB_PLUGIN_VERSION,
+    ckb_plugin_info,
+    ckb_init,
+    ckb_parameter,
+    ckb_keypress,
+    ckb_start,
+    ckb_frame,
+#ifdef CKB_DEINIT
+    ckb_deinit
+#else
+    0
+#endif
+};
+
+__attribute__((visibility("default"))) const ckb_plugin* ckb_plugin_get(){
+    return &ckb_plugin_table;
+}
+
+#else
+
 int main(int argc, char *argv[]){
+    ckb_out = stdout;
     if(argc == 2){
         if(!strcmp(argv[1], "--ckb-info")){
             ckb_info();
@@ -369,7 +465,8 @@ int main(int argc, char *argv[]){
             ckb_runctx ctx;
             // Read the keymap lines
             char cmd[CKB_MAX_WORD], param[CKB_MAX_WORD], value[CKB_MAX_WORD];
-            // Skip anything up until "begin keymap"
+            // Skip anything up until "begin keymap", except for "protocol 2 <path>", which offers a shared frame buffer
+            char shmpath[CKB_MAX_WORD] = "";
             do {
                 ckb_getline(cmd, param, value);
                 if(!*cmd){
@@ -377,6 +474,8 @@ int main(int argc, char *argv[]){
                     printf("Error [ckb-main]: Reached EOF looking for \"begin keymap\"");
                     return -2;
                 }
+                if(!strcmp(cmd, "protocol") && !strcmp(param, "2"))
+                    strcpy(shmpath, value);
             } while(strcmp(cmd, "begin") || strcmp(param, "keymap"));
             ckb_getline(cmd, param, value);
             unsigned keycount;
@@ -407,6 +506,17 @@ int main(int argc, char *argv[]){
             }
             ctx.width = max_x + 1;
             ctx.height = max_y + 1;
+            // Move the keys to the shared frame buffer if it was offered. Otherwise, frames are printed as text
+            int shared = 0;
+            if(*shmpath){
+                ckb_key* keys = ckb_map_keys(shmpath, keycount);
+                if(keys){
+                    memcpy(keys, ctx.keys, keycount * sizeof(ckb_key));
+                    free(ctx.keys);
+                    ctx.keys = keys;
+                    shared = 1;
+                }
+            }
             // Skip anything else until "end keymap"
             do {
                 ckb_getline(cmd, param, value);
@@ -437,6 +547,8 @@ int main(int argc, char *argv[]){
             } while(strcmp(cmd, "begin") || strcmp(param, "run"));
             // Run the main loop
             printf("begin run\n");
+            if(shared)
+                printf("protocol 2\n");
             fflush(stdout);
             while(1){
                 ckb_getline(cmd, param, value);
@@ -479,21 +591,31 @@ int main(int argc, char *argv[]){
                     if(!strcmp(cmd, "frame") && sscanf(param, "%lf", &delta) == 1){
                         int end = ckb_frame(&ctx, delta);
                         // Output the frame
-                        printf("begin frame\n");
-                        for(i = 0; i < ctx.keycount; i++){
-                            ckb_key* key = ctx.keys + i;
-                            printf("argb %s %02hhx%02hhx%02hhx%02hhx\n", key->name, key->a, key->r, key->g, key->b);
+                        if(shared)
+                            putchar(CKB_MSG_FRAME);
+                        else {
+                            printf("begin frame\n");
+                            for(i = 0; i < ctx.keycount; i++){
+                                ckb_key* key = ctx.keys + i;
+                                printf("argb %s %02hhx%02hhx%02hhx%02hhx\n", key->name, key->a, key->r, key->g, key->b);
+                            }
+                            printf("end frame\n");
                         }
-                        printf("end frame\n");
                         if(end)
                             break;
                         fflush(stdout);
                     }
                 }
             }
-            printf("end run\n");
-            fflush(stdout);
-            free(ctx.keys);
+            if(shared){
+                putchar(CKB_MSG_END);
+                fflush(stdout);
+                munmap((ckb_shmheader*)ctx.keys - 1, sizeof(ckb_shmheader) + keycount * sizeof(ckb_key));
+            } else {
+                printf("end run\n");
+                fflush(stdout);
+                free(ctx.keys);
+            }
             return 0;
         }
     }
@@ -501,6 +623,8 @@ int main(int argc, char *argv[]){
     return -1;
 }
 
+#endif  // CKB_PLUGIN
+
 #endif  // CKB_NO_MAIN
 
 #endif  // CKB_ANIM_H
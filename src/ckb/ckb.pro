@@ -32,6 +32,11 @@ DEFINES += CKB_VERSION_STR="\\\"$$CKB_VERSION_STR\\\""
 LIBS += -lz
 DEFINES += QUAZIP_STATIC
 
+# clock_nanosleep is in librt on older glibc
+unix:!macx {
+    LIBS += -lrt
+}
+
 SOURCES += main.cpp\
         mainwindow.cpp \
     kbwidget.cpp \
@@ -82,7 +87,9 @@ SOURCES += main.cpp\
     kbfirmware.cpp \
     fwupgradedialog.cpp \
     autorun.cpp \
-    keymap_es.cpp
+    keymap_es.cpp \
+    frameclock.cpp \
+    profilestore.cpp
 
 HEADERS  += mainwindow.h \
     kbwidget.h \
@@ -129,7 +136,9 @@ HEADERS  += mainwindow.h \
     quazip/zip.h \
     kbfirmware.h \
     fwupgradedialog.h \
-    autorun.h
+    autorun.h \
+    frameclock.h \
+    profilestore.h
 
 FORMS    += mainwindow.ui \
     kbwidget.ui \
@@ -153,5 +162,11 @@ RESOURCES += \
 OBJECTIVE_SOURCES += \
     media_mac.m
 
+# PulseAudio mute monitor
+!macx {
+    SOURCES += media_pulse.cpp
+    HEADERS += media_pulse.h
+}
+
 DISTFILES += \
     ckb-info.plist
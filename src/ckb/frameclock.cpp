@@ -0,0 +1,120 @@
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTimer>
+#include "frameclock.h"
+
+// Monotonic time in nanoseconds
+#ifdef Q_OS_MACX
+// OSX doesn't have clock_nanosleep (or CLOCK_MONOTONIC before 10.12), so the deadlines are kept on QElapsedTimer's clock
+// and slept for relatively
+static QElapsedTimer monotonic;
+
+static qint64 now(){
+    return monotonic.nsecsElapsed();
+}
+
+static void sleepUntil(qint64 time){
+    qint64 delta = time - now();
+    if(delta <= 0)
+        return;
+    timespec ts = { (time_t)(delta / 1000000000LL), (long)(delta % 1000000000LL) };
+    while(nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+#else
+static qint64 now(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleepUntil(qint64 time){
+    timespec ts = { (time_t)(time / 1000000000LL), (long)(time % 1000000000LL) };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+}
+#endif
+
+FrameClock::FrameClock(QObject* parent, int fps) :
+    QThread(parent), _rate(30), stopping(0)
+{
+#ifdef Q_OS_MACX
+    if(!monotonic.isValid())
+        monotonic.start();
+#endif
+    memset(&stats, 0, sizeof(stats));
+    rate(fps);
+}
+
+FrameClock::~FrameClock(){
+    stop();
+}
+
+void FrameClock::rate(int newRate){
+    if(newRate < 1)
+        newRate = 1;
+    if(newRate > 60)
+        newRate = 60;
+    _rate.store(newRate);
+}
+
+void FrameClock::stop(){
+    stopping.store(1);
+    quit();
+    wait();
+}
+
+FrameClock::Jitter FrameClock::jitter(){
+    QMutexLocker locker(&statLock);
+    Jitter res = stats;
+    memset(&stats, 0, sizeof(stats));
+    return res;
+}
+
+void FrameClock::run(){
+    // Handles the events of the objects living on this thread until shortly before the next deadline
+    QEventLoop loop;
+    QTimer wake;
+    wake.setTimerType(Qt::PreciseTimer);
+    wake.setSingleShot(true);
+    connect(&wake, SIGNAL(timeout()), &loop, SLOT(quit()));
+    qint64 period = 0, next = 0;
+    while(!stopping.load()){
+        qint64 newPeriod = 1000000000LL / _rate.load();
+        qint64 current = now();
+        if(newPeriod != period || current - next > period){
+            // On start, rate changes, or after falling more than a frame behind (a slow frame, or a suspend), restart on
+            // the next multiple of the period instead of running the missed frames. Devices at the same rate tick together
+            if(newPeriod == period){
+                statLock.lock();
+                stats.skipped += (int)((current - next) / period + 1);
+                statLock.unlock();
+            }
+            period = newPeriod;
+            next = (current / period + 1) * period;
+        }
+        // Leave 1ms to wake up from the event loop, then sleep the rest of the way so the frame starts on time
+        qint64 idle = (next - now()) / 1000000 - 1;
+        if(idle > 0){
+            wake.start(idle);
+            loop.exec();
+        }
+        sleepUntil(next);
+        if(stopping.load())
+            break;
+        // The frame runs right here (see tick()), so this is how late it's advanced and written
+        double late = (now() - next) / 1000000.;
+        statLock.lock();
+        stats.frames++;
+        stats.average += (late - stats.average) / stats.frames;
+        if(late > stats.worst)
+            stats.worst = late;
+        statLock.unlock();
+        emit tick();
+        next += period;
+    }
+    // Delete whatever was left to be deleted here (see Kb::~Kb())
+    QCoreApplication::sendPostedEvents(0, QEvent::DeferredDelete);
+}
@@ -0,0 +1,53 @@
+#ifndef FRAMECLOCK_H
+#define FRAMECLOCK_H
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QThread>
+
+// Frame clock for a single device. Runs on its own thread and sleeps until absolute deadlines spaced at the frame rate,
+// so the frame timing doesn't depend on how busy the GUI event loop is. tick() is emitted on the clock thread, and
+// receivers should use a direct connection so the whole frame runs there. Between frames the thread handles the events
+// of the objects living on it (the device's animation scripts).
+
+class FrameClock : public QThread
+{
+    Q_OBJECT
+public:
+    FrameClock(QObject* parent, int fps = 30);
+    ~FrameClock();
+
+    // Frame rate (1 - 60 FPS). Takes effect on the next frame
+    inline int rate() const { return _rate.load(); }
+    void rate(int newRate);
+
+    // Measured frame jitter, i.e. how long after the deadline each frame started (in milliseconds). The frames run on the
+    // clock thread as tick() is emitted, so this is when they're advanced and written. A frame that runs long delays the
+    // next one; once the clock falls more than a frame behind, the missed deadlines are skipped.
+    struct Jitter {
+        double average, worst;
+        // Frames run and skipped since the last call to jitter()
+        int frames, skipped;
+    };
+    // Gets the jitter since the last call and resets the counters
+    Jitter jitter();
+
+    // Stops the clock. Objects left on the thread get their pending deleteLater() handled before it exits. Also called
+    // when deleted
+    void stop();
+
+signals:
+    // Emitted on the clock thread. Connect with Qt::DirectConnection so that the frame runs there
+    void tick();
+
+private:
+    QAtomicInt _rate;
+    QAtomicInt stopping;
+
+    QMutex statLock;
+    Jitter stats;
+
+    void run();
+};
+
+#endif // FRAMECLOCK_H
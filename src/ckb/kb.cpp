@@ -1,14 +1,21 @@
+#include <cerrno>
 #include <fcntl.h>
+#include <unistd.h>
+#include <QSet>
 #include <QUrl>
 #include "kb.h"
 #include "media.h"
+#include "profilestore.h"
+
+// All open devices
+static QSet<Kb*> activeDevices;
 
 Kb::Kb(QObject *parent, const QString& path) :
     QThread(parent), devpath(path), cmdpath(path + "/cmd"),
     features("N/A"), firmware("N/A"), pollrate("N/A"),
     _currentProfile(0), _currentMode(0), _model(KeyMap::NO_MODEL), _layout(KeyMap::NO_LAYOUT),
     _hwProfile(0), prevProfile(0), prevMode(0),
-    cmd(cmdpath), notifyNumber(1), _needsSave(false), hwLoading(true)
+    cmd(cmdpath), notifyNumber(1), _needsSave(false), hwLoading(true), clock(0), _frameLock(QMutex::Recursive)
 {
     // Get the features, model, serial number, FW version (if available), and poll rate (if available) from /dev nodes
     QFile ftpath(path + "/features"), mpath(path + "/model"), spath(path + "/serial"), fwpath(path + "/fwversion"), ppath(path + "/pollrate");
@@ -69,42 +76,87 @@ Kb::Kb(QObject *parent, const QString& path) :
     }
     cmd.write(QString("notifyon %1\n").arg(notifyNumber).toLatin1());
     cmd.flush();
-    cmd.write(QString("active\n@%1 get :hwprofileid").arg(notifyNumber).toLatin1());
+    cmd.write(QString("active\n@%1 get :hwprofileid :fps").arg(notifyNumber).toLatin1());
     for(int i = 0; i < hwModeCount; i++)
         cmd.write(QString(" mode %1 get :hwid").arg(i + 1).toLatin1());
     cmd.write("\n");
     cmd.flush();
 
     emit infoUpdated();
+    activeDevices.insert(this);
+
+    // Frames are driven by the device's own clock and run on its thread. It starts at the default rate and is updated when
+    // the daemon replies
+    clock = new FrameClock(this);
+    connect(clock, SIGNAL(tick()), this, SLOT(frameUpdate()), Qt::DirectConnection);
+    clock->start(QThread::TimeCriticalPriority);
+    // The mute monitor is started by the first call, which has to be made here instead of on the frame thread
+    getMuteState();
 
     // Start a separate thread to read from the notification node
     start();
 }
 
 Kb::~Kb(){
+    activeDevices.remove(this);
     if(!isOpen()){
         terminate();
         wait(1000);
         return;
     }
-    // Kill notification thread and remove node
-    if(notifyNumber > 0)
-        cmd.write(QString("idle\nnotifyoff %1\n").arg(notifyNumber).toLatin1());
-    cmd.flush();
-    terminate();
-    wait(1000);
-    // Reset to hardware profile
-    if(_hwProfile){
-        _currentProfile = _hwProfile;
-        hwSave();
+    {
+        QMutexLocker locker(&_frameLock);
+        // Kill notification thread and remove node
+        if(notifyNumber > 0)
+            cmd.write(QString("idle\nnotifyoff %1\n").arg(notifyNumber).toLatin1());
+        cmd.flush();
+        terminate();
+        wait(1000);
+        // Reset to hardware profile
+        if(_hwProfile){
+            _currentProfile = _hwProfile;
+            hwSave();
+        }
+        // No more frames after this
+        _currentMode = 0;
     }
+    // Delete the modes while the frame thread is still running, so that their animation scripts are deleted there. Then
+    // stop it
+    qDeleteAll(findChildren<KbMode*>(QString(), Qt::FindDirectChildrenOnly));
+    delete clock;
+    clock = 0;
     cmd.close();
 }
 
-void Kb::load(QSettings &settings){
-    _needsSave = false;
-    // Read layout
-    _layout = KeyMap::getLayout(settings.value("Layout").toString());
+QMutex* Kb::frameLock(QObject* object){
+    for(; object; object = object->parent()){
+        Kb* device = qobject_cast<Kb*>(object);
+        if(device)
+            return &device->_frameLock;
+    }
+    return 0;
+}
+
+QThread* Kb::frameThread(QObject* object){
+    for(; object; object = object->parent()){
+        Kb* device = qobject_cast<Kb*>(object);
+        if(device)
+            return device->clock;
+    }
+    return 0;
+}
+
+void Kb::frameRateChanged(){
+    foreach(Kb* kb, activeDevices){
+        QMutexLocker locker(&kb->_frameLock);
+        kb->cmd.write(QString("@%1 get :fps\n").arg(kb->notifyNumber).toLatin1());
+        kb->cmd.flush();
+    }
+}
+
+void Kb::loadLayout(KeyMap::Layout newLayout){
+    QMutexLocker locker(&_frameLock);
+    _layout = newLayout;
     if(_layout == KeyMap::NO_LAYOUT){
         // If the layout couldn't be loaded, fetch it from the driver
         cmd.write(QString("@%1 get :layout\n").arg(notifyNumber).toLatin1());
@@ -115,6 +167,25 @@ void Kb::load(QSettings &settings){
         emit infoUpdated();
     }
     cmd.flush();
+}
+
+void Kb::loadFinished(KbProfile* newCurrentProfile){
+    if(newCurrentProfile)
+        setCurrentProfile(newCurrentProfile);
+    else {
+        // If nothing was loaded, load the demo profile
+        QSettings demoSettings(":/txt/demoprofile.conf", QSettings::IniFormat, this);
+        KbProfile* demo = new KbProfile(this, getKeyMap(), demoSettings, "{BA7FC152-2D51-4C26-A7A6-A036CC93D924}");
+        _profiles.append(demo);
+        setCurrentProfile(demo);
+    }
+
+    emit profileAdded();
+}
+
+void Kb::load(QSettings &settings){
+    _needsSave = false;
+    loadLayout(KeyMap::getLayout(settings.value("Layout").toString()));
 
     // Read profiles
     KbProfile* newCurrentProfile = 0;
@@ -128,17 +199,41 @@ void Kb::load(QSettings &settings){
                 newCurrentProfile = profile;
         }
     }
-    if(newCurrentProfile)
-        setCurrentProfile(newCurrentProfile);
-    else {
-        // If nothing was loaded, load the demo profile
-        QSettings demoSettings(":/txt/demoprofile.conf", QSettings::IniFormat, this);
-        KbProfile* demo = new KbProfile(this, getKeyMap(), demoSettings, "{BA7FC152-2D51-4C26-A7A6-A036CC93D924}");
-        _profiles.append(demo);
-        setCurrentProfile(demo);
+    loadFinished(newCurrentProfile);
+}
+
+bool Kb::load(ProfileStore& store){
+    QString layout;
+    QUuid current;
+    QList<QUuid> guids;
+    {
+        ProfileStore::Reader device(store, ProfileStore::DEVICE_RECORD);
+        if(!device.isValid())
+            return false;
+        device.stream >> layout >> current >> guids;
+        if(device.stream.status() != QDataStream::Ok)
+            return false;
     }
+    _needsSave = false;
+    loadLayout(KeyMap::getLayout(layout));
 
-    emit profileAdded();
+    // Read profiles. Any that can't be read are skipped; they'll be deleted on the next save
+    KbProfile* newCurrentProfile = 0;
+    foreach(const QUuid& guid, guids){
+        ProfileStore::Reader record(store, guid.toString().toUpper());
+        if(!record.isValid())
+            continue;
+        KbProfile* profile = new KbProfile(this, getKeyMap(), record.stream);
+        if(record.stream.status() != QDataStream::Ok){
+            delete profile;
+            continue;
+        }
+        _profiles.append(profile);
+        if(guid == current || !newCurrentProfile)
+            newCurrentProfile = profile;
+    }
+    loadFinished(newCurrentProfile);
+    return true;
 }
 
 void Kb::save(QSettings& settings){
@@ -155,13 +250,39 @@ void Kb::save(QSettings& settings){
     settings.setValue("Layout", KeyMap::getLayout(_layout));
 }
 
+void Kb::save(ProfileStore& store){
+    _needsSave = false;
+    QList<QUuid> guids;
+    QStringList records;
+    records << ProfileStore::DEVICE_RECORD;
+    QUuid current;
+    foreach(KbProfile* profile, _profiles){
+        QString name = profile->id().guidString();
+        guids << profile->id().guid;
+        records << name;
+        if(profile == _currentProfile)
+            current = profile->id().guid;
+        // Only rewrite profiles which changed
+        if(profile->needsSave() || !store.contains(name)){
+            ProfileStore::Writer record(store, name);
+            profile->save(record.stream);
+        }
+    }
+    {
+        ProfileStore::Writer device(store, ProfileStore::DEVICE_RECORD);
+        device.stream << KeyMap::getLayout(_layout) << current << guids;
+    }
+    store.removeExcept(records);
+}
+
 void Kb::hwSave(){
+    QMutexLocker locker(&_frameLock);
     if(!_currentProfile)
         return;
     // Close active lighting (if any)
     if(prevMode){
         prevMode->light()->close();
-        deletePrevious();
+        prevMode = 0;
     }
     hwProfile(_currentProfile);
     hwLoading = false;
@@ -208,6 +329,8 @@ bool Kb::needsSave() const {
 
 void Kb::writeProfileHeader(){
     cmd.write("eraseprofile");
+    // Erasing the profile resets the bindings of every mode
+    bindState.clear();
     // Write the profile name and ID
     cmd.write(" profilename ");
     cmd.write(QUrl::toPercentEncoding(_currentProfile->name()));
@@ -220,6 +343,7 @@ void Kb::writeProfileHeader(){
 void Kb::layout(KeyMap::Layout newLayout, bool write){
     if(newLayout == KeyMap::NO_LAYOUT)
         return;
+    QMutexLocker locker(&_frameLock);
     _layout = newLayout;
     if(write){
         cmd.write("layout ");
@@ -231,6 +355,8 @@ void Kb::layout(KeyMap::Layout newLayout, bool write){
         profile->keyMap(getKeyMap());
     if(_hwProfile && !_profiles.contains(_hwProfile))
         _hwProfile->keyMap(getKeyMap());
+    // Key names may refer to different keys now, so write all bindings again
+    bindState.clear();
     // Stop all animations as they'll need to be restarted
     foreach(KbMode* mode, _currentProfile->modes())
         mode->light()->close();
@@ -238,6 +364,7 @@ void Kb::layout(KeyMap::Layout newLayout, bool write){
 }
 
 void Kb::fwUpdate(const QString& path){
+    QMutexLocker locker(&_frameLock);
     fwUpdPath = path;
     // Write the active command to ensure it's not ignored
     cmd.write("active");
@@ -248,6 +375,7 @@ void Kb::fwUpdate(const QString& path){
 }
 
 void Kb::frameUpdate(){
+    QMutexLocker locker(&_frameLock);
     // Get system mute state
     muteState mute = getMuteState();
     if(mute == UNKNOWN)
@@ -264,36 +392,72 @@ void Kb::frameUpdate(){
         return;
     }
 
-    // Stop animations on the previously active mode (if any)
+    // Stop animations on the previously active mode (if any). They're left ready in case it's switched back to
     bool changed = false;
     if(prevMode != _currentMode){
-        if(prevMode){
-            prevMode->light()->close();
-            disconnect(prevMode, SIGNAL(destroyed()), this, SLOT(deletePrevious()));
-        }
+        KbMode* left = prevMode;
+        if(prevMode)
+            prevMode->light()->park();
         prevMode = _currentMode;
-        connect(prevMode, SIGNAL(destroyed()), this, SLOT(deletePrevious()));
+        warmUp(left);
         changed = true;
     }
 
     // If the profile has changed, update it
     if(prevProfile != _currentProfile){
         writeProfileHeader();
-        cmd.write(" ");
+        cmd.write("\n");
+        cmd.flush();
         prevProfile = _currentProfile;
     }
-    // Update current mode
+    // Update current mode. Only the lighting and bindings which changed are written; if nothing changed, nothing is sent
+    // unless the mode changed
     int index = _currentProfile->indexOf(_currentMode);
-    light->frameUpdate(cmd, index, mute != MUTED, !bind->winLock());
-    cmd.write(QString(" @%1 ").arg(notifyNumber).toLatin1());
-    bind->update(cmd, changed);
+    if(bindState.count() <= index)
+        bindState.resize(index + 1);
+    QByteArray lightCmd, bindCmd;
+    light->frameUpdate(lightCmd, index, mute != MUTED, !bind->winLock());
+    // If the driver already has this mode's bindings, switching to it doesn't need to write any
+    bind->update(bindCmd, bindState[index], changed);
+    if(lightCmd.isEmpty() && bindCmd.isEmpty() && !changed)
+        return;
+    cmd.write(QString().sprintf("mode %d switch", index + 1).toLatin1());
+    cmd.write(lightCmd);
+    if(!bindCmd.isEmpty()){
+        cmd.write(QString(" @%1 ").arg(notifyNumber).toLatin1());
+        cmd.write(bindCmd);
+    }
     cmd.write("\n");
     cmd.flush();
 }
 
-void Kb::deletePrevious(){
-    disconnect(prevMode, SIGNAL(destroyed()), this, SLOT(deletePrevious()));
-    prevMode = 0;
+void Kb::warmUp(KbMode* left){
+    QList<KbMode*> keep;
+    const QList<KbMode*>& modes = _currentProfile->modes();
+    int current = modes.indexOf(_currentMode);
+    foreach(int index, _currentMode->bind()->modeTargets(current, modes.count()))
+        keep.append(modes[index]);
+    if(left && !keep.contains(left))
+        keep.append(left);
+    // Stop the modes that can't be reached anymore
+    foreach(KbMode* mode, warmModes){
+        if(mode != _currentMode && !keep.contains(mode))
+            mode->light()->close();
+    }
+    warmModes.clear();
+    foreach(KbMode* mode, keep){
+        mode->light()->warmUp();
+        warmModes.append(mode);
+    }
+}
+
+void Kb::modeDeleted(KbMode* mode){
+    QMutexLocker locker(&_frameLock);
+    if(prevMode == mode)
+        prevMode = 0;
+    if(_currentMode == mode)
+        _currentMode = 0;
+    warmModes.removeAll(mode);
 }
 
 void Kb::hwProfile(KbProfile* newHwProfile){
@@ -315,98 +479,125 @@ void Kb::run(){
     QFile notify(notifyPath);
     // Wait a small amount of time for the node to open (100ms)
     QThread::usleep(100000);
-    if(!notify.open(QIODevice::ReadOnly)){
+    if(!notify.open(QIODevice::ReadOnly | QIODevice::Unbuffered)){
         // If it's still not open, try again before giving up (1s total)
         QThread::usleep(900000);
-        if(!notify.open(QIODevice::ReadOnly))
+        if(!notify.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
             return;
     }
-    // Read data from notification node
-    QByteArray line;
+    // Read data from notification node in chunks. Each chunk is parsed here and handed to the GUI thread in one go
+    int fd = notify.handle();
+    char buffer[4096];
+    QByteArray partial;
+    // Set when a line was too long and is being skipped
+    bool discard = false;
+    // Key names seen so far, so that key events can share the same strings
+    QHash<QByteArray, QString> keyNames;
     while(1){
-        if((line = notify.readLine()).length() > 0){
-            QString text = QString::fromUtf8(line);
-            metaObject()->invokeMethod(this, "readNotify", Qt::QueuedConnection, Q_ARG(QString, text));
-        }
-    }
-}
-
-void Kb::readNotify(QString line){
-    QStringList components = line.trimmed().split(" ");
-    if(components.count() < 2)
-        return;
-    if(components[0] == "layout"){
-        // Layout change - set new layout
-        KeyMap::Layout newLayout = KeyMap::getLayout(components[1]);
-        layout(newLayout, false);
-    } else if(components[0] == "key"){
-        // Key event
-        QString key = components[1];
-        if(key.length() < 2)
+        ssize_t length = ::read(fd, buffer, sizeof(buffer));
+        if(length < 0 && errno == EINTR)
+            continue;
+        if(length <= 0)
+            // Node removed
             return;
-        QString keyName = key.mid(1);
-        bool keyPressed = (key[0] == '+');
-        KbMode* mode = _currentMode;
-        if(mode){
-            mode->light()->animKeypress(keyName, keyPressed);
-            mode->bind()->keyEvent(keyName, keyPressed);
-        }
-    } else if(components[0] == "hwprofileid"){
-        // Hardware profile ID
-        if(components.count() < 3)
-            return;
-        // Find the hardware profile in the list of profiles
-        QString guid = components[1];
-        QString modified = components[2];
-        KbProfile* newProfile = 0;
-        foreach(KbProfile* profile, _profiles){
-            if(profile->id().guid == guid){
-                newProfile = profile;
-                break;
+        partial.append(buffer, length);
+        int end = partial.lastIndexOf('\n');
+        if(end < 0){
+            // Don't let a line without an end grow forever
+            if(partial.length() > MAX_NOTIFY_LINE){
+                partial.clear();
+                discard = true;
             }
+            continue;
         }
-        // If it wasn't found, create it
-        if(!newProfile){
-            newProfile = new KbProfile(this, getKeyMap(), guid, modified);
-            hwLoading = true;
-            cmd.write(QString("@%1 get :hwprofilename\n").arg(notifyNumber).toLatin1());
-            cmd.flush();
-        } else {
-            // If it's been updated (and we're loading hardware data), fetch its name
-            if(newProfile->id().modifiedString() != modified){
-                newProfile->id().modifiedString(modified);
-                if(hwLoading){
-                    cmd.write(QString("@%1 get :hwprofilename\n").arg(notifyNumber).toLatin1());
-                    cmd.flush();
+        QVector<NotifyEvent> events;
+        foreach(const QByteArray& line, partial.left(end).split('\n')){
+            QByteArray text = line.trimmed();
+            if(discard){
+                // Rest of a line that was too long
+                discard = false;
+                continue;
+            }
+            if(text.isEmpty() || text.length() > MAX_NOTIFY_LINE)
+                continue;
+            NotifyEvent event;
+            event.pressed = false;
+            event.mode = -1;
+            if((text.startsWith("key ") || text.startsWith("i ")) && (text[text.indexOf(' ') + 1] == '+' || text[text.indexOf(' ') + 1] == '-')){
+                // "key +name"/"key -name" or "i +name"/"i -name"
+                int sign = text.indexOf(' ') + 1;
+                QByteArray name = text.mid(sign + 1);
+                if(name.isEmpty())
+                    continue;
+                QHash<QByteArray, QString>::const_iterator known = keyNames.constFind(name);
+                if(known == keyNames.constEnd())
+                    known = keyNames.insert(name, QString::fromLatin1(name));
+                event.type = (text[0] == 'k') ? NotifyEvent::KEY : NotifyEvent::INDICATOR;
+                event.pressed = (text[sign] == '+');
+                event.key = known.value();
+            } else {
+                // "name args..." or "mode N name args..."
+                event.type = NotifyEvent::REPLY;
+                QStringList words = QString::fromUtf8(text).split(" ");
+                if(words[0] == "mode"){
+                    if(words.count() < 3)
+                        continue;
+                    event.mode = words[1].toInt() - 1;
+                    if(event.mode < 0)
+                        continue;
+                    words = words.mid(2);
                 }
+                event.key = words.takeFirst();
+                event.args = words;
             }
+            events.append(event);
         }
-        hwProfile(newProfile);
-        emit profileAdded();
-        if(_hwProfile == _currentProfile)
-            emit profileChanged();
-    } else if(components[0] == "hwprofilename"){
-        // Hardware profile name
-        QString name = QUrl::fromPercentEncoding(components[1].toUtf8());
-        if(!_hwProfile)
-            return;
-        QString oldName = _hwProfile->name();
-        if(!(oldName.length() >= name.length() && oldName.left(name.length()) == name)){
-            // Don't change the name if it's a truncated version of what we already have
-            _hwProfile->name(name);
-            emit profileRenamed();
-        }
-    } else if(components[0] == "mode"){
+        partial.remove(0, end + 1);
+        if(events.isEmpty())
+            continue;
+        notifyLock.lock();
+        bool queue = notifyEvents.isEmpty();
+        notifyEvents += events;
+        notifyLock.unlock();
+        if(queue)
+            metaObject()->invokeMethod(this, "readNotify", Qt::QueuedConnection);
+    }
+}
+
+void Kb::readNotify(){
+    QMutexLocker locker(&_frameLock);
+    notifyLock.lock();
+    QVector<NotifyEvent> events = notifyEvents;
+    notifyEvents.clear();
+    notifyLock.unlock();
+    foreach(const NotifyEvent& event, events){
+        if(event.type == NotifyEvent::KEY){
+            // Key event
+            KbMode* mode = _currentMode;
+            if(mode){
+                mode->light()->animKeypress(event.key, event.pressed);
+                mode->bind()->keyEvent(event.key, event.pressed);
+            }
+        } else if(event.type == NotifyEvent::REPLY)
+            readReply(event);
+        // Indicator changes aren't used by the GUI
+    }
+}
+
+void Kb::readReply(const NotifyEvent& reply){
+    const QString& field = reply.key;
+    const QStringList& args = reply.args;
+    if(args.isEmpty())
+        return;
+    if(reply.mode >= 0){
         // Mode-specific data
-        if(components.count() < 4)
-            return;
-        int mode = components[1].toInt() - 1;
-        if(components[2] == "hwid"){
-            if(components.count() < 5 || !_hwProfile)
+        int mode = reply.mode;
+        if(field == "hwid"){
+            if(args.count() < 2 || !_hwProfile)
                 return;
             // Hardware mode ID
-            QString guid = components[3];
-            QString modified = components[4];
+            QString guid = args[0];
+            QString modified = args[1];
             // Look for this mode in the hardware profile
             KbMode* hwMode = 0;
             bool isNew = false;
@@ -444,12 +635,12 @@ void Kb::readNotify(QString line){
                 cmd.write(QString("@%1 mode %2 get :hwname :hwrgb\n").arg(notifyNumber).arg(mode + 1).toLatin1());
                 cmd.flush();
             }
-        } else if(components[2] == "hwname"){
+        } else if(field == "hwname"){
             // Mode name - update list
             if(!_hwProfile || _hwProfile->modeCount() <= mode)
                 return;
             KbMode* hwMode = _hwProfile->modes()[mode];
-            QString name = QUrl::fromPercentEncoding(components[3].toUtf8());
+            QString name = QUrl::fromPercentEncoding(args[0].toUtf8());
             QString oldName = hwMode->name();
             if(!(oldName.length() >= name.length() && oldName.left(name.length()) == name)){
                 // Don't change the name if it's a truncated version of what we already have
@@ -457,15 +648,14 @@ void Kb::readNotify(QString line){
                 if(_hwProfile == _currentProfile)
                     emit modeRenamed();
             }
-        } else if(components[2] == "hwrgb"){
+        } else if(field == "hwrgb"){
             // RGB - set mode lighting
             if(!_hwProfile || _hwProfile->modeCount() <= mode)
                 return;
             KbLight* light = _hwProfile->modes()[mode]->light();
             // If it's a color command, scan the input
             QColor lightColor = QColor();
-            for(int i = 3; i < components.count(); i++){
-                QString comp = components[i];
+            foreach(const QString& comp, args){
                 if(comp.indexOf(":") < 0){
                     // Single hex constant?
                     bool ok;
@@ -498,13 +688,67 @@ void Kb::readNotify(QString line){
                 light->color("lock", lightColor);
             }
         }
-    } else if(components[0] == "fwupdate"){
-        if(components.count() < 3)
+    } else if(field == "layout"){
+        // Layout change - set new layout
+        KeyMap::Layout newLayout = KeyMap::getLayout(args[0]);
+        layout(newLayout, false);
+    } else if(field == "fps"){
+        // Daemon frame rate
+        int fps = args[0].toInt();
+        if(fps > 0 && clock)
+            clock->rate(fps);
+    } else if(field == "hwprofileid"){
+        // Hardware profile ID
+        if(args.count() < 2)
+            return;
+        // Find the hardware profile in the list of profiles
+        QString guid = args[0];
+        QString modified = args[1];
+        KbProfile* newProfile = 0;
+        foreach(KbProfile* profile, _profiles){
+            if(profile->id().guid == guid){
+                newProfile = profile;
+                break;
+            }
+        }
+        // If it wasn't found, create it
+        if(!newProfile){
+            newProfile = new KbProfile(this, getKeyMap(), guid, modified);
+            hwLoading = true;
+            cmd.write(QString("@%1 get :hwprofilename\n").arg(notifyNumber).toLatin1());
+            cmd.flush();
+        } else {
+            // If it's been updated (and we're loading hardware data), fetch its name
+            if(newProfile->id().modifiedString() != modified){
+                newProfile->id().modifiedString(modified);
+                if(hwLoading){
+                    cmd.write(QString("@%1 get :hwprofilename\n").arg(notifyNumber).toLatin1());
+                    cmd.flush();
+                }
+            }
+        }
+        hwProfile(newProfile);
+        emit profileAdded();
+        if(_hwProfile == _currentProfile)
+            emit profileChanged();
+    } else if(field == "hwprofilename"){
+        // Hardware profile name
+        QString name = QUrl::fromPercentEncoding(args[0].toUtf8());
+        if(!_hwProfile)
+            return;
+        QString oldName = _hwProfile->name();
+        if(!(oldName.length() >= name.length() && oldName.left(name.length()) == name)){
+            // Don't change the name if it's a truncated version of what we already have
+            _hwProfile->name(name);
+            emit profileRenamed();
+        }
+    } else if(field == "fwupdate"){
+        if(args.count() < 2)
             return;
         // Make sure path is the same
-        if(components[1] != fwUpdPath)
+        if(args[0] != fwUpdPath)
             return;
-        QString res = components[2];
+        QString res = args[1];
         if(res == "invalid" || res == "fail")
             emit fwUpdateFinished(false);
         else if(res == "ok")
@@ -524,6 +768,7 @@ KeyMap Kb::getKeyMap(){
 }
 
 void Kb::setCurrentProfile(KbProfile *profile, bool spontaneous){
+    QMutexLocker locker(&_frameLock);
     while(profile->modeCount() < hwModeCount)
         profile->append(new KbMode(this, getKeyMap()));
     KbMode* mode = profile->currentMode();
@@ -533,6 +778,7 @@ void Kb::setCurrentProfile(KbProfile *profile, bool spontaneous){
 }
 
 void Kb::setCurrentMode(KbProfile* profile, KbMode* mode, bool spontaneous){
+    QMutexLocker locker(&_frameLock);
     if(_currentProfile != profile){
         _currentProfile = profile;
         _needsSave = true;
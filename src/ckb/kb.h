@@ -3,9 +3,14 @@
 
 #include <QObject>
 #include <QFile>
+#include <QMutex>
 #include <QThread>
+#include <QVector>
+#include "frameclock.h"
 #include "kbprofile.h"
 
+class ProfileStore;
+
 // Class for managing devices
 
 class Kb : public QThread
@@ -33,6 +38,17 @@ public:
 
     inline bool isOpen() const { return cmd.isOpen(); }
 
+    // Frame clock. Runs at the daemon's frame rate (null if the device couldn't be opened)
+    inline FrameClock* frameClock() { return clock; }
+    // Frames run on the clock's thread while holding the device's frame lock. The current mode, its lighting, animations
+    // and bindings, and the profile's mode list must only be changed while holding it. Returns the lock of the device that
+    // the object belongs to (itself or through its parents), or null if there is none
+    static QMutex* frameLock(QObject* object);
+    // Thread that the frames of the object's device run on, or null if it doesn't have one. Animation scripts live there
+    static QThread* frameThread(QObject* object);
+    // Asks every device for the daemon's frame rate again. Call this after changing it
+    static void frameRateChanged();
+
     // Profile saved to hardware
     inline KbProfile* hwProfile() { return _hwProfile; }
     void hwProfile(KbProfile* newHwProfile);
@@ -68,6 +84,10 @@ public:
     // Load/save stored settings
     void load(QSettings& settings);
     void save(QSettings& settings);
+    // Load/save from the binary profile store. Only profiles which changed are written. load() returns false if the
+    // store couldn't be read
+    bool load(ProfileStore& store);
+    void save(ProfileStore& store);
     void hwSave();
     bool needsSave() const;
 
@@ -94,11 +114,10 @@ public slots:
     void frameUpdate();
 
 private slots:
-    // Processes lines read from the notification node
-    void readNotify(QString line);
+    // Processes events read from the notification node (see run())
+    void readNotify();
 
     void deleteHw();
-    void deletePrevious();
 
 private:
     KbProfile* _currentProfile;
@@ -108,6 +127,9 @@ private:
     KeyMap::Model _model;
     KeyMap::Layout _layout;
     void layout(KeyMap::Layout newLayout, bool write);
+    // Shared by both versions of load()
+    void loadLayout(KeyMap::Layout newLayout);
+    void loadFinished(KbProfile* newCurrentProfile);
 
     // Current firmware update file
     QString fwUpdPath;
@@ -116,6 +138,13 @@ private:
     // Previously-selected profile and mode
     KbProfile* prevProfile;
     KbMode* prevMode;
+    // Modes with animations launched in the background: the ones the current mode can switch to, and the one that was
+    // left last. Updated after every mode switch
+    QList<KbMode*> warmModes;
+    void warmUp(KbMode* left);
+    // Called by a mode when it's deleted, so that the frames stop using it
+    friend class KbMode;
+    void modeDeleted(KbMode* mode);
     // Used to write the profile info when switching
     void writeProfileHeader();
 
@@ -130,9 +159,38 @@ private:
     // Whether or not the hardware profile is being loaded
     bool hwLoading;
 
+    // Drives frameUpdate()
+    FrameClock* clock;
+    // See frameLock()
+    QMutex _frameLock;
+
+    // Bindings held by the driver for each mode index. Cleared when the profile is erased
+    QVector<KbBind::DriverState> bindState;
+
     // Key map for this keyboard
     KeyMap getKeyMap();
 
+    // Events parsed by the notification reader. Everything is parsed on the reader thread, so the GUI thread only has to
+    // dispatch on the type.
+    struct NotifyEvent {
+        enum Type {
+            KEY,            // "key +name": key is the key name, pressed is true if it went down
+            INDICATOR,      // "i +name": key is the indicator name, pressed is true if it turned on
+            REPLY           // Anything else ("layout us", "mode 1 hwname ..."): key is the field name, args are the words after it
+        } type;
+        bool pressed;
+        // Mode index (0-based) of a mode-specific reply, -1 otherwise
+        int mode;
+        QString key;
+        QStringList args;
+    };
+    // Events not yet handled by the GUI thread. readNotify() is only queued when the list goes from empty to non-empty
+    QMutex notifyLock;
+    QVector<NotifyEvent> notifyEvents;
+    void readReply(const NotifyEvent& reply);
+    // Longest line accepted from the notification node. Anything longer is discarded up to the next newline
+    static const int MAX_NOTIFY_LINE = 65536;
+
     // Notification reader, launches as a separate thread and reads from file.
     // (QFile doesn't have readyRead() so there's no other way to do this asynchronously)
     void run();
@@ -1,12 +1,15 @@
 #include <cmath>
 #include <QDateTime>
+#include <QElapsedTimer>
 #include <QMetaEnum>
+#include <QSet>
+#include "kb.h"
 #include "kbanim.h"
 
 KbAnim::KbAnim(QObject *parent, const KeyMap& map, const QUuid id, QSettings& settings) :
-    QObject(parent), _script(0), _map(map),
+    QObject(parent), frameLock(Kb::frameLock(parent)), _script(0), _map(map),
     repeatTime(0), kpRepeatTime(0), stopTime(0), kpStopTime(0), repeatMsec(0), kpRepeatMsec(0), forceStarted(false),
-    _guid(id), _needsSave(false)
+    _blendTime(0.), _guid(id), _needsSave(false)
 {
     settings.beginGroup(_guid.toString().toUpper());
     _keys = settings.value("Keys").toStringList();
@@ -27,9 +30,46 @@ KbAnim::KbAnim(QObject *parent, const KeyMap& map, const QUuid id, QSettings& se
         _parameters[param.toLower()] = settings.value(param);
     settings.endGroup();
     settings.endGroup();
+    loadScript();
+}
+
+KbAnim::KbAnim(QObject* parent, const KeyMap& map, QDataStream& stream) :
+    QObject(parent), frameLock(Kb::frameLock(parent)), _script(0), _map(map),
+    repeatTime(0), kpRepeatTime(0), stopTime(0), kpStopTime(0), repeatMsec(0), kpRepeatMsec(0), forceStarted(false),
+    _blendTime(0.), _needsSave(false)
+{
+    qint32 mode;
+    stream >> _guid >> _keys >> _name >> _opacity >> mode >> _scriptName >> _scriptGuid >> _parameters;
+    if(_opacity < 0.)
+        _opacity = 0.;
+    else if(_opacity > 1.)
+        _opacity = 1.;
+    if(mode < Normal || mode > Divide)
+        mode = Normal;
+    _mode = (Mode)mode;
+    loadScript();
+}
+
+KbAnim::~KbAnim(){
+    if(_script)
+        _script->deleteLater();
+}
 
+AnimScript* KbAnim::newScript(const QUuid& id){
+    // Scripts are read and advanced on the frame thread, so they're moved there (if the device has one)
+    AnimScript* script = AnimScript::copy(0, id);
+    QThread* thread = Kb::frameThread(this);
+    if(script && thread)
+        script->moveToThread(thread);
+    return script;
+}
+
+void KbAnim::loadScript(){
     if(!_scriptGuid.isNull()){
-        _script = AnimScript::copy(this, _scriptGuid);
+        _script = newScript(_scriptGuid);
+        if(!_script && AnimScanner::instance()->isScanning())
+            // The script may not have been scanned yet. Try again when the scan is done
+            connect(AnimScanner::instance(), SIGNAL(finished()), this, SLOT(scanFinished()), Qt::UniqueConnection);
         if(_script){
             // Remove nonexistant parameters
             foreach(const QString& name, _parameters.keys()){
@@ -50,6 +90,23 @@ KbAnim::KbAnim(QObject *parent, const KeyMap& map, const QUuid id, QSettings& se
     }
 }
 
+void KbAnim::scanFinished(){
+    QMutexLocker locker(frameLock);
+    disconnect(AnimScanner::instance(), SIGNAL(finished()), this, SLOT(scanFinished()));
+    if(_script)
+        return;
+    // If the animation was started without its script (see trigger()), start it for real now
+    bool started = forceStarted;
+    loadScript();
+    if(_script && started)
+        trigger(QDateTime::currentMSecsSinceEpoch());
+}
+
+void KbAnim::save(QDataStream& stream){
+    _needsSave = false;
+    stream << _guid << _keys << _name << _opacity << (qint32)_mode << _scriptName << _scriptGuid << _parameters;
+}
+
 void KbAnim::save(QSettings& settings){
     _needsSave = false;
     settings.beginGroup(_guid.toString().toUpper());
@@ -70,10 +127,10 @@ void KbAnim::save(QSettings& settings){
 }
 
 KbAnim::KbAnim(QObject* parent, const KeyMap& map, const QString& name, const QStringList& keys, const AnimScript* script) :
-    QObject(parent),
-    _script(AnimScript::copy(this, script->guid())), _map(map), _keys(keys),
+    QObject(parent), frameLock(Kb::frameLock(parent)),
+    _script(newScript(script->guid())), _map(map), _keys(keys),
     repeatTime(0), kpRepeatTime(0), stopTime(0), kpStopTime(0), repeatMsec(0), kpRepeatMsec(0), forceStarted(false),
-    _guid(QUuid::createUuid()), _name(name), _opacity(1.), _mode(Normal), _needsSave(true)
+    _blendTime(0.), _guid(QUuid::createUuid()), _name(name), _opacity(1.), _mode(Normal), _needsSave(true)
 {
     if(_script){
         // Set default parameters
@@ -90,11 +147,11 @@ KbAnim::KbAnim(QObject* parent, const KeyMap& map, const QString& name, const QS
 }
 
 KbAnim::KbAnim(QObject* parent, const KeyMap& map, const KbAnim& other) :
-    QObject(parent),
-    _script(AnimScript::copy(this, other.script()->guid())), _scriptGuid(_script->guid()), _scriptName(_script->name()),
+    QObject(parent), frameLock(Kb::frameLock(parent)),
+    _script(newScript(other.script()->guid())), _scriptGuid(_script->guid()), _scriptName(_script->name()),
     _map(map), _keys(other._keys), _parameters(other._parameters),
     repeatTime(0), kpRepeatTime(0), stopTime(0), kpStopTime(0), repeatMsec(0), kpRepeatMsec(0), forceStarted(false),
-    _guid(other._guid), _name(other._name), _opacity(other._opacity), _mode(other._mode), _needsSave(true)
+    _blendTime(0.), _guid(other._guid), _name(other._name), _opacity(other._opacity), _mode(other._mode), _needsSave(true)
 {
     reInit();
 }
@@ -102,27 +159,49 @@ KbAnim::KbAnim(QObject* parent, const KeyMap& map, const KbAnim& other) :
 void KbAnim::parameter(const QString& name, const QVariant& value){
     if(!_script->hasParam(name))
         return;
+    QMutexLocker locker(frameLock);
     _tempParameters[name] = value;
     updateParams();
 }
 
 void KbAnim::commitParams(){
+    QMutexLocker locker(frameLock);
     _needsSave = true;
     _parameters = effectiveParams();
     _tempParameters.clear();
+    updatePlayback();
 }
 
 void KbAnim::resetParams(){
+    QMutexLocker locker(frameLock);
     _tempParameters.clear();
     updateParams();
 }
 
 void KbAnim::updateParams(){
+    updatePlayback();
     if(_script)
         _script->parameters(effectiveParams());
     repeatKey = "";
 }
 
+void KbAnim::updatePlayback(){
+    QMap<QString, QVariant> parameters = effectiveParams();
+    playback.trigger = parameters.value("trigger").toBool();
+    playback.kpTrigger = parameters.value("kptrigger").toBool();
+    playback.kpRelease = parameters.value("kprelease").toBool();
+    playback.hasRepeat = parameters.contains("repeat");
+    playback.hasKpRepeat = parameters.contains("kprepeat");
+    playback.delay = round(parameters.value("delay").toDouble() * 1000.);
+    playback.kpDelay = round(parameters.value("kpdelay").toDouble() * 1000.);
+    playback.repeat = round(parameters.value("repeat").toDouble() * 1000.);
+    playback.kpRepeat = round(parameters.value("kprepeat").toDouble() * 1000.);
+    playback.stop = parameters.value("stop").toDouble();
+    playback.kpStop = parameters.value("kpstop").toDouble();
+    playback.stopCount = parameters.value("stop").toInt();
+    playback.kpStopCount = parameters.value("kpstop").toInt();
+}
+
 QMap<QString, QVariant> KbAnim::effectiveParams(){
     QMap<QString, QVariant> res = _parameters;
     // Apply all uncommited parameters
@@ -135,6 +214,8 @@ QMap<QString, QVariant> KbAnim::effectiveParams(){
 }
 
 void KbAnim::reInit(){
+    QMutexLocker locker(frameLock);
+    updatePlayback();
     if(_script)
         _script->init(_map, _keys, effectiveParams());
     repeatKey = "";
@@ -143,45 +224,36 @@ void KbAnim::reInit(){
 
 void KbAnim::map(const KeyMap& newMap){
     // Convert the old key list to the new map by positions, if possible
-    uint newCount = newMap.count();
     QStringList newKeyList;
+    QSet<QString> added;
     foreach(const QString& key, _keys){
-        const KeyPos* oldPos = _map.key(key);
-        if(!oldPos || key == "enter"){
-            // If the key wasn't in the map, add it anyway
-            if(!newKeyList.contains(key))
-                newKeyList << key;
-            continue;
-        }
+        // If the key wasn't in the map, add it anyway
         QString newKey = key;
-        for(uint i = 0; i < newCount; i++){
-            // Scan new map for matching positions
-            const KeyPos* newPos = newMap.key(i);
-            QString newName = newPos->name;
-            if(newPos->x == oldPos->x && newPos->y == oldPos->y
-                    && newName != "enter"){
-                newKey = newName;
-                break;
-            }
-        }
-        if(!newKeyList.contains(newKey))
+        int newIndex = newMap.indexOfId(_map.id(_map.index(key)));
+        if(newIndex >= 0)
+            newKey = newMap.key(newIndex)->name;
+        if(!added.contains(newKey)){
+            added.insert(newKey);
             newKeyList << newKey;
+        }
     }
     // Set the map
+    QMutexLocker locker(frameLock);
     _keys = newKeyList;
     _map = newMap;
     reInit();
 }
 
 void KbAnim::keys(const QStringList& newKeys){
+    QMutexLocker locker(frameLock);
     _keys = newKeys;
     reInit();
 }
 
 void KbAnim::trigger(quint64 timestamp){
-    QMap<QString, QVariant> parameters = effectiveParams();
-    if(_script && parameters.value("trigger").toBool()){
-        int delay = round(parameters.value("delay").toDouble() * 1000.);
+    QMutexLocker locker(frameLock);
+    if(_script && playback.trigger){
+        int delay = playback.delay;
         if(delay > 0){
             // If delay is enabled, wait to trigger the event
             timestamp += delay;
@@ -189,11 +261,11 @@ void KbAnim::trigger(quint64 timestamp){
             forceStarted = true;
         } else
             _script->retrigger(timestamp, true);
-        int repeat = round(parameters.value("repeat").toDouble() * 1000.);
+        int repeat = playback.repeat;
         if(repeat <= 0){
             // If no repeat allowed, calculate stop time in seconds
             repeatMsec = -1;
-            double stop = parameters.value("stop").toDouble();
+            double stop = playback.stop;
             if(stop <= 0)
                 stopTime = 0;
             else
@@ -203,7 +275,7 @@ void KbAnim::trigger(quint64 timestamp){
             repeatMsec = repeat;
             if(delay <= 0)
                 repeatTime = timestamp + repeat;
-            int stop = parameters.value("stop").toInt();
+            int stop = playback.stopCount;
             if(stop < 0)
                 stopTime = 0;
             else
@@ -214,9 +286,9 @@ void KbAnim::trigger(quint64 timestamp){
 }
 
 void KbAnim::keypress(const QString& key, bool pressed, quint64 timestamp){
-    QMap<QString, QVariant> parameters = effectiveParams();
-    if(_script && parameters.value("kptrigger").toBool()){
-        int delay = round(parameters.value("kpdelay").toDouble() * 1000.);
+    QMutexLocker locker(frameLock);
+    if(_script && playback.kpTrigger){
+        int delay = playback.kpDelay;
         if(pressed){
             if(delay > 0){
                 // If delay is enabled, wait to trigger the event
@@ -225,11 +297,11 @@ void KbAnim::keypress(const QString& key, bool pressed, quint64 timestamp){
                 forceStarted = true;
             } else
                 _script->keypress(key, pressed, timestamp);
-            int repeat = round(parameters.value("kprepeat").toDouble() * 1000.);
+            int repeat = playback.kpRepeat;
             if(repeat <= 0){
                 // If no repeat allowed, calculate stop time in seconds
                 kpRepeatMsec = -1;
-                double stop = parameters.value("kpstop").toDouble();
+                double stop = playback.kpStop;
                 if(stop <= 0.)
                     kpStopTime = 0;
                 else
@@ -239,7 +311,7 @@ void KbAnim::keypress(const QString& key, bool pressed, quint64 timestamp){
                 kpRepeatMsec = repeat;
                 if(delay <= 0)
                     kpRepeatTime = timestamp + repeat;
-                int stop = parameters.value("kpstop").toInt();
+                int stop = playback.kpStopCount;
                 if(stop < 0)
                     kpStopTime = 0;
                 else
@@ -248,7 +320,7 @@ void KbAnim::keypress(const QString& key, bool pressed, quint64 timestamp){
             repeatKey = key;
         } else {
             _script->keypress(key, pressed, timestamp);
-            if(parameters.value("kprelease").toBool())
+            if(playback.kpRelease)
                 // Stop repeating keypress if "Stop on key release" is enabled
                 kpStopTime = timestamp;
         }
@@ -256,6 +328,7 @@ void KbAnim::keypress(const QString& key, bool pressed, quint64 timestamp){
 }
 
 void KbAnim::stop(){
+    QMutexLocker locker(frameLock);
     if(_script)
         _script->stop();
     repeatTime = 0;
@@ -268,6 +341,24 @@ void KbAnim::stop(){
     forceStarted = false;
 }
 
+void KbAnim::warmUp(){
+    QMutexLocker locker(frameLock);
+    if(_script)
+        _script->warmUp();
+}
+
+void KbAnim::opacity(float newOpacity){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _opacity = newOpacity;
+}
+
+void KbAnim::mode(Mode newMode){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _mode = newMode;
+}
+
 // Blending functions
 
 static float blendNormal(float bg, float fg){
@@ -302,14 +393,14 @@ static float blendDivide(float bg, float fg){
 typedef float (*blendFunc)(float,float);
 static blendFunc functions[5] = { blendNormal, blendAdd, blendSubtract, blendMultiply, blendDivide };
 
-void KbAnim::blend(QHash<QString, QRgb>& animMap, quint64 timestamp){
+void KbAnim::blend(QVector<QRgb>& colors, quint64 timestamp){
     if(!_script)
         return;
-    QMap<QString, QVariant> parameters = effectiveParams();
+    QMutexLocker locker(frameLock);
     // Stop the animation if its time has run out
     if(stopTime != 0 && timestamp >= stopTime){
         repeatMsec = repeatTime = 0;
-        if(!parameters.contains("repeat")){
+        if(!playback.hasRepeat){
             // If repeats aren't allowed, stop the animation entirely
             _script->stop();
             return;
@@ -319,7 +410,7 @@ void KbAnim::blend(QHash<QString, QRgb>& animMap, quint64 timestamp){
     }
     if(kpStopTime != 0 && timestamp >= kpStopTime){
         kpRepeatMsec = kpRepeatTime = 0;
-        if(!parameters.contains("kprepeat")){
+        if(!playback.hasKpRepeat){
             _script->stop();
             return;
         } else
@@ -345,16 +436,19 @@ void KbAnim::blend(QHash<QString, QRgb>& animMap, quint64 timestamp){
 
     // Fetch the next frame from the script
     _script->frame(timestamp);
-    QHashIterator<QString, QRgb> i(_script->colors());
+    QElapsedTimer timer;
+    timer.start();
+    const QVector<QRgb>& fgColors = _script->colors();
+    const QBitArray& mask = _script->colorMask();
+    int count = qMin(colors.count(), fgColors.count());
+    QRgb* bgColors = colors.data();
     blendFunc f = functions[(int)_mode];
-    while(i.hasNext()){
+    for(int i = 0; i < count; i++){
         // Mix the colors in with the color map according to blend mode and alpha
-        i.next();
-        const QString& key = i.key();
-        if(!animMap.contains(key))
+        if(!mask.testBit(i))
             continue;
-        QRgb& bg = animMap[key];
-        QRgb fg = i.value();
+        QRgb& bg = bgColors[i];
+        QRgb fg = fgColors[i];
         float r = qRed(bg) / 255.f, g = qGreen(bg) / 255.f, b = qBlue(bg) / 255.f;
         float a = qAlpha(fg) * _opacity / 255.f;
         r = r * (1.f - a) + f(r, qRed(fg) / 255.f) * a;
@@ -362,4 +456,18 @@ void KbAnim::blend(QHash<QString, QRgb>& animMap, quint64 timestamp){
         b = b * (1.f - a) + f(b, qBlue(fg) / 255.f) * a;
         bg = qRgb(round(r * 255.f), round(g * 255.f), round(b * 255.f));
     }
+    _blendTime += timer.nsecsElapsed() / 1000000000.;
+}
+
+double KbAnim::blendTime() const {
+    QMutexLocker locker(frameLock);
+    return _blendTime;
+}
+
+AnimScript::Stats KbAnim::stats() const {
+    if(_script)
+        return _script->stats();
+    AnimScript::Stats stats;
+    memset(&stats, 0, sizeof(stats));
+    return stats;
 }
@@ -1,6 +1,8 @@
 #ifndef KBANIM_H
 #define KBANIM_H
 
+#include <QDataStream>
+#include <QMutex>
 #include <QObject>
 #include <QSettings>
 #include "animscript.h"
@@ -24,12 +26,16 @@ public:
     KbAnim(QObject* parent, const KeyMap& map, const QUuid id, QSettings& settings);
     // Save an animation to settings
     void save(QSettings& settings);
+    // Load/save an animation in binary form (see ProfileStore)
+    KbAnim(QObject* parent, const KeyMap& map, QDataStream& stream);
+    void save(QDataStream& stream);
     inline bool needsSave() const { return _needsSave; }
 
     // Create a new animation
     KbAnim(QObject* parent, const KeyMap& map, const QString& name, const QStringList& keys, const AnimScript* script);
     // Copy an existing animation
     KbAnim(QObject *parent, const KeyMap& map, const KbAnim& other);
+    ~KbAnim();
 
     // Key map
     inline const KeyMap& map() { return _map; }
@@ -56,11 +62,20 @@ public:
     void keypress(const QString& key, bool pressed, quint64 timestamp);
     // Stops the animation
     void stop();
+    // Launches the script ahead of time (see AnimScript::warmUp)
+    void warmUp();
+    // Stops the animation, but leaves a new instance of the script ready to start
+    inline void park() { stop(); warmUp(); }
     // Whether or not the animation is running
     inline bool isRunning() { return forceStarted || _script->hasFrame(); }
 
-    // Blends the animation into a color map, taking opacity and mode into account
-    void blend(QHash<QString, QRgb>& animMap, quint64 timestamp);
+    // Blends the animation into a color array (indexed by key map position), taking opacity and mode into account
+    void blend(QVector<QRgb>& colors, quint64 timestamp);
+
+    // Performance statistics of the script (empty if it isn't loaded)
+    AnimScript::Stats stats() const;
+    // Total time spent blending the animation (sec)
+    double blendTime() const;
 
     // Animation properties
     inline const QUuid& guid() const { return _guid; }
@@ -68,17 +83,26 @@ public:
     inline const QString& name() const { return _name; }
     inline void name(const QString& newName) { _needsSave = true; _name = newName; }
     inline float opacity() const { return _opacity; }
-    inline void opacity(float newOpacity) { _needsSave = true; _opacity = newOpacity; }
+    void opacity(float newOpacity);
     inline Mode mode() const { return _mode; }
-    inline void mode(Mode newMode) { _needsSave = true; _mode = newMode; }
+    void mode(Mode newMode);
 
     // Animation script properties
     const AnimScript* script() const { return _script; }
     const QString& scriptName() const { return _scriptName; }
 
+private slots:
+    // Retries loadScript() after the scripts have been scanned
+    void scanFinished();
+
 private:
-    // Script (null if not loaded)
+    // Frame lock of the device (see Kb::frameLock()). Held by everything the frames use
+    QMutex* frameLock;
+    // Script (null if not loaded). It lives on the device's frame thread, not the animation's
     AnimScript* _script;
+    AnimScript* newScript(const QUuid& id);
+    // Loads the script after reading the settings
+    void loadScript();
     // GUID and name (duplicated here in case the load fails)
     QUuid _scriptGuid;
     QString _scriptName;
@@ -95,6 +119,19 @@ private:
     // Updates parameters to animation if live params are enabled
     void updateParams();
 
+    // Playback parameters, cached from the effective parameters whenever they change so that they don't need to be looked up every frame
+    struct {
+        bool trigger, kpTrigger, kpRelease;
+        // Whether "repeat"/"kprepeat" exist at all
+        bool hasRepeat, hasKpRepeat;
+        // Times in msec
+        int delay, kpDelay, repeat, kpRepeat;
+        // Stop time in seconds (without repeat) or repetitions (with repeat)
+        double stop, kpStop;
+        int stopCount, kpStopCount;
+    } playback;
+    void updatePlayback();
+
     // Repeat/stop info (set from parameters)
     QString repeatKey;
     quint64 repeatTime, kpRepeatTime, stopTime, kpStopTime;
@@ -102,6 +139,9 @@ private:
     // Depending on the animation settings, it may not start immediately when it's "started", so this is used to avoid waiting for it.
     bool forceStarted;
 
+    // Total time spent in blend() (see blendTime())
+    double _blendTime;
+
     QUuid _guid;
     QString _name;
     float _opacity;
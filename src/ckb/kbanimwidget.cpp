@@ -1,5 +1,6 @@
 #include <QDateTime>
 #include <QMenu>
+#include <QStyle>
 #include "animsettingdialog.h"
 #include "kbanimwidget.h"
 #include "ui_kbanimwidget.h"
@@ -12,6 +13,10 @@ KbAnimWidget::KbAnimWidget(QWidget* parent) :
     ui->animList->setVisible(false);
     setCurrent(0);
     connect(ui->animList, SIGNAL(orderChanged()), this, SLOT(reorderAnims()));
+    ui->perfLabel->setVisible(false);
+    connect(&statsTimer, SIGNAL(timeout()), this, SLOT(updateStats()));
+    statsTimer.start(1000);
+    statsElapsed.start();
 }
 
 KbAnimWidget::~KbAnimWidget(){
@@ -34,6 +39,7 @@ void KbAnimWidget::refreshList(){
     setCurrent(0);
     ui->animList->clear();
     animations.clear();
+    lastStats.clear();
     // Add the animations from the new lighting mode
     if(!light){
         ui->animList->setVisible(false);
@@ -74,6 +80,59 @@ void KbAnimWidget::reorderAnims(){
     }
 }
 
+void KbAnimWidget::updateStats(){
+    double elapsed = statsElapsed.restart() / 1000.;
+    if(!light || !isVisible() || elapsed <= 0.){
+        lastStats.clear();
+        return;
+    }
+    QHash<KbAnim*, StatSample> newStats;
+    QIcon warning = style()->standardIcon(QStyle::SP_MessageBoxWarning);
+    double totalCpu = 0., totalBlend = 0.;
+    int slowCount = 0;
+    int count = ui->animList->count();
+    for(int i = 0; i < count; i++){
+        QListWidgetItem* item = ui->animList->item(i);
+        KbAnim* anim = animations.value(item->data(Qt::UserRole).toUuid());
+        if(!anim)
+            continue;
+        StatSample sample = { anim->stats(), anim->blendTime() };
+        newStats[anim] = sample;
+        // Compare against the last sample. If the frame count went down, the script was restarted
+        if(!lastStats.contains(anim))
+            continue;
+        const StatSample& last = lastStats.value(anim);
+        if(sample.stats.frames < last.stats.frames || sample.stats.dropped < last.stats.dropped)
+            continue;
+        quint64 frames = sample.stats.frames - last.stats.frames;
+        quint64 dropped = sample.stats.dropped - last.stats.dropped;
+        quint64 skipped = sample.stats.skipped - last.stats.skipped;
+        double cpu = qMax(sample.stats.cpuTime - last.stats.cpuTime, 0.) / elapsed * 100.;
+        double blend = (sample.blendTime - last.blendTime) / elapsed * 1000000.;
+        totalCpu += cpu;
+        totalBlend += blend;
+        // If more than 10% of the frames had to be dropped, the animation can't keep up with the frame rate
+        bool slow = (dropped * 10 > frames + dropped);
+        if(slow)
+            slowCount++;
+        item->setIcon(slow ? warning : QIcon());
+        item->setToolTip(QString("%1 FPS, %2 ms latency\n%3 frames dropped, %4 durations skipped\n%5% CPU, %6 µs/s blending")
+                         .arg(qRound(frames / elapsed)).arg(sample.stats.latency, 0, 'f', 1)
+                         .arg(dropped).arg(skipped)
+                         .arg(cpu, 0, 'f', 1).arg(qRound(blend)));
+    }
+    lastStats = newStats;
+    if(count == 0){
+        ui->perfLabel->setVisible(false);
+        return;
+    }
+    QString summary = QString("%1% CPU, %2 µs/s blending").arg(totalCpu, 0, 'f', 1).arg(qRound(totalBlend));
+    if(slowCount > 0)
+        summary += QString(" - %1 animation(s) can't keep up").arg(slowCount);
+    ui->perfLabel->setText(summary);
+    ui->perfLabel->setVisible(true);
+}
+
 void KbAnimWidget::clearSelection(){
     ui->animList->setCurrentItem(0);
     setCurrent(0);
@@ -1,6 +1,7 @@
 #ifndef KBANIMWIDGET_H
 #define KBANIMWIDGET_H
 
+#include <QElapsedTimer>
 #include <QListWidgetItem>
 #include <QTimer>
 #include <QWidget>
@@ -44,6 +45,7 @@ private slots:
 
     void refreshList();
     void reorderAnims();
+    void updateStats();
 
 
     void on_propertyButton_clicked();
@@ -57,6 +59,15 @@ private:
     QStringList selectedKeys;
     bool noReorder;
 
+    // Performance statistics, sampled once per second to find the frame rate and CPU usage of each animation
+    struct StatSample {
+        AnimScript::Stats stats;
+        double blendTime;
+    };
+    QHash<KbAnim*, StatSample> lastStats;
+    QTimer statsTimer;
+    QElapsedTimer statsElapsed;
+
     Ui::KbAnimWidget *ui;
 };
 
@@ -6,19 +6,22 @@
 
 QHash<QString, QString> KbBind::_globalRemap;
 quint64 KbBind::globalRemapTime = 0;
+// The global remap is read by the devices' frame threads (see update())
+static QMutex remapLock;
 
 KbBind::KbBind(KbMode* modeParent, Kb* parentBoard, const KeyMap& keyMap) :
-    QObject(modeParent), _devParent(parentBoard), lastGlobalRemapTime(globalRemapTime), _map(keyMap),
+    QObject(modeParent), _devParent(parentBoard), frameLock(Kb::frameLock(parentBoard)), lastGlobalRemapTime(globalRemapTime), _map(keyMap),
     _winLock(false), _needsUpdate(true), _needsSave(true) {
 }
 
 KbBind::KbBind(KbMode* modeParent, Kb* parentBoard, const KeyMap& keyMap, const KbBind& other) :
-    QObject(modeParent), _devParent(parentBoard), lastGlobalRemapTime(globalRemapTime), _bind(other._bind),
+    QObject(modeParent), _devParent(parentBoard), frameLock(Kb::frameLock(parentBoard)), lastGlobalRemapTime(globalRemapTime), _bind(other._bind),
     _winLock(false), _needsUpdate(true), _needsSave(true) {
     map(keyMap);
 }
 
 void KbBind::load(QSettings& settings){
+    QMutexLocker locker(frameLock);
     _needsSave = false;
     settings.beginGroup("Binding");
     KeyMap currentMap = _map;
@@ -51,13 +54,37 @@ void KbBind::save(QSettings& settings){
     settings.endGroup();
 }
 
+void KbBind::load(QDataStream& stream){
+    QMutexLocker locker(frameLock);
+    _needsSave = false;
+    KeyMap currentMap = _map;
+    QString mapName;
+    stream >> mapName >> _bind;
+    _map = KeyMap::fromName(mapName);
+    emit didLoad();
+    map(currentMap);
+}
+
+void KbBind::save(QDataStream& stream){
+    _needsSave = false;
+    QHash<QString, QString> bind;
+    foreach(QString key, _bind.keys()){
+        QString act = _bind.value(key);
+        if(act != defaultAction(key))
+            bind[key] = act;
+    }
+    stream << _map.name() << bind;
+}
+
 QString KbBind::globalRemap(const QString& key){
+    QMutexLocker locker(&remapLock);
     if(!_globalRemap.contains(key))
         return key;
     return _globalRemap.value(key);
 }
 
 void KbBind::setGlobalRemap(const QHash<QString, QString> keyToActual){
+    QMutexLocker locker(&remapLock);
     _globalRemap.clear();
     // Ignore any keys with the standard binding
     QHashIterator<QString, QString> i(keyToActual);
@@ -70,6 +97,7 @@ void KbBind::setGlobalRemap(const QHash<QString, QString> keyToActual){
 }
 
 void KbBind::loadGlobalRemap(){
+    QMutexLocker locker(&remapLock);
     _globalRemap.clear();
     QSettings settings;
     settings.beginGroup("Program/GlobalRemap");
@@ -90,6 +118,7 @@ void KbBind::saveGlobalRemap(){
 }
 
 void KbBind::map(const KeyMap& map){
+    QMutexLocker locker(frameLock);
     _map = map;
     // Remove any keys not present in the map
     QHashIterator<QString, QString> i(_bind);
@@ -114,6 +143,47 @@ QString KbBind::action(const QString& key){
     return defaultAction(key);
 }
 
+int KbBind::modeTarget(int mode, int current, int modeCount){
+    switch(mode){
+    case MODE_PREV_WRAP:
+        mode = current - 1;
+        if(mode < 0)
+            mode = modeCount - 1;
+        break;
+    case MODE_NEXT_WRAP:
+        mode = current + 1;
+        if(mode >= modeCount)
+            mode = 0;
+        break;
+    case MODE_PREV:
+        mode = current - 1;
+        break;
+    case MODE_NEXT:
+        mode = current + 1;
+        break;
+    default:
+        // Absolute
+        break;
+    }
+    if(mode < 0 || mode >= modeCount)
+        return -1;
+    return mode;
+}
+
+QList<int> KbBind::modeTargets(int current, int modeCount){
+    QList<int> targets;
+    uint count = _map.count();
+    for(uint i = 0; i < count; i++){
+        QString act = action(_map.key(i)->name);
+        if(!act.startsWith("$mode:"))
+            continue;
+        int mode = modeTarget(act.mid(6).toInt(), current, modeCount);
+        if(mode >= 0 && mode != current && !targets.contains(mode))
+            targets.append(mode);
+    }
+    return targets;
+}
+
 QString KbBind::defaultAction(const QString& key){
     QString rKey = globalRemap(key);
     // G1-G18 are unbound by default
@@ -194,6 +264,7 @@ QString KbBind::friendlyActionName(const QString& key){
 }
 
 void KbBind::resetAction(const QString &key){
+    QMutexLocker locker(frameLock);
     QString rKey = globalRemap(key);
     _bind.remove(rKey);
     _needsUpdate = true;
@@ -201,6 +272,7 @@ void KbBind::resetAction(const QString &key){
 }
 
 void KbBind::noAction(const QString& key){
+    QMutexLocker locker(frameLock);
     QString rKey = globalRemap(key);
     if(!_map.key(rKey))
         return;
@@ -210,6 +282,7 @@ void KbBind::noAction(const QString& key){
 }
 
 void KbBind::keyAction(const QString& key, const QString& actionKey){
+    QMutexLocker locker(frameLock);
     QString rKey = globalRemap(key);
     if(!_map.key(rKey))
         return;
@@ -219,6 +292,7 @@ void KbBind::keyAction(const QString& key, const QString& actionKey){
 }
 
 void KbBind::modeAction(const QString& key, int mode){
+    QMutexLocker locker(frameLock);
     QString rKey = globalRemap(key);
     if(!_map.key(rKey))
         return;
@@ -228,6 +302,7 @@ void KbBind::modeAction(const QString& key, int mode){
 }
 
 void KbBind::lightAction(const QString& key, int type){
+    QMutexLocker locker(frameLock);
     QString rKey = globalRemap(key);
     if(!_map.key(rKey))
         return;
@@ -237,6 +312,7 @@ void KbBind::lightAction(const QString& key, int type){
 }
 
 void KbBind::lockAction(const QString& key, int type){
+    QMutexLocker locker(frameLock);
     QString rKey = globalRemap(key);
     if(!_map.key(rKey))
         return;
@@ -246,6 +322,7 @@ void KbBind::lockAction(const QString& key, int type){
 }
 
 void KbBind::programAction(const QString& key, const QString& onPress, const QString& onRelease, int stop){
+    QMutexLocker locker(frameLock);
     QString rKey = globalRemap(key);
     if(!_map.key(rKey))
         return;
@@ -255,6 +332,12 @@ void KbBind::programAction(const QString& key, const QString& onPress, const QSt
     _needsSave = true;
 }
 
+void KbBind::winLock(bool newWinLock){
+    QMutexLocker locker(frameLock);
+    _winLock = newWinLock;
+    _needsUpdate = true;
+}
+
 QString KbBind::specialInfo(const QString& action, int& parameter){
     QStringList list = action.split(":");
     if(list.length() < 2){
@@ -277,14 +360,17 @@ int KbBind::programInfo(const QString& action, QString& onPress, QString& onRele
     return programs[2].toInt();
 }
 
-void KbBind::update(QFile& cmd, bool force){
-    if(!force && !_needsUpdate && lastGlobalRemapTime == globalRemapTime)
+void KbBind::update(QByteArray& cmd, DriverState& state, bool force){
+    QMutexLocker locker(frameLock);
+    remapLock.lock();
+    quint64 remapTime = globalRemapTime;
+    QHash<QString, QString> remap = _globalRemap;
+    remapLock.unlock();
+    if(!force && state.valid && !_needsUpdate && lastGlobalRemapTime == remapTime)
         return;
-    lastGlobalRemapTime = globalRemapTime;
+    lastGlobalRemapTime = remapTime;
     emit updated();
     _needsUpdate = false;
-    // Reset all keys and enable notifications for all
-    cmd.write("rebind all notify all");
     // Make sure modifier keys are included as they may be remapped globally
     QHash<QString, QString> bind(_bind);
     if(!_bind.contains("caps")) bind["caps"] = "caps";
@@ -296,29 +382,58 @@ void KbBind::update(QFile& cmd, bool force){
     if(!_bind.contains("rwin")) bind["rwin"] = "rwin";
     if(!_bind.contains("lalt")) bind["lalt"] = "lalt";
     if(!_bind.contains("ralt")) bind["ralt"] = "ralt";
-    QHashIterator<QString, QString> i(bind);
-    // Write out rebound keys
+    // Find what the driver should hold for each key
+    QMutableHashIterator<QString, QString> i(bind);
     while(i.hasNext()){
         i.next();
-        QString key = i.key();
         QString act = i.value();
-        if(_globalRemap.contains(key))
-            act = action(key);
-        if(act.isEmpty() || isSpecial(act)){
-            // If the key is unbound or is a special action, unbind it
-            cmd.write(" unbind ");
-            cmd.write(key.toLatin1());
-        } else {
-            // Otherwise, write the binding
-            cmd.write(" bind ");
-            cmd.write(key.toLatin1());
-            cmd.write(":");
-            cmd.write(act.toLatin1());
-        }
+        if(remap.contains(i.key()))
+            act = action(i.key());
+        // If the key is unbound or is a special action, unbind it
+        if(isSpecial(act))
+            act = "";
+        i.setValue(act);
     }
     // If win lock is enabled, unbind windows keys
     if(_winLock)
-        cmd.write(" unbind lwin rwin");
+        bind["lwin"] = bind["rwin"] = "";
+
+    if(!state.valid){
+        // Reset all keys and enable notifications for all
+        cmd += "rebind all notify all";
+        state.bind.clear();
+        state.valid = true;
+    } else {
+        // Reset keys which are no longer rebound
+        QHashIterator<QString, QString> old(state.bind);
+        while(old.hasNext()){
+            old.next();
+            if(!bind.contains(old.key())){
+                cmd += " rebind ";
+                cmd += old.key().toLatin1();
+            }
+        }
+    }
+    // Write out rebound keys which changed
+    QHashIterator<QString, QString> j(bind);
+    while(j.hasNext()){
+        j.next();
+        QString key = j.key();
+        QString act = j.value();
+        QHash<QString, QString>::const_iterator sent = state.bind.constFind(key);
+        if(sent != state.bind.constEnd() && sent.value() == act)
+            continue;
+        if(act.isEmpty()){
+            cmd += " unbind ";
+            cmd += key.toLatin1();
+        } else {
+            cmd += " bind ";
+            cmd += key.toLatin1();
+            cmd += ":";
+            cmd += act.toLatin1();
+        }
+    }
+    state.bind = bind;
 }
 
 void KbBind::keyEvent(const QString& key, bool down){
@@ -338,31 +453,8 @@ void KbBind::keyEvent(const QString& key, bool down){
         // Change mode
         Kb* device = devParent();
         KbProfile* currentProfile = device->currentProfile();
-        int mode = currentProfile->indexOf(currentProfile->currentMode());
-        int modeCount = currentProfile->modeCount();
-        switch(suffix){
-        case MODE_PREV_WRAP:
-            mode--;
-            if(mode < 0)
-                mode = modeCount - 1;
-            break;
-        case MODE_NEXT_WRAP:
-            mode++;
-            if(mode >= modeCount)
-                mode = 0;
-            break;
-        case MODE_PREV:
-            mode--;
-            break;
-        case MODE_NEXT:
-            mode++;
-            break;
-        default:
-            // Absolute
-            mode = suffix;
-            break;
-        }
-        if(mode < 0 || mode >= modeCount)
+        int mode = modeTarget(suffix, currentProfile->indexOf(currentProfile->currentMode()), currentProfile->modeCount());
+        if(mode < 0)
             return;
         device->setCurrentMode(currentProfile->modes()[mode]);
     } else if(prefix == "$light"){
@@ -1,8 +1,10 @@
 #ifndef KBBIND_H
 #define KBBIND_H
 
+#include <QDataStream>
 #include <QFile>
 #include <QHash>
+#include <QMutex>
 #include <QObject>
 #include <QProcess>
 #include <QSettings>
@@ -23,6 +25,9 @@ public:
     // Load and save from stored settings
     void load(QSettings& settings);
     void save(QSettings& settings);
+    // Binary versions (see ProfileStore)
+    void load(QDataStream& stream);
+    void save(QDataStream& stream);
     inline bool needsSave() const { return _needsSave; }
 
     // Key map
@@ -72,6 +77,10 @@ public:
     const static int MODE_PREV_WRAP = -4, MODE_NEXT_WRAP = -3;
     void modeAction(const QString& key, int mode);
     inline void modeAction(const QStringList& keys, int mode) { foreach(const QString& key, keys) modeAction(key, mode); }
+    // Mode index that a mode-switch action leads to from the current mode, or -1 if it doesn't go anywhere
+    static int modeTarget(int mode, int current, int modeCount);
+    // All modes that this mode can switch to
+    QList<int> modeTargets(int current, int modeCount);
     // Sets a key to control brightness.
     const static int LIGHT_UP = 0, LIGHT_DOWN = 1;
     const static int LIGHT_UP_WRAP = 2, LIGHT_DOWN_WRAP = 3;
@@ -90,11 +99,20 @@ public:
 
     // Current win lock state
     inline bool winLock() { return _winLock; }
-    void winLock(bool newWinLock) { _winLock = newWinLock; _needsUpdate = true; }
+    void winLock(bool newWinLock);
 
-    // Updates bindings to the driver. Write "mode %d" first.
-    // By default, nothing will be written unless bindings have changed. Use force = true to overwrite.
-    void update(QFile& cmd, bool force = false);
+    // Bindings held by the driver for one of the device's modes. Keys that aren't listed have their default binding
+    // (an empty action means unbound). Invalid if unknown, e.g. after the profile was erased.
+    struct DriverState {
+        bool valid;
+        QHash<QString, QString> bind;
+        DriverState() : valid(false) {}
+    };
+
+    // Updates bindings to the driver. Write "mode %d" first. state is what the driver currently holds for that mode, only
+    // the differences are written. If it isn't valid, all keys are rebound.
+    // By default, nothing will be written unless bindings have changed. Use force = true to compare them anyway.
+    void update(QByteArray& cmd, DriverState& state, bool force = false);
 
 public slots:
     // Callback for a keypress event.
@@ -108,6 +126,8 @@ signals:
 
 private:
     Kb* _devParent;
+    // Frame lock of the device (see Kb::frameLock()). Held by everything the frames use
+    QMutex* frameLock;
     inline Kb* devParent() { return _devParent; }
     inline KbMode* modeParent() { return (KbMode*)parent(); }
 
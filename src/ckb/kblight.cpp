@@ -1,19 +1,22 @@
 #include <cmath>
 #include <QDateTime>
 #include <QSet>
+#include "kb.h"
 #include "kblight.h"
 
+// Shared by the devices' frame threads
+static QMutex activeLock;
 static int _shareDimming = -1;
 static QSet<KbLight*> activeLights;
 
 KbLight::KbLight(QObject* parent, const KeyMap& keyMap) :
-    QObject(parent), _previewAnim(0), _dimming(0), _inactive(MAX_INACTIVE), _showMute(true), _start(false), _needsSave(true)
+    QObject(parent), frameLock(Kb::frameLock(parent)), _previewAnim(0), _colorsChanged(true), _dimming(0), _inactive(MAX_INACTIVE), _showMute(true), _start(false), _needsSave(true), _lastScale(-1)
 {
     map(keyMap);
 }
 
 KbLight::KbLight(QObject* parent, const KeyMap& keyMap, const KbLight& other) :
-    QObject(parent), _previewAnim(0), _map(other._map), _colorMap(other._colorMap), _dimming(other._dimming), _inactive(other._inactive), _showMute(other._showMute), _start(false), _needsSave(true)
+    QObject(parent), frameLock(Kb::frameLock(parent)), _previewAnim(0), _map(other._map), _colorMap(other._colorMap), _colorsChanged(true), _dimming(other._dimming), _inactive(other._inactive), _showMute(other._showMute), _start(false), _needsSave(true), _lastScale(-1)
 {
     map(keyMap);
     // Duplicate animations
@@ -22,29 +25,20 @@ KbLight::KbLight(QObject* parent, const KeyMap& keyMap, const KbLight& other) :
 }
 
 void KbLight::map(const KeyMap& map){
+    QMutexLocker locker(frameLock);
     uint newCount = map.count();
-    uint oldCount = _map.count();
     QHash<QString, QRgb> newColorMap = _colorMap;
     // Translate key colors by position (if possible)
     for(uint i = 0; i < newCount; i++){
-        const KeyPos* newPos = map.key(i);
-        QString name = newPos->name;
-        if(name != "enter"){
-            bool found = false;
-            for(uint j = 0; j < oldCount; j++){
-                // Scan old map for matching positions
-                const KeyPos* oldPos = _map.key(j);
-                QString oldName = oldPos->name;
-                if(oldPos->x == newPos->x && oldPos->y == newPos->y
-                        && oldName != "enter" && _colorMap.contains(oldName)){
-                    // If found, set color
-                    found = true;
-                    newColorMap[name] = _colorMap.value(oldName);
-                    break;
-                }
-            }
-            if(found)
+        QString name = map.key(i)->name;
+        int oldIndex = _map.indexOfId(map.id(i));
+        if(oldIndex >= 0){
+            QString oldName = _map.key(oldIndex)->name;
+            if(_colorMap.contains(oldName)){
+                // If found, set color
+                newColorMap[name] = _colorMap.value(oldName);
                 continue;
+            }
         }
         // If the map still doesn't contain the key, set it to white.
         if(!newColorMap.contains(name))
@@ -55,43 +49,74 @@ void KbLight::map(const KeyMap& map){
     foreach(KbAnim* anim, _animList)
         anim->map(map);
     _colorMap = newColorMap;
-    _needsSave = true;
+    _needsSave = _colorsChanged = true;
     emit updated();
 }
 
 KbLight::~KbLight(){
+    QMutexLocker locker(&activeLock);
     activeLights.remove(this);
 }
 
+void KbLight::color(const QString& key, const QColor& newColor){
+    QMutexLocker locker(frameLock);
+    _needsSave = _colorsChanged = true;
+    _colorMap[key] = newColor.rgb();
+}
+
 void KbLight::color(const QColor& newColor){
+    QMutexLocker locker(frameLock);
     QRgb newRgb = newColor.rgb();
     uint count = _map.count();
     for(uint i = 0; i < count; i++)
         _colorMap[_map.key(i)->name] = newRgb;
-    _needsSave = true;
+    _needsSave = _colorsChanged = true;
 }
 
 int KbLight::shareDimming(){
+    QMutexLocker locker(&activeLock);
     return _shareDimming;
 }
 
 void KbLight::shareDimming(int newShareDimming){
+    activeLock.lock();
     _shareDimming = newShareDimming;
+    QSet<KbLight*> lights = activeLights;
+    activeLock.unlock();
+    // dimming() takes the lights' frame locks, which must not be taken while holding the active list
     if(newShareDimming != -1){
-        foreach(KbLight* light, activeLights)
+        foreach(KbLight* light, lights)
             light->dimming(newShareDimming);
     }
 }
 
 void KbLight::dimming(int newDimming){
+    QMutexLocker locker(frameLock);
+    activeLock.lock();
     if(_shareDimming != -1)
         _shareDimming = newDimming;
+    activeLock.unlock();
     _needsSave = true;
     _dimming = newDimming;
     emit updated();
 }
 
+void KbLight::inactive(int in){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _inactive = in;
+    emit updated();
+}
+
+void KbLight::showMute(bool newShowMute){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _showMute = newShowMute;
+    emit updated();
+}
+
 KbAnim* KbLight::addAnim(const AnimScript *base, const QStringList &keys, const QString& name, const QMap<QString, QVariant>& preset){
+    QMutexLocker locker(frameLock);
     // Stop and restart all existing animations
     quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
     foreach(KbAnim* anim, _animList){
@@ -115,6 +140,7 @@ KbAnim* KbLight::addAnim(const AnimScript *base, const QStringList &keys, const
 }
 
 void KbLight::previewAnim(const AnimScript* base, const QStringList& keys, const QMap<QString, QVariant>& preset){
+    QMutexLocker locker(frameLock);
     if(_previewAnim)
         stopPreview();
     quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
@@ -134,11 +160,15 @@ void KbLight::previewAnim(const AnimScript* base, const QStringList& keys, const
 }
 
 void KbLight::stopPreview(){
-    delete _previewAnim;
+    QMutexLocker locker(frameLock);
+    // Also called on the frame thread, so the animation is left for the GUI thread to delete
+    if(_previewAnim)
+        _previewAnim->deleteLater();
     _previewAnim = 0;
 }
 
 KbAnim* KbLight::duplicateAnim(KbAnim* oldAnim){
+    QMutexLocker locker(frameLock);
     // Stop and restart all existing animations
     quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
     foreach(KbAnim* anim, _animList){
@@ -159,7 +189,14 @@ KbAnim* KbLight::duplicateAnim(KbAnim* oldAnim){
     return anim;
 }
 
+void KbLight::animList(const QList<KbAnim*>& newAnimList){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _animList = newAnimList;
+}
+
 bool KbLight::isStarted(){
+    QMutexLocker locker(frameLock);
     if(!_start)
         return false;
     foreach(KbAnim* animation, _animList){
@@ -170,6 +207,7 @@ bool KbLight::isStarted(){
 }
 
 void KbLight::restartAnimation(){
+    QMutexLocker locker(frameLock);
     quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
     foreach(KbAnim* anim, _animList){
         anim->stop();
@@ -180,6 +218,7 @@ void KbLight::restartAnimation(){
 }
 
 void KbLight::animKeypress(const QString& key, bool down){
+    QMutexLocker locker(frameLock);
     foreach(KbAnim* anim, _animList){
         if(anim->keys().contains(key))
             anim->keypress(key, down, QDateTime::currentMSecsSinceEpoch());
@@ -190,88 +229,105 @@ void KbLight::animKeypress(const QString& key, bool down){
     }
 }
 
-void KbLight::printRGB(QFile& cmd, const QHash<QString, QRgb>& animMap){
-    cmd.write(" rgb on");
-    QHashIterator<QString, QRgb> i(animMap);
-    while(i.hasNext()){
-        i.next();
-        QString name = i.key();
+void KbLight::updateColors(){
+    uint count = _map.count();
+    _colors.resize(count);
+    for(uint i = 0; i < count; i++)
+        _colors[i] = _colorMap.value(_map.key(i)->name, 0xFFFFFFFF);
+    _colorsChanged = false;
+}
+
+void KbLight::printRGB(QByteArray& cmd, const QVector<QRgb>& colors, const QVector<QRgb>& previous){
+    // If there's no previous frame, write everything. Otherwise write only the keys that changed
+    bool full = (previous.count() != colors.count());
+    if(full)
+        cmd += " rgb on";
+    bool first = true;
+    uint count = qMin(_map.count(), (uint)colors.count());
+    bool k65 = (_map.model() == KeyMap::K65);
+    for(uint i = 0; i < count; i++){
+        QRgb color = colors[i];
+        if(!full && color == previous[i])
+            continue;
+        const char* name = _map.key(i)->name;
         // Volume buttons don't have LEDs except on the K65
-        if(_map.model() != KeyMap::K65 && (name == "volup" || name == "voldn"))
+        if(!k65 && (!strcmp(name, "volup") || !strcmp(name, "voldn")))
             continue;
-        QRgb color = i.value();
-        cmd.write(" ");
-        cmd.write(name.toLatin1());
+        if(first && !full)
+            cmd += " rgb";
+        first = false;
         char output[8];
         snprintf(output, sizeof(output), ":%02x%02x%02x", qRed(color), qGreen(color), qBlue(color));
-        cmd.write(output);
+        cmd += " ";
+        cmd += name;
+        cmd += output;
     }
 }
 
-void KbLight::frameUpdate(QFile& cmd, int modeIndex, bool dimMute, bool dimLock){
-    // Advance animations
-    QHash<QString, QRgb> animMap = _colorMap;
+void KbLight::frameUpdate(QByteArray& cmd, int modeIndex, bool dimMute, bool dimLock){
+    QMutexLocker locker(frameLock);
+    // Advance animations. The frame buffer is reused, so this doesn't allocate unless the key map changes
+    if(_colorsChanged)
+        updateColors();
+    int count = _colors.count();
+    _frameColors.resize(count);
+    memcpy(_frameColors.data(), _colors.constData(), count * sizeof(QRgb));
     quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
     foreach(KbAnim* anim, _animList)
-        anim->blend(animMap, timestamp);
+        anim->blend(_frameColors, timestamp);
     if(_previewAnim)
-        _previewAnim->blend(animMap, timestamp);
+        _previewAnim->blend(_frameColors, timestamp);
 
-    cmd.write(QString().sprintf("mode %d switch", modeIndex + 1).toLatin1());
     if(_dimming == 3){
         // If brightness is at 0%, turn off lighting entirely
-        cmd.write(" rgb off");
+        if(_lastScale != SCALE_OFF){
+            cmd += " rgb off";
+            _lastScale = SCALE_OFF;
+            _lastFrame.clear();
+        }
         return;
     }
 
-    // Dim inactive keys
-    float light = (3 - _dimming) / 3.f;
-    QStringList inactiveList = QStringList();
-    float inactiveLight = 1.f;
-    if(_inactive >= 0){
-        inactiveList << "mr" << "m1" << "m2" << "m3";
-        if(dimLock)
-            inactiveList << "lock";
-        if(dimMute && _showMute)
-            inactiveList << "mute";
-        inactiveList.removeAll(QString("m%1").arg(modeIndex + 1));
-        inactiveLight = (2 - _inactive) / 4.f;
-    }
-
-    // Set brightness
-    if(light != 1.f || inactiveLight != 1.f){
-        QMutableHashIterator<QString, QRgb> i(animMap);
-        while(i.hasNext()){
-            i.next();
-            QRgb& rgb = i.value();
-            float r = qRed(rgb);
-            float g = qGreen(rgb);
-            float b = qBlue(rgb);
-            if(light != 1.f){
-                r *= light;
-                g *= light;
-                b *= light;
-            }
-            if(inactiveLight != 1.f && inactiveList.contains(i.key())){
-                r *= inactiveLight;
-                g *= inactiveLight;
-                b *= inactiveLight;
-            }
-            rgb = qRgb(round(r), round(g), round(b));
+    // Brightness and inactive key dimming are applied by the daemon, so the colors are sent unscaled.
+    // The settings only need to be written when they change.
+    bool muteDimmed = dimMute && _showMute;
+    int scaleKey = _dimming | (_inactive + 1) << 4 | dimLock << 8 | muteDimmed << 9 | modeIndex << 10;
+    if(scaleKey != _lastScale){
+        _lastScale = scaleKey;
+        QString scale = QString(" brightness %1 dim all:100").arg(qRound((3 - _dimming) * 100 / 3.f));
+        if(_inactive >= 0){
+            QStringList inactiveList = QStringList();
+            inactiveList << "mr" << "m1" << "m2" << "m3";
+            if(dimLock)
+                inactiveList << "lock";
+            if(muteDimmed)
+                inactiveList << "mute";
+            inactiveList.removeAll(QString("m%1").arg(modeIndex + 1));
+            scale += QString(" dim %1:%2").arg(inactiveList.join(",")).arg((2 - _inactive) * 25);
         }
+        cmd += scale.toLatin1();
     }
 
-    // Apply light
-    printRGB(cmd, animMap);
+    // Apply light. Only the keys which changed since the last frame are sent
+    printRGB(cmd, _frameColors, _lastFrame);
+    _lastFrame.resize(count);
+    memcpy(_lastFrame.data(), _frameColors.constData(), count * sizeof(QRgb));
 }
 
 void KbLight::open(){
+    QMutexLocker locker(frameLock);
     // Apply shared dimming if needed
-    if(_shareDimming != -1 && _shareDimming != _dimming)
-        dimming(_shareDimming);
+    int share = shareDimming();
+    if(share != -1 && share != _dimming)
+        dimming(share);
+    activeLock.lock();
     activeLights.insert(this);
+    activeLock.unlock();
     if(_start)
         return;
+    // Brightness and colors need to be re-sent in full after a mode switch
+    _lastScale = -1;
+    _lastFrame.clear();
     quint64 timestamp = QDateTime::currentMSecsSinceEpoch();
     foreach(KbAnim* anim, _animList)
         anim->trigger(timestamp);
@@ -281,31 +337,61 @@ void KbLight::open(){
 }
 
 void KbLight::close(){
+    QMutexLocker locker(frameLock);
+    activeLock.lock();
     activeLights.remove(this);
+    activeLock.unlock();
     foreach(KbAnim* anim, _animList)
         anim->stop();
     stopPreview();
     _start = false;
 }
 
+void KbLight::warmUp(){
+    QMutexLocker locker(frameLock);
+    if(_start)
+        return;
+    foreach(KbAnim* anim, _animList)
+        anim->warmUp();
+}
+
+void KbLight::park(){
+    QMutexLocker locker(frameLock);
+    activeLock.lock();
+    activeLights.remove(this);
+    activeLock.unlock();
+    foreach(KbAnim* anim, _animList)
+        anim->park();
+    stopPreview();
+    _start = false;
+}
+
 void KbLight::base(QFile &cmd, int modeIndex){
+    QMutexLocker locker(frameLock);
     close();
     if(_dimming == MAX_DIM){
         cmd.write(QString().sprintf("mode %d rgb off", modeIndex + 1).toLatin1());
         return;
     }
-    // Set just the background color, ignoring any animation
+    // Set just the background color, ignoring any animation or brightness. Brightness is applied by the daemon and hardware
+    // saves aren't scaled, so it's left as it is; changing it here would go unnoticed by the other modes' lights
     cmd.write(QString().sprintf("mode %d", modeIndex + 1).toLatin1());
-    QHash<QString, QRgb> animMap = _colorMap;
-    animMap["mr"] = qRgb(0, 0, 0);
-    animMap["m1"] = qRgb(0, 0, 0);
-    animMap["m2"] = qRgb(0, 0, 0);
-    animMap["m3"] = qRgb(0, 0, 0);
-    animMap["lock"] = qRgb(0, 0, 0);
-    printRGB(cmd, animMap);
+    if(_colorsChanged)
+        updateColors();
+    QVector<QRgb> colors = _colors;
+    // Indicator keys are turned off
+    foreach(const QString& name, QStringList() << "mr" << "m1" << "m2" << "m3" << "lock"){
+        int index = _map.index(name);
+        if(index >= 0)
+            colors[index] = qRgb(0, 0, 0);
+    }
+    QByteArray rgb;
+    printRGB(rgb, colors, QVector<QRgb>());
+    cmd.write(rgb);
 }
 
 void KbLight::load(QSettings& settings){
+    QMutexLocker locker(frameLock);
     // Load light settings
     _needsSave = false;
     settings.beginGroup("Lighting");
@@ -369,6 +455,39 @@ void KbLight::save(QSettings& settings){
     settings.endGroup();
 }
 
+void KbLight::load(QDataStream& stream){
+    QMutexLocker locker(frameLock);
+    _needsSave = false;
+    KeyMap currentMap = _map;
+    QString mapName;
+    quint32 dimming;
+    qint32 inactive;
+    quint32 animCount;
+    stream >> mapName >> dimming >> inactive >> _showMute >> _colorMap >> animCount;
+    _map = KeyMap::fromName(mapName);
+    if(dimming > (quint32)MAX_DIM)
+        dimming = MAX_DIM;
+    _dimming = dimming;
+    _inactive = inactive;
+    if(_inactive > MAX_INACTIVE)
+        _inactive = MAX_INACTIVE;
+    // Load animations
+    foreach(KbAnim* anim, _animList)
+        anim->deleteLater();
+    _animList.clear();
+    for(quint32 i = 0; i < animCount && stream.status() == QDataStream::Ok; i++)
+        _animList.append(new KbAnim(this, _map, stream));
+    emit didLoad();
+    map(currentMap);
+}
+
+void KbLight::save(QDataStream& stream){
+    _needsSave = false;
+    stream << _map.name() << (quint32)_dimming << (qint32)_inactive << _showMute << _colorMap << (quint32)_animList.count();
+    foreach(KbAnim* anim, _animList)
+        anim->save(stream);
+}
+
 bool KbLight::needsSave() const {
     if(_needsSave)
         return true;
@@ -2,6 +2,7 @@
 #define KBLIGHT_H
 
 #include <QFile>
+#include <QMutex>
 #include <QObject>
 #include <QSettings>
 #include "animscript.h"
@@ -24,7 +25,7 @@ public:
     // Key -> color map
     inline const QHash<QString, QRgb>& colorMap() { return _colorMap; }
     // Color a key
-    inline void color(const QString& key, const QColor& newColor) { _needsSave = true; _colorMap[key] = newColor.rgb(); }
+    void color(const QString& key, const QColor& newColor);
     // Color all keys in the current map
     void color(const QColor& newColor);
 
@@ -39,17 +40,17 @@ public:
     // Inactive indicator level. -1 for no dimming, 2 for off
     static const int MAX_INACTIVE = 2;
     inline int inactive() { return _inactive; }
-    inline void inactive(int in) { _needsSave = true; _inactive = in; emit updated(); }
+    void inactive(int in);
 
     // Whether or not to indicate the mute key
     inline bool showMute() { return _showMute; }
-    inline void showMute(bool newShowMute) { _needsSave = true; _showMute = newShowMute; emit updated(); }
+    void showMute(bool newShowMute);
 
     // Lighting animations
     KbAnim* addAnim(const AnimScript* base, const QStringList& keys, const QString& name, const QMap<QString, QVariant>& preset);
     KbAnim* duplicateAnim(KbAnim* oldAnim);
     const QList<KbAnim*>& animList() { return _animList; }
-    void animList(const QList<KbAnim*>& newAnimList) { _needsSave = true; _animList = newAnimList; }
+    void animList(const QList<KbAnim*>& newAnimList);
     // Preview animation - temporary animation displayed at the top of the animation list
     void previewAnim(const AnimScript* base, const QStringList& keys, const QMap<QString, QVariant>& preset);
     void stopPreview();
@@ -62,16 +63,24 @@ public:
     void open();
     // Whether or not all animations have started
     bool isStarted();
-    // Write a new frame to the keyboard.
-    void frameUpdate(QFile& cmd, int modeIndex, bool dimMute, bool dimLock);
+    // Advance the animations and write the lighting commands for a new frame. Only the changes since the last frame are written,
+    // so nothing is written at all if the frame is the same.
+    void frameUpdate(QByteArray& cmd, int modeIndex, bool dimMute, bool dimLock);
     // Make the lighting idle, stopping any animations.
     void close();
+    // Launch the animation scripts in advance, so that open() doesn't have to wait for them. Does nothing if already open
+    void warmUp();
+    // Like close(), but leaves the animations ready to start again (see warmUp)
+    void park();
     // Write the mode's base colors without any animation
     void base(QFile& cmd, int modeIndex);
 
     // Load and save from stored settings
     void load(QSettings& settings);
     void save(QSettings& settings);
+    // Binary versions (see ProfileStore)
+    void load(QDataStream& stream);
+    void save(QDataStream& stream);
     bool needsSave() const;
 
 signals:
@@ -79,17 +88,28 @@ signals:
     void updated();
 
 private:
+    // Frame lock of the device (see Kb::frameLock()). Held by everything the frames use
+    QMutex* frameLock;
     QList<KbAnim*> _animList;
     KbAnim* _previewAnim;
     KeyMap _map;
     QHash<QString, QRgb> _colorMap;
+    // Base colors and the frame being built, indexed by key map position. The base colors are rebuilt from the color map when it changes
+    QVector<QRgb> _colors, _frameColors;
+    // Last frame written to the keyboard. Empty if the next frame must be written in full
+    QVector<QRgb> _lastFrame;
+    bool _colorsChanged;
     int _dimming;
     int _inactive;
     bool _showMute;
     bool _start;
     bool _needsSave;
+    // Last brightness settings sent to the daemon (see frameUpdate)
+    int _lastScale;
+    static const int SCALE_OFF = -2;
 
-    void printRGB(QFile& cmd, const QHash<QString, QRgb>& animMap);
+    void updateColors();
+    void printRGB(QByteArray& cmd, const QVector<QRgb>& colors, const QVector<QRgb>& previous);
 };
 
 #endif // KBLIGHT_H
@@ -7,8 +7,8 @@ KbLightWidget::KbLightWidget(QWidget *parent) :
     ui(new Ui::KbLightWidget)
 {
     ui->setupUi(this);
-    if(AnimScript::count() == 0)
-        ui->animButton->setVisible(false);
+    updateAnimButton();
+    connect(AnimScanner::instance(), SIGNAL(finished()), this, SLOT(updateAnimButton()));
 
     connect(ui->bgButton, SIGNAL(colorChanged(QColor)), this, SLOT(changeColor(QColor)));
     connect(ui->keyWidget, SIGNAL(selectionChanged(QStringList)), this, SLOT(newSelection(QStringList)));
@@ -93,6 +93,10 @@ void KbLightWidget::on_brightnessBox_activated(int index){
         light->dimming(index);
 }
 
+void KbLightWidget::updateAnimButton(){
+    ui->animButton->setVisible(AnimScript::count() != 0);
+}
+
 void KbLightWidget::on_bgButton_clicked(){
     if(currentSelection.isEmpty())
         ui->keyWidget->selectAll();
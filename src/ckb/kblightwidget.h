@@ -28,6 +28,8 @@ private slots:
     void changeColor(QColor newColor);
     void changeAnim(KbAnim* newAnim);
     void changeAnimKeys(QStringList keys);
+    // Shows the animation button if there are any animations to add
+    void updateAnimButton();
 
     void on_brightnessBox_activated(int index);
     void on_animButton_clicked();
@@ -21,6 +21,13 @@ KbMode::KbMode(Kb* parent, const KeyMap& keyMap, const KbMode& other) :
     connect(_light, SIGNAL(updated()), this, SLOT(doUpdate()));
 }
 
+KbMode::~KbMode(){
+    // Make sure the frames stop using the mode before its lighting and bindings are deleted
+    Kb* device = qobject_cast<Kb*>(parent());
+    if(device)
+        device->modeDeleted(this);
+}
+
 KbMode::KbMode(Kb *parent, const KeyMap &keyMap, QSettings &settings) :
     QObject(parent),
     _name(settings.value("Name").toString().trimmed()),
@@ -37,6 +44,21 @@ KbMode::KbMode(Kb *parent, const KeyMap &keyMap, QSettings &settings) :
     _bind->load(settings);
 }
 
+KbMode::KbMode(Kb* parent, const KeyMap& keyMap, QDataStream& stream) :
+    QObject(parent),
+    _light(new KbLight(this, keyMap)), _bind(new KbBind(this, parent, keyMap)),
+    _needsSave(false)
+{
+    connect(_light, SIGNAL(updated()), this, SLOT(doUpdate()));
+    stream >> _id.guid >> _id.modified >> _name;
+    if(_id.guid.isNull())
+        _id.guid = QUuid::createUuid();
+    if(_name == "")
+        _name = "Unnamed";
+    _light->load(stream);
+    _bind->load(stream);
+}
+
 void KbMode::newId(){
     _needsSave = true;
     _id = UsbId();
@@ -60,6 +82,13 @@ void KbMode::save(QSettings& settings){
     _bind->save(settings);
 }
 
+void KbMode::save(QDataStream& stream){
+    _needsSave = false;
+    stream << _id.guid << _id.modified << _name;
+    _light->save(stream);
+    _bind->save(stream);
+}
+
 bool KbMode::needsSave() const {
     return _needsSave || _light->needsSave() || _bind->needsSave();
 }
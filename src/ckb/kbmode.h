@@ -29,8 +29,11 @@ public:
     KbMode(Kb* parent, const KeyMap& keyMap, const QString& guid = "", const QString& modified = "");
     // Mode from settings
     KbMode(Kb* parent, const KeyMap& keyMap, QSettings& settings);
+    // Mode from a binary profile record
+    KbMode(Kb* parent, const KeyMap& keyMap, QDataStream& stream);
     // Mode by copy
     KbMode(Kb* parent, const KeyMap& keyMap, const KbMode& other);
+    ~KbMode();
 
     // Mode properties
     inline const QString& name() const { return _name; }
@@ -48,6 +51,7 @@ public:
 
     // Save settings
     void save(QSettings& settings);
+    void save(QDataStream& stream);
     bool needsSave() const;
 
 signals:
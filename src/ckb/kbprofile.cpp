@@ -2,7 +2,7 @@
 #include "kb.h"
 
 KbProfile::KbProfile(Kb* parent, const KeyMap& keyMap, const KbProfile& other) :
-    QObject(parent), _currentMode(0), _name(other._name), _id(other._id), _keyMap(keyMap), _needsSave(true)
+    QObject(parent), frameLock(Kb::frameLock(parent)), _currentMode(0), _name(other._name), _id(other._id), _keyMap(keyMap), _needsSave(true)
 {
     foreach(KbMode* mode, other.modes()){
         KbMode* newMode = new KbMode(parent, keyMap, *mode);
@@ -13,14 +13,14 @@ KbProfile::KbProfile(Kb* parent, const KeyMap& keyMap, const KbProfile& other) :
 }
 
 KbProfile::KbProfile(Kb* parent, const KeyMap& keyMap, const QString& guid, const QString& modified) :
-    QObject(parent), _currentMode(0), _id(guid, modified.toUInt(0, 16)), _keyMap(keyMap), _needsSave(true)
+    QObject(parent), frameLock(Kb::frameLock(parent)), _currentMode(0), _id(guid, modified.toUInt(0, 16)), _keyMap(keyMap), _needsSave(true)
 {
     if(_id.guid.isNull())
         _id.guid = QUuid::createUuid();
 }
 
 KbProfile::KbProfile(Kb* parent, const KeyMap& keyMap, QSettings& settings, const QString& guid) :
-    QObject(parent), _currentMode(0), _id(guid, 0), _keyMap(keyMap), _needsSave(false)
+    QObject(parent), frameLock(Kb::frameLock(parent)), _currentMode(0), _id(guid, 0), _keyMap(keyMap), _needsSave(false)
 {
     // Load data from preferences
     settings.beginGroup(guid);
@@ -43,6 +43,23 @@ KbProfile::KbProfile(Kb* parent, const KeyMap& keyMap, QSettings& settings, cons
     settings.endGroup();
 }
 
+KbProfile::KbProfile(Kb* parent, const KeyMap& keyMap, QDataStream& stream) :
+    QObject(parent), frameLock(Kb::frameLock(parent)), _currentMode(0), _keyMap(keyMap), _needsSave(false)
+{
+    QUuid current;
+    quint32 count;
+    stream >> _id.guid >> _id.modified >> _name >> current >> count;
+    if(_name == "")
+        _name = "Unnamed";
+    // Load modes. Stop at the first error so a truncated record can't produce garbage modes
+    for(quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++){
+        KbMode* mode = new KbMode(parent, _keyMap, stream);
+        _modes.append(mode);
+        if(current == mode->id().guid || !_currentMode)
+            _currentMode = mode;
+    }
+}
+
 void KbProfile::save(QSettings& settings){
     _needsSave = false;
     // Save data to preferences
@@ -63,6 +80,13 @@ void KbProfile::save(QSettings& settings){
     settings.endGroup();
 }
 
+void KbProfile::save(QDataStream& stream){
+    _needsSave = false;
+    stream << _id.guid << _id.modified << _name << (_currentMode ? _currentMode->id().guid : QUuid()) << (quint32)modeCount();
+    foreach(KbMode* mode, _modes)
+        mode->save(stream);
+}
+
 bool KbProfile::needsSave() const {
     if(_needsSave)
         return true;
@@ -73,7 +97,52 @@ bool KbProfile::needsSave() const {
     return false;
 }
 
+void KbProfile::name(const QString& newName){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _name = newName.trimmed();
+    if(_name == "")
+        _name = "Unnamed";
+}
+
+void KbProfile::id(const UsbId& newId){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _id = newId;
+}
+
+void KbProfile::modes(const QList<KbMode*>& newModes){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _modes = newModes;
+}
+
+void KbProfile::append(KbMode* newMode){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _modes.append(newMode);
+}
+
+void KbProfile::insert(int index, KbMode* newMode){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _modes.insert(index, newMode);
+}
+
+void KbProfile::removeAll(KbMode* mode){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _modes.removeAll(mode);
+}
+
+void KbProfile::move(int from, int to){
+    QMutexLocker locker(frameLock);
+    _needsSave = true;
+    _modes.move(from, to);
+}
+
 void KbProfile::newId(){
+    QMutexLocker locker(frameLock);
     _needsSave = true;
     _id = UsbId();
     foreach(KbMode* mode, _modes)
@@ -81,6 +150,7 @@ void KbProfile::newId(){
 }
 
 void KbProfile::keyMap(const KeyMap& newKeyMap){
+    QMutexLocker locker(frameLock);
     _keyMap = newKeyMap;
     foreach(KbMode* mode, _modes)
         mode->keyMap(newKeyMap);
@@ -2,6 +2,7 @@
 #define KBPROFILE_H
 
 #include <QList>
+#include <QMutex>
 #include <QObject>
 #include <QSettings>
 #include <QString>
@@ -18,16 +19,19 @@ public:
     explicit KbProfile(Kb* parent, const KeyMap& keyMap, const QString& guid = "", const QString& modified = "");
     // Load profile from settings
     explicit KbProfile(Kb* parent, const KeyMap& keyMap, QSettings& settings, const QString& guid);
+    // Load profile from a binary record
+    explicit KbProfile(Kb* parent, const KeyMap& keyMap, QDataStream& stream);
 
     // Save profile to settings
     void save(QSettings& settings);
+    void save(QDataStream& stream);
     bool needsSave() const;
 
     // Profile properties
     inline QString name() const { return _name; }
-    inline void name(const QString& newName) { _needsSave = true; _name = newName.trimmed(); if(_name == "") _name = "Unnamed"; }
+    void name(const QString& newName);
     inline UsbId& id() { return _id; }
-    inline void id(const UsbId& newId) { _needsSave = true; _id = newId; }
+    void id(const UsbId& newId);
 
     // Creates a new ID for the profile and all of its modes
     void newId();
@@ -36,13 +40,13 @@ public:
     inline const KeyMap& keyMap() const { return _keyMap; }
     void keyMap(const KeyMap& newKeyMap);
 
-    // Modes in this profile
+    // Modes in this profile. The list is read by the frames, so it's changed under the device's frame lock
     inline const QList<KbMode*>& modes() const { return _modes; }
-    inline void modes(const QList<KbMode*>& newModes) { _needsSave = true; _modes = newModes; }
-    inline void append(KbMode* newMode) { _needsSave = true; _modes.append(newMode); }
-    inline void insert(int index, KbMode* newMode) { _needsSave = true; _modes.insert(index, newMode); }
-    inline void removeAll(KbMode* mode) { _needsSave = true; _modes.removeAll(mode); }
-    inline void move(int from, int to) { _needsSave = true; _modes.move(from, to); }
+    void modes(const QList<KbMode*>& newModes);
+    void append(KbMode* newMode);
+    void insert(int index, KbMode* newMode);
+    void removeAll(KbMode* mode);
+    void move(int from, int to);
 
     inline int modeCount() const { return _modes.count(); }
     inline int indexOf(KbMode* mode) const { return _modes.indexOf(mode); }
@@ -53,6 +57,8 @@ public:
     inline void currentMode(KbMode* newCurrentMode) { _needsSave = true; _currentMode = newCurrentMode; }
 
 private:
+    // Frame lock of the device (see Kb::frameLock())
+    QMutex* frameLock;
     KbMode* _currentMode;
     QString _name;
     UsbId _id;
@@ -10,6 +10,7 @@
 #include "kbwidget.h"
 #include "kblightwidget.h"
 #include "kbprofiledialog.h"
+#include "profilestore.h"
 #include "ui_kbwidget.h"
 #include "ui_kblightwidget.h"
 
@@ -17,7 +18,8 @@ KbWidget::KbWidget(QWidget *parent, const QString &path, const QString &prefsBas
     QWidget(parent),
     device(new Kb(this, path)), hasShownNewFW(false),
     ui(new Ui::KbWidget),
-    lastAutoSave(QDateTime::currentMSecsSinceEpoch()), currentMode(0), _active(true)
+    lastAutoSave(QDateTime::currentMSecsSinceEpoch()), currentMode(0), _active(true),
+    store(0), legacyPrefs(false), saveFailed(false)
 {
     ui->setupUi(this);
     connect(ui->modesList, SIGNAL(orderChanged()), this, SLOT(modesList_reordered()));
@@ -37,6 +39,8 @@ KbWidget::KbWidget(QWidget *parent, const QString &path, const QString &prefsBas
     connect(device, SIGNAL(modeRenamed()), this, SLOT(profileChanged()));
     connect(device, SIGNAL(modeRenamed()), this, SLOT(modeChanged()));
     connect(device, SIGNAL(modeChanged(bool)), this, SLOT(modeChanged(bool)));
+    connect(&frameTimer, SIGNAL(timeout()), this, SLOT(updateFrameTiming()));
+    frameTimer.start(1000);
 
     // Remove the Lighting and Misc tabs from non-RGB keyboards
     if(!device->features.contains("rgb")){
@@ -54,30 +58,49 @@ KbWidget::KbWidget(QWidget *parent, const QString &path, const QString &prefsBas
         ui->fwUpdLayout->removeItem(ui->fwUpdLayout->itemAt(1));
     }
 
-    // Load profiles from stored settings
-    QSettings settings;
-    settings.beginGroup(prefsPath);
-    device->load(settings);
+    // Load profiles from stored settings. Older versions kept them in QSettings, so read from there if the device
+    // isn't in the store yet
+    store = new ProfileStore(device->usbSerial);
+    if(!store->exists() || !device->load(*store)){
+        legacyPrefs = true;
+        QSettings settings;
+        settings.beginGroup(prefsPath);
+        device->load(settings);
+    }
 }
 
 KbWidget::~KbWidget(){
-    saveSettings();
+    if(device){
+        saveSettings();
+        ProfileStore::flush();
+    }
+    delete store;
     delete device;
     delete ui;
 }
 
 void KbWidget::saveSettings(){
-    QSettings settings;
-    settings.remove(prefsPath);
-    settings.beginGroup(prefsPath);
-    device->save(settings);
-    settings.endGroup();
+    saveFailed = false;
+    device->save(*store);
+    if(legacyPrefs){
+        // The old copy of the settings can be removed once everything is in the store. If anything couldn't be written,
+        // keep it and try again on the next save
+        if(!store->commit()){
+            saveFailed = true;
+            return;
+        }
+        legacyPrefs = false;
+        QSettings settings;
+        settings.remove(prefsPath);
+    }
 }
 
 void KbWidget::saveIfNeeded(){
     quint64 now = QDateTime::currentMSecsSinceEpoch();
-    // Auto-save every 10s (if settings have changed)
-    if(device->needsSave() && now >= lastAutoSave + 10 * 1000){
+    if(store->takeFailed())
+        saveFailed = true;
+    // Auto-save every 10s (if settings have changed or the last save failed)
+    if((device->needsSave() || saveFailed) && now >= lastAutoSave + 10 * 1000){
         saveSettings();
         lastAutoSave = now;
     }
@@ -318,6 +341,20 @@ void KbWidget::devUpdate(){
     ui->layoutBox->setCurrentIndex(device->layout());
 }
 
+void KbWidget::updateFrameTiming(){
+    FrameClock* clock = device->frameClock();
+    if(!clock)
+        return;
+    // Always read the jitter so that the next sample only covers the last second
+    FrameClock::Jitter jitter = clock->jitter();
+    if(!isVisible())
+        return;
+    QString text = QString("%1 FPS, jitter %2 ms avg / %3 ms max").arg(clock->rate()).arg(jitter.average, 0, 'f', 2).arg(jitter.worst, 0, 'f', 2);
+    if(jitter.skipped > 0)
+        text += QString(", %1 skipped").arg(jitter.skipped);
+    ui->frameLabel->setText(text);
+}
+
 void KbWidget::modeUpdate(){
     KbLight* currentLight = currentMode->light();
     bool inactiveCheck = (currentLight->inactive() >= 0);
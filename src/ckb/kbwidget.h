@@ -3,6 +3,7 @@
 
 #include <QFile>
 #include <QListWidgetItem>
+#include <QTimer>
 #include <QWidget>
 #include "kb.h"
 
@@ -48,6 +49,16 @@ private:
     QString prefsPath;
     bool _active;
 
+    // Binary settings storage. If the device hasn't been saved to it yet, settings are loaded from QSettings (prefsPath)
+    // and that group is removed after the first save
+    ProfileStore* store;
+    bool legacyPrefs;
+    // Set if the store couldn't be written, so the next auto-save runs even if nothing changed
+    bool saveFailed;
+
+    // Updates the frame timing on the device tab
+    QTimer frameTimer;
+
     const static int GUID = Qt::UserRole;
     const static int NEW_FLAG = Qt::UserRole + 1;
 
@@ -67,6 +78,7 @@ private slots:
     void on_modesList_customContextMenuRequested(const QPoint &pos);
 
     void devUpdate();
+    void updateFrameTiming();
     void modeUpdate();
     void on_hwSaveButton_clicked();
     void on_inactiveSwitchCheck_clicked(bool checked);
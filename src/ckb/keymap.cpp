@@ -1,3 +1,5 @@
+#include <QHash>
+#include <QVector>
 #include "keymap.h"
 
 // Normal size
@@ -70,6 +72,7 @@ static KeyLayout K65Pos[KEYLAYOUT_COUNT] = {
 #define K65_WIDTH       209
 #define K65_HEIGHT      K70_HEIGHT
 
+// Also copied in ckb-daemon/keypos.c
 KeyPos K65TopRow[] = {
     {"Brightness", "light", 164 - K70_X_START, 0, 12, 12}, {"Mute", "mute", 176 - K70_X_START, 0, 12, 12}, {"Volume Down", "voldn", 192 - K70_X_START, 0, 14, 8}, {"Volume Up", "volup", 205 - K70_X_START, 0, 14, 8}, {"Windows Lock", "lock", 222 - K70_X_START, 0, 12, 12}
 };
@@ -143,6 +146,59 @@ QString KeyMap::getModel(KeyMap::Model model){
     }
 }
 
+// Name and ID lookups for each model/layout, built the first time the key map is used
+struct KeyIndex {
+    QHash<QString, int> names;
+    // Key index -> ID
+    QVector<int> ids;
+    // ID -> key index (-1 if not present)
+    QVector<int> indices;
+};
+
+static KeyIndex* K95Index[KEYLAYOUT_COUNT];
+static KeyIndex* K70Index[KEYLAYOUT_COUNT];
+static KeyIndex* K65Index[KEYLAYOUT_COUNT];
+
+// Key IDs by model and position. They're shared by all layouts so that the same position gets the same ID
+static QHash<quint64, int> keyIds;
+
+static int keyId(KeyMap::Model model, const KeyPos& key){
+    // Enter gets a position of its own (see KeyMap::id)
+    quint32 x = key.x, y = key.y;
+    if(!strcmp(key.name, "enter"))
+        x = y = 0xFFFF;
+    quint64 pos = (quint64)model << 32 | (x & 0xFFFF) << 16 | (y & 0xFFFF);
+    QHash<quint64, int>::const_iterator i = keyIds.constFind(pos);
+    if(i != keyIds.constEnd())
+        return i.value();
+    int id = keyIds.count();
+    keyIds[pos] = id;
+    return id;
+}
+
+static const KeyIndex* getIndex(KeyMap::Model model, KeyMap::Layout layout, uint count, const KeyPos* positions){
+    KeyIndex** table = (model == KeyMap::K65) ? K65Index : (model == KeyMap::K70) ? K70Index : K95Index;
+    if(table[layout])
+        return table[layout];
+    KeyIndex* index = new KeyIndex;
+    index->ids.resize(count);
+    for(uint i = 0; i < count; i++){
+        const KeyPos& key = positions[i];
+        // If a name appears twice, the first one wins (same as a linear search)
+        if(!index->names.contains(key.name))
+            index->names[key.name] = i;
+        int id = keyId(model, key);
+        index->ids[i] = id;
+        if(id >= index->indices.count())
+            index->indices.resize(id + 1);
+    }
+    index->indices.fill(-1);
+    for(uint i = count; i > 0; i--)
+        index->indices[index->ids[i - 1]] = i - 1;
+    table[layout] = index;
+    return index;
+}
+
 KeyMap KeyMap::standard(KeyMap::Model model, KeyMap::Layout layout){
     if(model == NO_MODEL || layout == NO_LAYOUT)
         return KeyMap();
@@ -209,12 +265,13 @@ QString KeyMap::name() const {
 }
 
 KeyMap::KeyMap(Model _keyModel, Layout _keyLayout, uint _keyCount, uint _width, const KeyPos* _positions) :
-    positions(_positions), keyCount(_keyCount), keyWidth(_width), keyHeight(K95_HEIGHT),
+    positions(_positions), keyIndex(getIndex(_keyModel, _keyLayout, _keyCount, _positions)),
+    keyCount(_keyCount), keyWidth(_width), keyHeight(K95_HEIGHT),
     keyModel(_keyModel), keyLayout(_keyLayout)
 {}
 
 KeyMap::KeyMap() :
-     positions(0), keyCount(0), keyWidth(0), keyHeight(0),
+     positions(0), keyIndex(0), keyCount(0), keyWidth(0), keyHeight(0),
      keyModel(NO_MODEL), keyLayout(NO_LAYOUT)
 {}
 
@@ -223,25 +280,28 @@ const KeyPos* KeyMap::key(uint index) const {
 }
 
 const KeyPos* KeyMap::key(const QString& name) const {
-    uint c = count();
-    QByteArray rawname = name.toLatin1();
-    const char* cname = rawname.constData();
-    for(uint i = 0; i < c; i++){
-        if(!strcmp(positions[i].name, cname))
-            return positions + i;
-    }
-    return 0;
+    int i = index(name);
+    if(i < 0)
+        return 0;
+    return positions + i;
 }
 
 int KeyMap::index(const QString& name) const {
-    uint c = count();
-    QByteArray rawname = name.toLatin1();
-    const char* cname = rawname.constData();
-    for(uint i = 0; i < c; i++){
-        if(!strcmp(positions[i].name, cname))
-            return i;
-    }
-    return -1;
+    if(!keyIndex)
+        return -1;
+    return keyIndex->names.value(name, -1);
+}
+
+int KeyMap::id(uint index) const {
+    if(!keyIndex || index >= count())
+        return -1;
+    return keyIndex->ids[index];
+}
+
+int KeyMap::indexOfId(int id) const {
+    if(!keyIndex || id < 0 || id >= keyIndex->indices.count())
+        return -1;
+    return keyIndex->indices[id];
 }
 
 QStringList KeyMap::allKeys() const {
@@ -34,6 +34,9 @@ struct KeyPos {
     }
 };
 
+// Lookup tables for a key map (see keymap.cpp)
+struct KeyIndex;
+
 // Key lighting/layout class
 class KeyMap {
 public:
@@ -86,6 +89,12 @@ public:
     const KeyPos* key(const QString& name) const;
     int index(const QString& name) const;
 
+    // Key IDs. A key has the same ID in every layout of the same model as long as it's in the same place, so keys can be
+    // translated between layouts with indexOfId(otherMap.id(index)). The Enter key has its own ID, because its shape
+    // (and LED position) differs between layouts. Returns -1 if not found.
+    int id(uint index) const;
+    int indexOfId(int id) const;
+
     // List of all key names
     QStringList allKeys() const;
 
@@ -93,6 +102,7 @@ public:
 
 private:
     const KeyPos* positions;
+    const KeyIndex* keyIndex;
     uint keyCount :16, keyWidth :16, keyHeight :16;
     Model keyModel :4;
     Layout keyLayout :4;
@@ -6,6 +6,7 @@
 #define KEYCOUNT_K95_104 135
 #define KEYCOUNT_K95_105 136
 
+// ckb-daemon/keypos.c keeps a copy of these positions. Update it as well when changing them
 KeyPos K95PosGB[KEYCOUNT_K95_105] = {
     {0, "mr", 38, 0, NS}, {0, "m1", 50, 0, NS}, {0, "m2", 62, 0, NS}, {0, "m3", 74, 0, NS}, {"Brightness", "light", 222, 0, NS}, {"Windows Lock", "lock", 234, 0, NS}, {"Mute", "mute", 273, 0, 13, 8}, {"Volume Up", "volup", 290, -2, 18, 6}, {"Volume down", "voldn", 290, 2, 18, 6},
     {0, "g1", 0, 14, NS}, {0, "g2", 11, 14, NS}, {0, "g3", 22, 14, NS}, {"Esc", "esc", 38, 14, NS}, {0, "f1", 58, 14, NS}, {0, "f2", 70, 14, NS}, {0, "f3", 82, 14, NS}, {0, "f4", 94, 14, NS}, {0, "f5", 114, 14, NS}, {0, "f6", 126, 14, NS}, {0, "f7", 138, 14, NS}, {0, "f8", 150, 14, NS}, {0, "f9", 170, 14, NS}, {0, "f10", 182, 14, NS}, {0, "f11", 194, 14, NS}, {0, "f12", 206, 14, NS}, {"Print Screen\nSysRq", "prtscn", 222, 14, NS}, {"Scroll Lock", "scroll", 234, 14, NS}, {"Pause\nBreak", "pause", 246, 14, NS}, {"Stop", "stop", 262, 14, 12, 8}, {"Previous", "prev", 273, 14, 13, 8}, {"Play/Pause", "play", 285, 14, 13, 8}, {"Next", "next", 296, 14, 12, 8},
@@ -8,8 +8,14 @@
 
 static const int KEY_SIZE = 12;
 
+static const QColor bgColor(68, 64, 64);
+static const QColor keyColor(112, 110, 110);
+static const QColor highlightColor(136, 176, 240);
+static const QColor highlightAnimColor(136, 200, 240);
+static const QColor animColor(112, 200, 110);
+
 KeyWidget::KeyWidget(QWidget *parent, bool rgbMode) :
-    QWidget(parent), mouseDownX(-1), mouseDownY(-1), mouseCurrentX(-1), mouseCurrentY(-1), mouseDownMode(NONE), _rgbMode(rgbMode)
+    QWidget(parent), mouseDownX(-1), mouseDownY(-1), mouseCurrentX(-1), mouseCurrentY(-1), mouseDownMode(NONE), _rgbMode(rgbMode), keyLayerDirty(true)
 {
     setMouseTracking(true);
 }
@@ -20,28 +26,43 @@ void KeyWidget::map(const KeyMap& newMap){
     newSelection = QBitArray(keyMap.count());
     animation = QBitArray(keyMap.count());
     setFixedSize((keyMap.width() + KEY_SIZE) * 2.3, (keyMap.height() + KEY_SIZE) * 2.3);
+    keyLayerDirty = true;
+    update();
+}
+
+void KeyWidget::rgbMode(bool newRgbMode){
+    _rgbMode = newRgbMode;
+    keyLayerDirty = true;
     update();
 }
 
 void KeyWidget::colorMap(const QHash<QString, QRgb>& newColorMap){
+    if(!_rgbMode || !isVisible() || window()->isMinimized()){
+        // Nothing is on screen, so don't bother finding out what changed. The widget is painted in full when it's shown again
+        _colorMap = newColorMap;
+        update();
+        return;
+    }
+    // Repaint only the keys whose color changed
+    float xScale = (float)width() / (keyMap.width() + KEY_SIZE);
+    float yScale = (float)height() / (keyMap.height() + KEY_SIZE);
+    uint count = keyMap.count();
+    for(uint i = 0; i < count; i++){
+        QString name = keyMap.key(i)->name;
+        if(hasLight(i) && _colorMap.value(name) != newColorMap.value(name))
+            // Leave room for the outline
+            update(lightRect(i, xScale, yScale).toAlignedRect().adjusted(-2, -2, 2, 2));
+    }
     _colorMap = newColorMap;
-    update();
 }
 
 void KeyWidget::bindMap(const QHash<QString, QString>& newBindMap){
     _bindMap = newBindMap;
+    keyLayerDirty = true;
     update();
 }
 
-void KeyWidget::paintEvent(QPaintEvent*){
-    const QColor bgColor(68, 64, 64);
-    const QColor keyColor(112, 110, 110);
-    const QColor highlightColor(136, 176, 240);
-    const QColor highlightAnimColor(136, 200, 240);
-    const QColor animColor(112, 200, 110);
-
-    uint count = keyMap.count();
-
+void KeyWidget::paintEvent(QPaintEvent* event){
     // Determine which keys to highlight
     QBitArray highlight;
     switch(mouseDownMode){
@@ -67,13 +88,17 @@ void KeyWidget::paintEvent(QPaintEvent*){
 #else
     int ratio = 1;
 #endif
-    float xScale = (float)width() / (keyMap.width() + KEY_SIZE) * ratio;
-    float yScale = (float)height() / (keyMap.height() + KEY_SIZE) * ratio;
+    // The keys and their labels are only drawn again when they change (see renderKeys)
+    if(keyLayerDirty || keyLayer.size() != size() * ratio || highlight != layerHighlight || animation != layerAnimation)
+        renderKeys(highlight, ratio);
+    // Only the area that needs updating is painted. Changing the colors only updates the keys that changed
+    QRect area = event->rect();
+
     // Draw background
     painter.setPen(Qt::NoPen);
     painter.setRenderHint(QPainter::Antialiasing, true);
     painter.setBrush(QBrush(bgColor));
-    painter.drawRect(0, 0, width(), height());
+    painter.drawRect(area);
 
     // Draw mouse highlight (if any)
     if(mouseDownMode != NONE && (mouseDownX != mouseCurrentX || mouseDownY != mouseCurrentY)){
@@ -88,8 +113,48 @@ void KeyWidget::paintEvent(QPaintEvent*){
         painter.drawRect(x1, y1, x2 - x1, y2 - y1);
     }
 
+    // Draw keys
+    painter.drawPixmap(area, keyLayer, QRect(area.topLeft() * ratio, area.size() * ratio));
+
+    // Draw key colors (RGB mode)
+    if(_rgbMode){
+        float xScale = (float)width() / (keyMap.width() + KEY_SIZE);
+        float yScale = (float)height() / (keyMap.height() + KEY_SIZE);
+        painter.setPen(QPen(QColor(255, 255, 255), 1.5 / ratio));
+        uint count = keyMap.count();
+        for(uint i = 0; i < count; i++){
+            if(!hasLight(i))
+                continue;
+            QRectF rect = lightRect(i, xScale, yScale);
+            if(!area.intersects(rect.toAlignedRect().adjusted(-1, -1, 1, 1)))
+                continue;
+            painter.setBrush(QBrush(_colorMap.value(keyMap.key(i)->name)));
+            painter.drawEllipse(rect);
+        }
+    }
+}
+
+bool KeyWidget::hasLight(uint index) const {
+    // In RGB mode, ignore volume wheel on K70/K95
+    const KeyPos& key = *keyMap.key(index);
+    return !(keyMap.model() != KeyMap::K65 && (!strcmp(key.name, "volup") || !strcmp(key.name, "voldn")));
+}
+
+QRectF KeyWidget::lightRect(uint index, float xScale, float yScale) const {
+    const KeyPos& key = *keyMap.key(index);
+    float x = key.x + 6.f - 1.8f;
+    float y = key.y + 6.f - 1.8f;
+    float w = 3.6f;
+    float h = 3.6f;
+    return QRectF(x * xScale, y * yScale, w * xScale, h * yScale);
+}
+
+void KeyWidget::renderKeys(const QBitArray& highlight, int ratio){
     // Draw key backgrounds on a separate pixmap so that a drop shadow can be applied to them.
     int wWidth = width(), wHeight = height();
+    float xScale = (float)wWidth / (keyMap.width() + KEY_SIZE) * ratio;
+    float yScale = (float)wHeight / (keyMap.height() + KEY_SIZE) * ratio;
+    uint count = keyMap.count();
     KeyMap::Model model = keyMap.model();
     QPixmap keyBG(wWidth * ratio, wHeight * ratio);
     keyBG.fill(QColor(0, 0, 0, 0));
@@ -152,23 +217,18 @@ void KeyWidget::paintEvent(QPaintEvent*){
     QPainter decPainter(&decoration);
     decPainter.setRenderHints(QPainter::Antialiasing | QPainter::TextAntialiasing);
     if(_rgbMode){
-        // Draw key colors (RGB mode)
+        // Draw the light circles (RGB mode). The colors are painted over them in paintEvent(), so only the shadows matter here
         decPainter.setPen(QPen(QColor(255, 255, 255), 1.5));
+        decPainter.setBrush(QBrush(keyColor));
         for(uint i = 0; i < count; i++){
-            const KeyPos& key = *keyMap.key(i);
-            if(model != KeyMap::K65 && _rgbMode && (!strcmp(key.name, "volup") || !strcmp(key.name, "voldn")))
+            if(!hasLight(i))
                 continue;
-            float x = key.x + 6.f - 1.8f;
-            float y = key.y + 6.f - 1.8f;
-            float w = 3.6f;
-            float h = 3.6f;
-            decPainter.setBrush(QBrush(_colorMap[key.name]));
-            decPainter.drawEllipse(QRectF(x * xScale, y * yScale, w * xScale, h * yScale));
+            decPainter.drawEllipse(lightRect(i, xScale, yScale));
         }
     } else {
         // Draw key names
         decPainter.setBrush(Qt::NoBrush);
-        QFont font = painter.font();
+        QFont font = this->font();
         font.setBold(true);
         font.setPixelSize(5.25f * yScale);
         QFont font0 = font;
@@ -271,15 +331,14 @@ void KeyWidget::paintEvent(QPaintEvent*){
     scene->addItem(bgItem);
     scene->addItem(decItem);
     // It has to be rendered onto yet another pixmap or else DPI scaling will look terrible...
-    QPixmap final(wWidth * ratio, wHeight * ratio);
-    final.fill(QColor(0, 0, 0, 0));
-    QPainter finalPainter(&final);
+    keyLayer = QPixmap(wWidth * ratio, wHeight * ratio);
+    keyLayer.fill(QColor(0, 0, 0, 0));
+    QPainter finalPainter(&keyLayer);
     scene->render(&finalPainter, QRectF(0, 0, wWidth * ratio, wHeight * ratio), QRectF(0, 0, wWidth * ratio, wHeight * ratio));
     delete scene;   // <- Automatically cleans up the rest of the objects
-#if QT_VERSION >= QT_VERSION_CHECK(5, 3, 0)
-    final.setDevicePixelRatio(ratio);
-#endif
-    painter.drawPixmap(QPointF(0., 0.), final);
+    layerHighlight = highlight;
+    layerAnimation = animation;
+    keyLayerDirty = false;
 }
 
 void KeyWidget::mousePressEvent(QMouseEvent* event){
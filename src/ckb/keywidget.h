@@ -4,6 +4,7 @@
 #include <QBitArray>
 #include <QMouseEvent>
 #include <QPaintEvent>
+#include <QPixmap>
 #include <QWidget>
 #include "keymap.h"
 
@@ -14,7 +15,7 @@ public:
     // New key widget. rgbMode = true to display colors, false to display key names
     explicit KeyWidget(QWidget *parent = 0, bool rgbMode = true);
     inline bool rgbMode() { return _rgbMode; }
-    inline void rgbMode(bool newRgbMode) { _rgbMode = newRgbMode; update(); }
+    void rgbMode(bool newRgbMode);
 
     // Key map
     const KeyMap& map() const { return keyMap; }
@@ -59,7 +60,18 @@ private:
     } mouseDownMode;
     bool _rgbMode;
 
-    void paintEvent(QPaintEvent*);
+    // Keys, labels, and shadows. Everything except the background, the mouse selection, and the key colors, which are painted
+    // over it. Rendered again when the size, highlight, or bindings change.
+    QPixmap keyLayer;
+    QBitArray layerHighlight, layerAnimation;
+    bool keyLayerDirty;
+    void renderKeys(const QBitArray& highlight, int ratio);
+
+    // Whether a key has a light drawn on it in RGB mode, and where (scaled to the widget)
+    bool hasLight(uint index) const;
+    QRectF lightRect(uint index, float xScale, float yScale) const;
+
+    void paintEvent(QPaintEvent* event);
     void mousePressEvent(QMouseEvent* event);
     void mouseMoveEvent(QMouseEvent* event);
     void mouseReleaseEvent(QMouseEvent* event);
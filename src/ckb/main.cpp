@@ -1,9 +1,11 @@
 #include "mainwindow.h"
 #include <QApplication>
-#include <QSharedMemory>
+#include <QLocalServer>
+#include <QLocalSocket>
 #include <cstring>
 
-QSharedMemory appShare("ckb");
+// Local server that other instances connect to (see isRunning)
+QLocalServer* appServer = 0;
 
 #ifdef Q_OS_MACX
 // App Nap is an OSX feature designed to save power by putting background apps to sleep.
@@ -12,16 +14,21 @@ extern "C" void disableAppNap();
 #endif
 
 bool isRunning(bool showWindow){
-    if(!appShare.create(16)){
-        if(!appShare.attach() || !appShare.lock())
-            return false;
+    // If another instance is running, connect to it and ask it to show its window (if desired)
+    QLocalSocket socket;
+    socket.connectToServer("ckb");
+    if(socket.waitForConnected(1000)){
         if(showWindow){
-            void* data = appShare.data();
-            snprintf((char*)data, 16, "Open");
+            socket.write("Open\n");
+            socket.waitForBytesWritten(1000);
         }
-        appShare.unlock();
+        socket.disconnectFromServer();
         return true;
     }
+    // Otherwise, start listening. Remove the old socket first in case a previous instance crashed without removing it
+    QLocalServer::removeServer("ckb");
+    appServer = new QLocalServer(qApp);
+    appServer->listen("ckb");
     return false;
 }
 
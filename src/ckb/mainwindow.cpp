@@ -1,12 +1,14 @@
 #include "kbfirmware.h"
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
-#include <QSharedMemory>
+#include <QFileInfo>
+#include <QLocalServer>
+#include <QLocalSocket>
 #include <QShortcut>
 #include <QMessageBox>
 #include <QMenuBar>
 
-extern QSharedMemory appShare;
+extern QLocalServer* appServer;
 
 float ckbGuiVersion = 0.f;
 // Assume daemon has no version limitations if it's not connected
@@ -58,10 +60,24 @@ MainWindow::MainWindow(QWidget *parent) :
 
     connect(qApp, SIGNAL(aboutToQuit()), this, SLOT(cleanup()));
 
+    // Frames are timed by each device (see Kb), so this only needs to run occasionally
     eventTimer = new QTimer(this);
-    eventTimer->setTimerType(Qt::PreciseTimer);
     connect(eventTimer, SIGNAL(timeout()), this, SLOT(timerTick()));
-    eventTimer->start(1000 / 60);
+    eventTimer->start(1000);
+
+    // Rescan devices whenever the connected list changes. The directories above it are watched too, so that the daemon
+    // starting or stopping is noticed (see scanKeyboards)
+    scanTimer = new QTimer(this);
+    scanTimer->setSingleShot(true);
+    scanTimer->setInterval(100);
+    connect(scanTimer, SIGNAL(timeout()), this, SLOT(scanKeyboards()));
+    deviceWatcher = new QFileSystemWatcher(this);
+    deviceWatcher->addPath(QFileInfo(devpath.arg(0)).absolutePath());
+    connect(deviceWatcher, SIGNAL(fileChanged(QString)), this, SLOT(devicesChanged()));
+    connect(deviceWatcher, SIGNAL(directoryChanged(QString)), this, SLOT(devicesChanged()));
+
+    if(appServer)
+        connect(appServer, SIGNAL(newConnection()), this, SLOT(instanceConnected()));
 
     QCoreApplication::setOrganizationName("ckb");
 
@@ -72,9 +88,18 @@ MainWindow::MainWindow(QWidget *parent) :
     scanKeyboards();
 }
 
+void MainWindow::devicesChanged(){
+    scanTimer->start();
+}
+
 void MainWindow::scanKeyboards(){
     QString rootdev = devpath.arg(0);
     QFile connected(rootdev + "/connected");
+    // The root controller and the file are recreated when the daemon restarts, which removes them from the watcher
+    if(QFileInfo(rootdev).isDir() && !deviceWatcher->directories().contains(rootdev))
+        deviceWatcher->addPath(rootdev);
+    if(connected.exists() && !deviceWatcher->files().contains(connected.fileName()))
+        deviceWatcher->addPath(connected.fileName());
     if(!connected.open(QIODevice::ReadOnly)){
         // No root controller - remove all keyboards
         while(ui->tabWidget->count() > 1)
@@ -127,34 +152,12 @@ void MainWindow::scanKeyboards(){
         ui->tabWidget->insertTab(count - 1, widget, widget->name());
         if(ui->tabWidget->currentIndex() == count)
             ui->tabWidget->setCurrentIndex(count - 1);
-        connect(eventTimer, SIGNAL(timeout()), widget->device, SLOT(frameUpdate()));
     }
     connected.close();
 
     // Remove any devices not found in the connected list
-    bool updateShown = false;
     foreach(KbWidget* w, kbWidgets){
-        if(w->isActive()){
-            if(!updateShown){
-                // Display firmware upgrade notification if a new version is available (and user has automatic updates enabled)
-                QSettings settings;
-                if(settings.value("Program/DisableAutoFWCheck").toBool())
-                    continue;
-                float version = KbFirmware::versionForBoard(w->device->features);
-                if(version > w->device->firmware.toFloat()){
-                    if(w->hasShownNewFW)
-                        continue;
-                    w->hasShownNewFW = true;
-                    w->updateFwButton();
-                    // Don't display more than one of these at once
-                    updateShown = true;
-                    // Don't run this method here because it will lock up the timer and prevent devices from working properly
-                    // Use a queued invocation instead
-                    metaObject()->invokeMethod(this, "showFwUpdateNotification", Qt::QueuedConnection, Q_ARG(QWidget*, w), Q_ARG(float, version));
-                }
-            }
-            w->saveIfNeeded();
-        } else {
+        if(!w->isActive()){
             int i = kbWidgets.indexOf(w);
             ui->tabWidget->removeTab(i);
             kbWidgets.removeAt(i);
@@ -208,25 +211,48 @@ void MainWindow::closeEvent(QCloseEvent *event){
 }
 
 void MainWindow::timerTick(){
-    // Check if another instance requested this in the foreground
-    if(appShare.lock()){
-        void* data = appShare.data();
-        if((QString)QByteArray((const char*)data) == "Open")
-            showWindow();
-        // Remove the request
-        *(char*)data = 0;
-        appShare.unlock();
-    }
     // Check for firmware updates (when appropriate)
-    QSettings settings;
-    if(!settings.value("Program/DisableAutoFWCheck").toBool())
+    bool autoFwCheck = settingsWidget->autoFwCheck();
+    if(autoFwCheck)
         KbFirmware::checkUpdates();
-    // Scan for connected/disconnected keyboards
-    scanKeyboards();
+    bool updateShown = false;
+    foreach(KbWidget* w, kbWidgets){
+        if(!w->isActive())
+            continue;
+        if(autoFwCheck && !updateShown){
+            // Display firmware upgrade notification if a new version is available
+            float version = KbFirmware::versionForBoard(w->device->features);
+            if(version > w->device->firmware.toFloat() && !w->hasShownNewFW){
+                w->hasShownNewFW = true;
+                w->updateFwButton();
+                // Don't display more than one of these at once
+                updateShown = true;
+                // Don't run this method here because it will lock up the timer and prevent devices from working properly
+                // Use a queued invocation instead
+                metaObject()->invokeMethod(this, "showFwUpdateNotification", Qt::QueuedConnection, Q_ARG(QWidget*, w), Q_ARG(float, version));
+            }
+        }
+        w->saveIfNeeded();
+    }
     // Poll for setting updates
     settingsWidget->pollUpdates();
 }
 
+void MainWindow::instanceConnected(){
+    QLocalSocket* socket;
+    while((socket = appServer->nextPendingConnection())){
+        connect(socket, SIGNAL(readyRead()), this, SLOT(instanceRequest()));
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+    }
+}
+
+void MainWindow::instanceRequest(){
+    // The new instance asks for the window to be shown unless it was started in the background
+    QLocalSocket* socket = qobject_cast<QLocalSocket*>(sender());
+    if(socket && socket->readAll().contains("Open"))
+        showWindow();
+}
+
 void MainWindow::iconClicked(QSystemTrayIcon::ActivationReason reason){
     if(reason == QSystemTrayIcon::Trigger || reason == QSystemTrayIcon::DoubleClick)
         showWindow();
@@ -2,6 +2,7 @@
 #define MAINWINDOW_H
 
 #include <QCloseEvent>
+#include <QFileSystemWatcher>
 #include <QMainWindow>
 #include <QMenu>
 #include <QSystemTrayIcon>
@@ -39,7 +40,6 @@ public:
     explicit MainWindow(QWidget *parent = 0);
     ~MainWindow();
 
-    void scanKeyboards();
     SettingsWidget* settingsWidget;
     QList<KbWidget*> kbWidgets;
 
@@ -53,8 +53,18 @@ public:
 
     static MainWindow* mainWindow;
 
+public slots:
+    // Adds and removes devices according to the daemon's list of connected devices
+    void scanKeyboards();
+
 private slots:
+    // Periodic tasks (auto-save, firmware notifications)
     void timerTick();
+    // The list of connected devices (or the daemon itself) changed
+    void devicesChanged();
+    // Another instance of ckb was started
+    void instanceConnected();
+    void instanceRequest();
     void iconClicked(QSystemTrayIcon::ActivationReason reason);
     void showWindow();
     void quitApp();
@@ -63,6 +73,11 @@ private slots:
 
 private:
     Ui::MainWindow *ui;
+
+    // Watches the daemon's list of connected devices. Changes are collected for a short time before scanning, as the list
+    // is written in several steps.
+    QFileSystemWatcher* deviceWatcher;
+    QTimer* scanTimer;
 };
 
 #endif // MAINWINDOW_H
@@ -23,4 +23,19 @@ ENUM_C(muteState) {
 } ENUM_END_C(muteState);
 EXTERN_C muteState getMuteState();
 
+#if defined(__cplusplus) && !defined(__APPLE__)
+
+// Source of the mute state on Linux. The default follows PulseAudio (see media_pulse.h), but it can be replaced, e.g. with
+// a stub that doesn't need a sound server.
+class MuteBackend {
+public:
+    virtual ~MuteBackend() {}
+    // Returns the last known state. Called every frame from the devices' frame threads, so it must not block
+    virtual muteState state() = 0;
+};
+// Replaces the current backend. The backend is not deleted by getMuteState(); pass null to go back to the default one
+void setMuteBackend(MuteBackend* backend);
+
+#endif
+
 #endif
@@ -0,0 +1,92 @@
+#include <QTimer>
+#include "media_pulse.h"
+
+PulseMute::PulseMute(QObject* parent) :
+    QObject(parent), _state(UNKNOWN), queryAgain(false), restarting(false)
+{
+    connect(&subscriber, SIGNAL(readyReadStandardOutput()), this, SLOT(readEvents()));
+    connect(&subscriber, SIGNAL(finished(int)), this, SLOT(subscriberStopped()));
+    connect(&subscriber, SIGNAL(error(QProcess::ProcessError)), this, SLOT(subscriberStopped()));
+    connect(&querier, SIGNAL(finished(int)), this, SLOT(queryFinished()));
+    connect(&querier, SIGNAL(error(QProcess::ProcessError)), this, SLOT(queryFinished()));
+    subscribe();
+}
+
+PulseMute::~PulseMute(){
+    subscriber.disconnect(this);
+    querier.disconnect(this);
+    subscriber.kill();
+    querier.kill();
+    subscriber.waitForFinished(1000);
+    querier.waitForFinished(1000);
+}
+
+void PulseMute::subscribe(){
+    restarting = false;
+    if(subscriber.state() != QProcess::NotRunning)
+        return;
+    subscriber.start("pactl", QStringList() << "subscribe", QIODevice::ReadOnly);
+    // Changes made before the subscription started aren't reported, so read the state now
+    query();
+}
+
+void PulseMute::subscriberStopped(){
+    // Both finished() and error() may arrive for the same exit, only restart once
+    if(restarting || subscriber.state() != QProcess::NotRunning)
+        return;
+    restarting = true;
+    _state.store(UNKNOWN);
+    QTimer::singleShot(RETRY_DELAY, this, SLOT(subscribe()));
+}
+
+void PulseMute::readEvents(){
+    // Lines look like "Event 'change' on sink #0". Only sink and server events can change the default sink's mute state
+    bool changed = false;
+    while(subscriber.canReadLine()){
+        QByteArray line = subscriber.readLine();
+        if(line.contains(" on sink ") || line.contains(" on server"))
+            changed = true;
+    }
+    if(changed)
+        query();
+}
+
+void PulseMute::query(){
+    if(querier.state() != QProcess::NotRunning){
+        queryAgain = true;
+        return;
+    }
+    queryAgain = false;
+    querier.start("pacmd", QStringList() << "list-sinks", QIODevice::ReadOnly);
+}
+
+void PulseMute::queryFinished(){
+    if(querier.state() != QProcess::NotRunning)
+        return;
+    if(querier.exitStatus() != QProcess::NormalExit || querier.exitCode() != 0){
+        querier.readAll();
+        _state.store(UNKNOWN);
+    } else {
+        // The default sink is the one marked "* index: N". Find its "muted: yes/no" line
+        muteState newState = UNKNOWN;
+        bool isDefault = false;
+        while(querier.canReadLine()){
+            QByteArray line = querier.readLine().trimmed();
+            if(line.startsWith("* index:"))
+                isDefault = true;
+            else if(line.startsWith("index:"))
+                isDefault = false;
+            else if(isDefault && line.startsWith("muted:")){
+                QByteArray value = line.mid(6).trimmed();
+                if(value == "yes")
+                    newState = MUTED;
+                else if(value == "no")
+                    newState = UNMUTED;
+            }
+        }
+        querier.readAll();
+        _state.store(newState);
+    }
+    if(queryAgain)
+        query();
+}
@@ -0,0 +1,43 @@
+#ifndef MEDIA_PULSE_H
+#define MEDIA_PULSE_H
+
+#include <QAtomicInt>
+#include <QObject>
+#include <QProcess>
+#include "media.h"
+
+// Follows the default PulseAudio sink's mute state. Keeps a "pactl subscribe" process running and only asks for the state
+// again when it reports a change to a sink or to the server (e.g. a new default sink).
+
+class PulseMute : public QObject, public MuteBackend
+{
+    Q_OBJECT
+public:
+    PulseMute(QObject* parent);
+    ~PulseMute();
+
+    // Read by the devices' frame threads
+    inline muteState state() { return (muteState)_state.load(); }
+
+private slots:
+    // Starts (or restarts) the subscription
+    void subscribe();
+    void subscriberStopped();
+    void readEvents();
+    // Reads the current state
+    void query();
+    void queryFinished();
+
+private:
+    QProcess subscriber, querier;
+    QAtomicInt _state;
+    // Whether the state changed again while it was being read
+    bool queryAgain;
+    // Whether a restart is already scheduled
+    bool restarting;
+
+    // Delay before restarting the subscription if pactl exits or can't be found (ms)
+    const static int RETRY_DELAY = 5000;
+};
+
+#endif // MEDIA_PULSE_H
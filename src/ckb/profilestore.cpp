@@ -0,0 +1,139 @@
+#include <QDir>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThreadPool>
+#include "profilestore.h"
+
+const QString ProfileStore::DEVICE_RECORD = "device";
+
+// Every record starts with this, followed by the format version
+static const quint32 RECORD_MAGIC = 0x706b6263;
+static const quint32 RECORD_VERSION = 1;
+static const QDataStream::Version STREAM_VERSION = QDataStream::Qt_5_0;
+
+// Records are written one at a time, so that two writes to the same record always finish in order
+static QThreadPool* writePool(){
+    static QThreadPool* pool = 0;
+    if(!pool){
+        pool = new QThreadPool;
+        pool->setMaxThreadCount(1);
+    }
+    return pool;
+}
+
+class ProfileStore::WriteTask : public QRunnable {
+public:
+    WriteTask(ProfileStore* store, const QString& name, const QByteArray& data) : store(store), name(name), data(data) {}
+
+    void run(){
+        // Write to a temporary file first so that a crash doesn't leave a partial record behind
+        QString path = store->path + "/" + name;
+        QSaveFile file(path);
+        if(!file.open(QIODevice::WriteOnly) || file.write(data) != data.size() || !file.commit()){
+            qWarning("Unable to write %s", path.toLocal8Bit().constData());
+            QMutexLocker locker(&store->failLock);
+            store->failed << name;
+        }
+    }
+
+private:
+    ProfileStore* store;
+    QString name;
+    QByteArray data;
+};
+
+ProfileStore::ProfileStore(const QString& serial) :
+    path(QStandardPaths::writableLocation(QStandardPaths::DataLocation) + "/profiles/" + serial)
+{
+    QDir dir(path);
+    foreach(const QString& name, dir.entryList(QDir::Files))
+        records.insert(name);
+}
+
+ProfileStore::~ProfileStore(){
+    // The write tasks refer to the store
+    flush();
+}
+
+bool ProfileStore::exists() const {
+    return records.contains(DEVICE_RECORD);
+}
+
+ProfileStore::Reader::Reader(const ProfileStore& store, const QString& name) :
+    file(store.path + "/" + name), map(0), valid(false)
+{
+    if(!store.records.contains(name) || !file.open(QIODevice::ReadOnly) || file.size() == 0)
+        return;
+    map = file.map(0, file.size());
+    if(!map)
+        return;
+    // The stream reads from the mapping without copying it. It's valid until the reader is deleted
+    buffer.setData(QByteArray::fromRawData((const char*)map, file.size()));
+    buffer.open(QIODevice::ReadOnly);
+    stream.setDevice(&buffer);
+    stream.setVersion(STREAM_VERSION);
+    quint32 magic, version;
+    stream >> magic >> version;
+    valid = (stream.status() == QDataStream::Ok && magic == RECORD_MAGIC && version == RECORD_VERSION);
+}
+
+ProfileStore::Reader::~Reader(){
+    stream.setDevice(0);
+    buffer.close();
+    if(map)
+        file.unmap(map);
+}
+
+ProfileStore::Writer::Writer(ProfileStore& store, const QString& name) :
+    store(store), name(name)
+{
+    buffer.setBuffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    stream.setDevice(&buffer);
+    stream.setVersion(STREAM_VERSION);
+    stream << RECORD_MAGIC << RECORD_VERSION;
+}
+
+ProfileStore::Writer::~Writer(){
+    stream.setDevice(0);
+    buffer.close();
+    store.write(name, data);
+}
+
+void ProfileStore::write(const QString& name, const QByteArray& data){
+    if(records.isEmpty())
+        QDir().mkpath(path);
+    records.insert(name);
+    writePool()->start(new WriteTask(this, name, data));
+}
+
+bool ProfileStore::takeFailed(){
+    QMutexLocker locker(&failLock);
+    if(failed.isEmpty())
+        return false;
+    foreach(const QString& name, failed)
+        records.remove(name);
+    failed.clear();
+    return true;
+}
+
+void ProfileStore::removeExcept(const QStringList& keep){
+    QStringList remove;
+    foreach(const QString& name, records){
+        if(!keep.contains(name))
+            remove << name;
+    }
+    if(remove.isEmpty())
+        return;
+    // Wait for pending writes in case one of them is to a removed record
+    flush();
+    foreach(const QString& name, remove){
+        QFile::remove(path + "/" + name);
+        records.remove(name);
+    }
+}
+
+void ProfileStore::flush(){
+    writePool()->waitForDone();
+}
@@ -0,0 +1,85 @@
+#ifndef PROFILESTORE_H
+#define PROFILESTORE_H
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QDataStream>
+#include <QFile>
+#include <QMutex>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+
+// Binary storage for a device's settings. Each profile is kept in its own record (file) and the device's profile list in
+// another, so only the profiles which changed need to be written. Records are written in the background.
+
+class ProfileStore
+{
+public:
+    // Opens the store for the device with the given serial number
+    explicit ProfileStore(const QString& serial);
+    // Waits for the store's writes to finish
+    ~ProfileStore();
+
+    // Whether the device has been saved to the store before. If not, settings should be read from QSettings instead
+    bool exists() const;
+    // Whether a record exists
+    inline bool contains(const QString& name) const { return records.contains(name); }
+
+    // Reads a record. The data is read directly from the memory-mapped file
+    class Reader {
+    public:
+        Reader(const ProfileStore& store, const QString& name);
+        ~Reader();
+        // False if the record doesn't exist or is from an incompatible version
+        inline bool isValid() const { return valid; }
+        QDataStream stream;
+
+    private:
+        QFile file;
+        uchar* map;
+        QBuffer buffer;
+        bool valid;
+    };
+
+    // Writes a record. The stream is written to the store when the Writer is deleted
+    class Writer {
+    public:
+        Writer(ProfileStore& store, const QString& name);
+        ~Writer();
+        QDataStream stream;
+
+    private:
+        ProfileStore& store;
+        QString name;
+        QByteArray data;
+        QBuffer buffer;
+    };
+
+    // Deletes all records except for the given ones
+    void removeExcept(const QStringList& keep);
+
+    // Returns true if any writes failed since the last call. The records that failed are forgotten (see contains()), so
+    // they'll be written again on the next save
+    bool takeFailed();
+    // Waits for all pending writes and returns true if every record was written successfully
+    inline bool commit() { flush(); return !takeFailed(); }
+
+    // Waits for all stores to finish writing
+    static void flush();
+
+    // Name of the record containing the profile list
+    static const QString DEVICE_RECORD;
+
+private:
+    QString path;
+    QSet<QString> records;
+    // Records which couldn't be written. Added to by the write thread
+    QMutex failLock;
+    QStringList failed;
+
+    class WriteTask;
+    void write(const QString& name, const QByteArray& data);
+};
+
+#endif // PROFILESTORE_H
@@ -2,12 +2,12 @@
 #include "ui_settingswidget.h"
 #include "animscript.h"
 #include "autorun.h"
+#include "kb.h"
 #include "kblight.h"
 #include "mainwindow.h"
 #include <unistd.h>
 
 extern QString devpath;
-extern QTimer* eventTimer;
 
 // Animation FPS
 int framerate = 30;
@@ -113,7 +113,12 @@ SettingsWidget::SettingsWidget(QWidget *parent) :
         ui->loginItemBox->setChecked(AutoRun::isEnabled());
     }
 
+    // Read animation plugin setting (default = off, executables only)
+    AnimScript::pluginsEnabled(settings.value("AnimPlugins").toBool());
+    ui->animPluginBox->setChecked(AnimScript::pluginsEnabled());
+
     ui->animPathLabel->setText(AnimScript::path());
+    connect(AnimScanner::instance(), SIGNAL(finished()), this, SLOT(animScanFinished()));
     on_animScanButton_clicked();
 }
 
@@ -127,6 +132,10 @@ void SettingsWidget::pollUpdates(){
     }
 }
 
+bool SettingsWidget::autoFwCheck() const {
+    return ui->autoFWBox->isChecked();
+}
+
 SettingsWidget::~SettingsWidget(){
     delete ui;
 }
@@ -165,11 +174,8 @@ void SettingsWidget::on_pushButton_clicked(){
 }
 
 void SettingsWidget::on_fpsBox_activated(const QString &arg1){
-    if(!eventTimer)
-        return;
     // Set FPS
     framerate = arg1.split(" ")[0].toInt();
-    eventTimer->setInterval(1000 / framerate);
     QSettings settings;
     settings.beginGroup("Program");
     settings.setValue("framerate", framerate);
@@ -179,10 +185,17 @@ void SettingsWidget::on_fpsBox_activated(const QString &arg1){
         cmd.write(QString("fps %1\n").arg(framerate).toLatin1());
         cmd.close();
     }
+    // Devices follow the daemon's rate
+    Kb::frameRateChanged();
 }
 
 void SettingsWidget::on_animScanButton_clicked(){
+    // The count is shown when the scan finishes
+    ui->animCountLabel->setText("Scanning...");
     AnimScript::scan();
+}
+
+void SettingsWidget::animScanFinished(){
     int count = AnimScript::count();
     if(count == 0)
         ui->animCountLabel->setText("No animations found");
@@ -192,6 +205,13 @@ void SettingsWidget::on_animScanButton_clicked(){
         ui->animCountLabel->setText(QString("%1 animations found").arg(count));
 }
 
+void SettingsWidget::on_animPluginBox_clicked(bool checked){
+    QSettings settings;
+    settings.setValue("Program/AnimPlugins", checked);
+    AnimScript::pluginsEnabled(checked);
+    on_animScanButton_clicked();
+}
+
 void SettingsWidget::on_capsBox_activated(int index){
     updateModifiers();
 }
@@ -22,11 +22,16 @@ public:
     // Poll for setting updates and save (if necessary)
     void pollUpdates();
 
+    // Whether automatic firmware update checks are enabled
+    bool autoFwCheck() const;
+
 private slots:
     void on_pushButton_clicked();
 
     void on_fpsBox_activated(const QString &arg1);
     void on_animScanButton_clicked();
+    void animScanFinished();
+    void on_animPluginBox_clicked(bool checked);
 
     void on_capsBox_activated(int index);
     void on_shiftBox_activated(int index);